@@ -0,0 +1,476 @@
+/*
+ * main.c
+ * Copyright (C) 2026 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#include "virtual_mem.h"
+#include <yaf/fat32.h>
+#include <yaf/utils.h>
+#include <xcore/fs/utils.h>
+#include <xcore/helpers.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_CLUSTER_SIZE
+#  define BENCH_CLUSTER_SIZE  CONFIG_CLUSTER_SIZE
+#else
+#  define BENCH_CLUSTER_SIZE  4096
+#endif
+
+#define BENCH_CHUNK_SIZE      4096
+#define BENCH_FILE_SIZE       (4 * 1024 * 1024)
+#define BENCH_NODE_COUNT      256
+#define BENCH_NODE_POOL_SIZE  4
+#define BENCH_RANDOM_COUNT    1024
+#define BENCH_TABLE_COUNT     2
+#define BENCH_TOTAL_SIZE      (64 * 1024 * 1024)
+#define BENCH_USAGE_COUNT     16
+
+#define PATH_DIR              "/DIR"
+#define PATH_FILE             "/FILE.BIN"
+/*----------------------------------------------------------------------------*/
+struct BenchContext
+{
+  struct Interface *interface;
+  struct FsHandle *handle;
+  uint8_t *buffer;
+  uint32_t seed;
+};
+
+struct BenchResult
+{
+  /* Completed file system operations */
+  uint64_t operations;
+  /* Payload bytes transferred */
+  uint64_t bytes;
+};
+
+struct BenchScenario
+{
+  const char *name;
+  bool (*run)(struct BenchContext *, struct BenchResult *);
+};
+/*----------------------------------------------------------------------------*/
+static double getTime(void);
+static bool makeNode(struct FsHandle *, const char *, bool);
+static void makeNodeName(char *, size_t);
+static uint32_t makeRandom(struct BenchContext *);
+static bool runScenario(struct BenchContext *, const struct BenchScenario *);
+
+static bool benchCreate(struct BenchContext *, struct BenchResult *);
+static bool benchDirList(struct BenchContext *, struct BenchResult *);
+static bool benchRandomRead(struct BenchContext *, struct BenchResult *);
+static bool benchRandomWrite(struct BenchContext *, struct BenchResult *);
+static bool benchRemove(struct BenchContext *, struct BenchResult *);
+static bool benchSequentialRead(struct BenchContext *, struct BenchResult *);
+static bool benchSequentialWrite(struct BenchContext *, struct BenchResult *);
+static bool benchUsage(struct BenchContext *, struct BenchResult *);
+/*----------------------------------------------------------------------------*/
+static const struct BenchScenario scenarios[] = {
+    {"seq_write", benchSequentialWrite},
+    {"seq_read", benchSequentialRead},
+    {"rand_write", benchRandomWrite},
+    {"rand_read", benchRandomRead},
+    {"create", benchCreate},
+    {"dir_list", benchDirList},
+    {"remove", benchRemove},
+    {"usage", benchUsage}
+};
+/*----------------------------------------------------------------------------*/
+static double getTime(void)
+{
+  struct timespec time;
+
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+/*----------------------------------------------------------------------------*/
+static bool makeNode(struct FsHandle *handle, const char *path, bool dir)
+{
+  struct FsNode * const parent = fsOpenBaseNode(handle, path);
+
+  if (parent == NULL)
+    return false;
+
+  const char * const name = fsExtractName(path);
+  const struct FsFieldDescriptor desc[] = {
+      {
+          name,
+          strlen(name) + 1,
+          FS_NODE_NAME
+      }, {
+          NULL,
+          0,
+          FS_NODE_DATA
+      }
+  };
+  const size_t count = dir ? ARRAY_SIZE(desc) - 1 : ARRAY_SIZE(desc);
+  const enum Result res = fsNodeCreate(parent, desc, count);
+
+  fsNodeFree(parent);
+  return res == E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static void makeNodeName(char *name, size_t index)
+{
+  sprintf(name, "F%05u_LONG_NAME.TXT", (unsigned int)index);
+}
+/*----------------------------------------------------------------------------*/
+static uint32_t makeRandom(struct BenchContext *context)
+{
+  /* Xorshift generator with a fixed seed for reproducible access patterns */
+  uint32_t value = context->seed;
+
+  value ^= value << 13;
+  value ^= value >> 17;
+  value ^= value << 5;
+
+  context->seed = value;
+  return value;
+}
+/*----------------------------------------------------------------------------*/
+static bool runScenario(struct BenchContext *context,
+    const struct BenchScenario *scenario)
+{
+  struct BenchResult result = {0, 0};
+  struct VirtualMemStats stats;
+
+  vmemResetStats(context->interface);
+
+  const double begin = getTime();
+  const bool completed = scenario->run(context, &result);
+  const double elapsed = getTime() - begin;
+
+  if (!completed || !result.operations)
+  {
+    fprintf(stderr, "benchmark %s failed\n", scenario->name);
+    return false;
+  }
+
+  vmemGetStats(context->interface, &stats);
+
+  const double operations = (double)result.operations;
+
+  const double simulated = (double)stats.time / 1e9;
+
+  printf("{\"scenario\": \"%s\", \"operations\": %"PRIu64", "
+      "\"seconds\": %.6f, \"ops_per_s\": %.1f, \"bytes_per_s\": %.1f, "
+      "\"sim_seconds\": %.6f, \"sim_ops_per_s\": %.1f, "
+      "\"sim_bytes_per_s\": %.1f, "
+      "\"reads_per_op\": %.3f, \"writes_per_op\": %.3f, "
+      "\"read_bytes_per_op\": %.1f, \"written_bytes_per_op\": %.1f}\n",
+      scenario->name, result.operations, elapsed,
+      operations / elapsed, (double)result.bytes / elapsed,
+      simulated, operations / simulated, (double)result.bytes / simulated,
+      (double)stats.reads / operations, (double)stats.writes / operations,
+      (double)stats.readBytes / operations,
+      (double)stats.writtenBytes / operations);
+
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+static bool benchCreate(struct BenchContext *context,
+    struct BenchResult *result)
+{
+  struct FsNode * const parent = fsOpenNode(context->handle, PATH_DIR);
+
+  if (parent == NULL)
+    return false;
+
+  for (size_t i = 0; i < BENCH_NODE_COUNT; ++i)
+  {
+    char name[FS_NAME_LENGTH];
+
+    makeNodeName(name, i);
+
+    const struct FsFieldDescriptor desc[] = {
+        {
+            name,
+            strlen(name) + 1,
+            FS_NODE_NAME
+        }, {
+            NULL,
+            0,
+            FS_NODE_DATA
+        }
+    };
+
+    if (fsNodeCreate(parent, desc, ARRAY_SIZE(desc)) != E_OK)
+      break;
+
+    ++result->operations;
+  }
+
+  fsNodeFree(parent);
+  return result->operations == BENCH_NODE_COUNT;
+}
+/*----------------------------------------------------------------------------*/
+static bool benchDirList(struct BenchContext *context,
+    struct BenchResult *result)
+{
+  struct FsNode * const parent = fsOpenNode(context->handle, PATH_DIR);
+
+  if (parent == NULL)
+    return false;
+
+  struct FsNode * const node = fsNodeHead(parent);
+
+  fsNodeFree(parent);
+  if (node == NULL)
+    return false;
+
+  do
+  {
+    char name[FS_NAME_LENGTH];
+    size_t count;
+
+    if (fsNodeRead(node, FS_NODE_NAME, 0, name, sizeof(name), &count) != E_OK)
+      break;
+
+    ++result->operations;
+  }
+  while (fsNodeNext(node) == E_OK);
+
+  fsNodeFree(node);
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+static bool benchRandomRead(struct BenchContext *context,
+    struct BenchResult *result)
+{
+  struct FsNode * const node = fsOpenNode(context->handle, PATH_FILE);
+
+  if (node == NULL)
+    return false;
+
+  for (size_t i = 0; i < BENCH_RANDOM_COUNT; ++i)
+  {
+    const FsLength position = (FsLength)(makeRandom(context)
+        % (BENCH_FILE_SIZE / CONFIG_SECTOR_SIZE)) * CONFIG_SECTOR_SIZE;
+    size_t count;
+
+    if (fsNodeRead(node, FS_NODE_DATA, position, context->buffer,
+        CONFIG_SECTOR_SIZE, &count) != E_OK || count != CONFIG_SECTOR_SIZE)
+    {
+      break;
+    }
+
+    ++result->operations;
+    result->bytes += count;
+  }
+
+  fsNodeFree(node);
+  return result->operations == BENCH_RANDOM_COUNT;
+}
+/*----------------------------------------------------------------------------*/
+static bool benchRandomWrite(struct BenchContext *context,
+    struct BenchResult *result)
+{
+  struct FsNode * const node = fsOpenNode(context->handle, PATH_FILE);
+
+  if (node == NULL)
+    return false;
+
+  for (size_t i = 0; i < BENCH_RANDOM_COUNT; ++i)
+  {
+    const FsLength position = (FsLength)(makeRandom(context)
+        % (BENCH_FILE_SIZE / CONFIG_SECTOR_SIZE)) * CONFIG_SECTOR_SIZE;
+    size_t count;
+
+    if (fsNodeWrite(node, FS_NODE_DATA, position, context->buffer,
+        CONFIG_SECTOR_SIZE, &count) != E_OK || count != CONFIG_SECTOR_SIZE)
+    {
+      break;
+    }
+
+    ++result->operations;
+    result->bytes += count;
+  }
+
+  fsNodeFree(node);
+  return result->operations == BENCH_RANDOM_COUNT
+      && fsHandleSync(context->handle) == E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static bool benchRemove(struct BenchContext *context,
+    struct BenchResult *result)
+{
+  struct FsNode * const parent = fsOpenNode(context->handle, PATH_DIR);
+
+  if (parent == NULL)
+    return false;
+
+  for (size_t i = 0; i < BENCH_NODE_COUNT; ++i)
+  {
+    char path[FS_NAME_LENGTH + sizeof(PATH_DIR)];
+
+    strcpy(path, PATH_DIR "/");
+    makeNodeName(path + strlen(path), i);
+
+    struct FsNode * const node = fsOpenNode(context->handle, path);
+
+    if (node == NULL)
+      break;
+
+    const enum Result res = fsNodeRemove(parent, node);
+
+    fsNodeFree(node);
+    if (res != E_OK)
+      break;
+
+    ++result->operations;
+  }
+
+  fsNodeFree(parent);
+  return result->operations == BENCH_NODE_COUNT;
+}
+/*----------------------------------------------------------------------------*/
+static bool benchSequentialRead(struct BenchContext *context,
+    struct BenchResult *result)
+{
+  struct FsNode * const node = fsOpenNode(context->handle, PATH_FILE);
+
+  if (node == NULL)
+    return false;
+
+  for (FsLength position = 0; position < BENCH_FILE_SIZE;)
+  {
+    size_t count;
+
+    if (fsNodeRead(node, FS_NODE_DATA, position, context->buffer,
+        BENCH_CHUNK_SIZE, &count) != E_OK || count != BENCH_CHUNK_SIZE)
+    {
+      break;
+    }
+
+    position += count;
+    ++result->operations;
+    result->bytes += count;
+  }
+
+  fsNodeFree(node);
+  return result->bytes == BENCH_FILE_SIZE;
+}
+/*----------------------------------------------------------------------------*/
+static bool benchSequentialWrite(struct BenchContext *context,
+    struct BenchResult *result)
+{
+  struct FsNode * const node = fsOpenNode(context->handle, PATH_FILE);
+
+  if (node == NULL)
+    return false;
+
+  for (FsLength position = 0; position < BENCH_FILE_SIZE;)
+  {
+    size_t count;
+
+    if (fsNodeWrite(node, FS_NODE_DATA, position, context->buffer,
+        BENCH_CHUNK_SIZE, &count) != E_OK || count != BENCH_CHUNK_SIZE)
+    {
+      break;
+    }
+
+    position += count;
+    ++result->operations;
+    result->bytes += count;
+  }
+
+  fsNodeFree(node);
+  return result->bytes == BENCH_FILE_SIZE
+      && fsHandleSync(context->handle) == E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static bool benchUsage(struct BenchContext *context,
+    struct BenchResult *result)
+{
+  for (size_t i = 0; i < BENCH_USAGE_COUNT; ++i)
+  {
+    FsCapacity used;
+
+    if (fat32GetUsage(context->handle, context->buffer, BENCH_CHUNK_SIZE,
+        &used) != E_OK)
+    {
+      return false;
+    }
+
+    ++result->operations;
+  }
+
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+int main(void)
+{
+  /* Timing model of a memory card with a flash translation layer */
+  static const struct VirtualMemConfig vmemConfig = {
+      .size = BENCH_TOTAL_SIZE,
+      .latency = 100000,
+      .bandwidth = 20 * 1024 * 1024,
+      .block = 16384,
+      .rewrite = 1000000,
+      .stallRate = 1000,
+      .stall = 50000000
+  };
+  static const struct Fat32FsConfig makeFsConfig = {
+      .cluster = BENCH_CLUSTER_SIZE,
+      .tables = BENCH_TABLE_COUNT
+  };
+
+  struct BenchContext context = {
+      .interface = NULL,
+      .handle = NULL,
+      .buffer = NULL,
+      .seed = 0x12345678UL
+  };
+  int status = EXIT_FAILURE;
+
+  context.buffer = malloc(BENCH_CHUNK_SIZE);
+  if (context.buffer == NULL)
+    return status;
+  memset(context.buffer, 0xA5, BENCH_CHUNK_SIZE);
+
+  context.interface = init(VirtualMem, &vmemConfig);
+  if (context.interface == NULL)
+    goto free_buffer;
+
+  if (fat32MakeFs(context.interface, &makeFsConfig, NULL, 0) != E_OK)
+    goto free_interface;
+
+  const struct Fat32Config fsConfig = {
+      .interface = context.interface,
+      .nodes = BENCH_NODE_POOL_SIZE,
+      .threads = 0
+  };
+
+  context.handle = init(FatHandle, &fsConfig);
+  if (context.handle == NULL)
+    goto free_interface;
+
+  if (!makeNode(context.handle, PATH_DIR, true)
+      || !makeNode(context.handle, PATH_FILE, false))
+  {
+    goto free_handle;
+  }
+
+  status = EXIT_SUCCESS;
+  for (size_t i = 0; i < ARRAY_SIZE(scenarios); ++i)
+  {
+    if (!runScenario(&context, &scenarios[i]))
+    {
+      status = EXIT_FAILURE;
+      break;
+    }
+  }
+
+free_handle:
+  deinit(context.handle);
+free_interface:
+  deinit(context.interface);
+free_buffer:
+  free(context.buffer);
+  return status;
+}
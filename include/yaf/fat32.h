@@ -9,9 +9,79 @@
 /*----------------------------------------------------------------------------*/
 #include <xcore/fs/fs.h>
 #include <xcore/interface.h>
+#include <xcore/realtime.h>
 /*----------------------------------------------------------------------------*/
 extern const struct FsHandleClass * const FatHandle;
+
+/* Round the value up to the alignment boundary, alignment is power of two */
+#define FAT32_ALIGN(value, alignment) \
+    (((value) + (alignment) - 1) & ~((size_t)(alignment) - 1))
+/* Effective alignment of the arena parts, at least the pointer alignment */
+#define FAT32_ARENA_ALIGNMENT(alignment) \
+    ((size_t)(alignment) > sizeof(void *) \
+        ? (size_t)(alignment) : sizeof(void *))
+/* Upper bound of the memory used by each command context */
+#define FAT32_CONTEXT_SIZE(sector, alignment) \
+    (FAT32_ALIGN((size_t)(sector) + 2 * sizeof(uint32_t), \
+        FAT32_ARENA_ALIGNMENT(alignment)) + sizeof(uint16_t))
+/* Upper bound of the memory used by each node descriptor */
+#define FAT32_NODE_SIZE \
+    (4 * sizeof(void *) + 40 + FS_NAME_LENGTH + sizeof(uint16_t))
+/*
+ * Size of the arena for a handle with the given sector size, buffer
+ * alignment, number of nodes and number of threads. One additional
+ * context is reserved for directory compaction in a separate pool.
+ */
+#define FAT32_ARENA_SIZE(sector, alignment, nodes, threads) \
+    (3 * FAT32_ARENA_ALIGNMENT(alignment) \
+        + FAT32_CONTEXT_SIZE(sector, alignment) \
+            * (((threads) ? (threads) : 1) + 1) \
+        + FAT32_NODE_SIZE * (nodes))
+
+enum
+{
+  FAT32_ATTRIBUTE_RO        = 0x01,
+  FAT32_ATTRIBUTE_HIDDEN    = 0x02,
+  FAT32_ATTRIBUTE_SYSTEM    = 0x04,
+  FAT32_ATTRIBUTE_DIR       = 0x10,
+  FAT32_ATTRIBUTE_ARCHIVED  = 0x20
+};
+
+enum Fat32TraceCommand
+{
+  FAT32_TRACE_READ,
+  FAT32_TRACE_WRITE
+};
+
+enum Fat32TraceOrigin
+{
+  FAT32_ORIGIN_MOUNT,
+  FAT32_ORIGIN_SYNC,
+  FAT32_ORIGIN_LIST,
+  FAT32_ORIGIN_READ,
+  FAT32_ORIGIN_WRITE,
+  FAT32_ORIGIN_CREATE,
+  FAT32_ORIGIN_REMOVE,
+  FAT32_ORIGIN_MOVE,
+  FAT32_ORIGIN_COMPACT
+};
 /*----------------------------------------------------------------------------*/
+struct Fat32TraceEvent
+{
+  /** First sector of the command. */
+  uint32_t sector;
+  /** Number of sectors transferred by the command. */
+  uint32_t count;
+  /** Result of the command, valid only for completed commands. */
+  enum Result result;
+  /** Direction of the transfer, one of the Fat32TraceCommand values. */
+  uint8_t command;
+  /** Public operation that issued the command, Fat32TraceOrigin value. */
+  uint8_t origin;
+  /** Event is reported before the command is issued and after completion. */
+  bool completed;
+};
+
 struct Fat32Config
 {
   /**
@@ -28,6 +98,104 @@ struct Fat32Config
    * This option is used only when support for multiple threads is enabled.
    */
   size_t threads;
+  /**
+   * Optional: time in milliseconds to wait for a free command context when
+   * all contexts are in use. Operations fail immediately when the value
+   * is zero. This option is used only when support for multiple threads
+   * is enabled.
+   */
+  unsigned int timeout;
+  /**
+   * Optional: memory for context and node pools. Pools are allocated
+   * dynamically when the pointer is null. Use the FAT32_ARENA_SIZE macro
+   * to calculate the required size.
+   */
+  void *arena;
+  /**
+   * Optional: size of the arena in bytes.
+   */
+  size_t size;
+  /**
+   * Optional: alignment of sector buffers in bytes, power of two. Buffers
+   * are aligned along the pointer size when the value is zero.
+   */
+  size_t alignment;
+  /**
+   * Optional: function called before and after each sector command.
+   * The function is called from the thread that issued the command and
+   * should not use the handle. This option is used only when support
+   * for tracing is enabled.
+   */
+  void (*trace)(void *, const struct Fat32TraceEvent *);
+  /**
+   * Optional: first argument of the trace function.
+   */
+  void *traceArgument;
+};
+
+struct Fat32NodeFields
+{
+  /** Field descriptors of the node, the same as for the node creation. */
+  const struct FsFieldDescriptor *descriptors;
+  /** Number of field descriptors. */
+  size_t number;
 };
+
+struct Fat32DirRecord
+{
+  /** Node identifier, the same value as in the FS_NODE_ID field. */
+  FsIdentifier id;
+  /** Modification time in microseconds. */
+  time64_t time;
+  /** Size of the node payload, zero for directories. */
+  uint32_t size;
+  /** Length of the record including the name and the alignment padding. */
+  uint16_t length;
+  /** Attributes of the directory entry. */
+  uint8_t attributes;
+  /** Access flags, the same value as in the FS_NODE_ACCESS field. */
+  FsAccess access;
+  /** Null-terminated name of the node. */
+  char name[];
+};
+
+struct Fat32Statistics
+{
+  /** Bytes read from the interface. */
+  uint64_t readBytes;
+  /** Bytes written to the interface. */
+  uint64_t writtenBytes;
+  /** Single-sector read commands. */
+  uint32_t sectorReads;
+  /** Single-sector write commands. */
+  uint32_t sectorWrites;
+  /** Multi-sector read commands. */
+  uint32_t bufferReads;
+  /** Multi-sector write commands. */
+  uint32_t bufferWrites;
+  /** Sector reads served from a context buffer without a command. */
+  uint32_t cachedReads;
+  /** Lookups of the next cluster in the allocation table. */
+  uint32_t tableLookups;
+  /** Allocated clusters. */
+  uint32_t allocations;
+  /** Failed attempts to get a command context. */
+  uint32_t contextExhaustions;
+  /** Failed attempts to get a node descriptor. */
+  uint32_t nodeExhaustions;
+};
+/*----------------------------------------------------------------------------*/
+BEGIN_DECLS
+
+enum Result fat32CompactDir(void *);
+enum Result fat32CreateNodes(void *, const struct Fat32NodeFields *, size_t,
+    size_t *);
+enum Result fat32MoveNode(void *, void *, void *, const char *);
+enum Result fat32ReadDir(void *, void *, size_t, size_t *);
+
+enum Result fat32GetStatistics(const void *, struct Fat32Statistics *);
+enum Result fat32ResetStatistics(void *);
+
+END_DECLS
 /*----------------------------------------------------------------------------*/
 #endif /* YAF_FAT32_H_ */
@@ -7,15 +7,14 @@
 #ifndef YAF_FAT32_DEFS_H_
 #define YAF_FAT32_DEFS_H_
 /*----------------------------------------------------------------------------*/
-#include <yaf/pointer_array.h>
-#include <yaf/pointer_queue.h>
 #include <xcore/bits.h>
 #include <xcore/fs/fs.h>
 #include <xcore/realtime.h>
 #include <xcore/unicode.h>
 
 #ifdef CONFIG_THREADS
-#include <xcore/os/mutex.h>
+#include <yaf/rw_lock.h>
+#include <stdatomic.h>
 #endif
 /*----------------------------------------------------------------------------*/
 /* Sector size may be 512, 1024, 2048 or 4096 bytes, default is 512. */
@@ -33,14 +32,57 @@
 
 /* Sector size in bytes */
 #define SECTOR_SIZE             (1 << SECTOR_EXP)
+
+/* Optional fixed cluster size, from 1 to 128 sectors */
+#ifdef CONFIG_CLUSTER_SIZE
+#  if CONFIG_CLUSTER_SIZE == CONFIG_SECTOR_SIZE
+#    define CLUSTER_EXP 0
+#  elif CONFIG_CLUSTER_SIZE == CONFIG_SECTOR_SIZE * 2
+#    define CLUSTER_EXP 1
+#  elif CONFIG_CLUSTER_SIZE == CONFIG_SECTOR_SIZE * 4
+#    define CLUSTER_EXP 2
+#  elif CONFIG_CLUSTER_SIZE == CONFIG_SECTOR_SIZE * 8
+#    define CLUSTER_EXP 3
+#  elif CONFIG_CLUSTER_SIZE == CONFIG_SECTOR_SIZE * 16
+#    define CLUSTER_EXP 4
+#  elif CONFIG_CLUSTER_SIZE == CONFIG_SECTOR_SIZE * 32
+#    define CLUSTER_EXP 5
+#  elif CONFIG_CLUSTER_SIZE == CONFIG_SECTOR_SIZE * 64
+#    define CLUSTER_EXP 6
+#  elif CONFIG_CLUSTER_SIZE == CONFIG_SECTOR_SIZE * 128
+#    define CLUSTER_EXP 7
+#  else
+#    error "Incorrect cluster size"
+#  endif
+#  if CONFIG_CLUSTER_SIZE > 65536
+#    error "Cluster size exceeds 64 KiB"
+#  endif
+#endif
 /*----------------------------------------------------------------------------*/
 /* Use public definition from the XCORE library */
 #define CONFIG_NAME_LENGTH      FS_NAME_LENGTH
 /* Maximum number of duplicate name entries when using the 8.3 convention */
 #define MAX_SIMILAR_NAMES       100
+/* Characters of the short name basis preserved in hashed aliases */
+#define ALIAS_PREFIX_LENGTH     2
+/* Maximum number of hashed aliases with the same hash value */
+#define MAX_SIMILAR_ALIASES     10
 /*----------------------------------------------------------------------------*/
 /* Default pool size */
 #define DEFAULT_THREAD_COUNT    1
+/* Number of directories with remembered free entry positions, power of two */
+#define GAP_HINT_COUNT          8
+/*
+ * Number of directory locks, power of two not greater than the number of
+ * gap hints so that directories sharing a hint always share a lock
+ */
+#define DIR_LOCK_COUNT          4
+/* Maximum number of nodes created during a single directory pass */
+#define CREATE_GROUP_SIZE       8
+/* Maximum nesting level of directories walked by utilities and moves */
+#define MAX_TREE_DEPTH          32
+/* Contexts reserved for operations that use two sector buffers */
+#define RESERVED_CONTEXT_COUNT  1
 /*----------------------------------------------------------------------------*/
 #define FLAG_RO                 BIT(0) /* Read only */
 #define FLAG_HIDDEN             BIT(1)
@@ -58,6 +100,8 @@
 /* Long file name chunk */
 #define MASK_LFN                BIT_FIELD(0x0F, 0)
 /*----------------------------------------------------------------------------*/
+/* Bad cluster value */
+#define CLUSTER_BAD_VAL         0x0FFFFFF7UL
 /* End of cluster chain value */
 #define CLUSTER_EOC_VAL         0x0FFFFFF8UL
 /* Index of the first cluster of the data region */
@@ -96,18 +140,108 @@ enum
   FAT_FLAG_DIR    = 0x01,
   FAT_FLAG_FILE   = 0x02,
   FAT_FLAG_RO     = 0x04,
-  FAT_FLAG_DIRTY  = 0x08
+  FAT_FLAG_DIRTY  = 0x08,
+  FAT_FLAG_NAME   = 0x10
+};
+
+enum FatCounter
+{
+  /* Multi-sector read and write commands */
+  FAT_COUNTER_BUFFER_READS,
+  FAT_COUNTER_BUFFER_WRITES,
+  /* Single-sector read and write commands */
+  FAT_COUNTER_SECTOR_READS,
+  FAT_COUNTER_SECTOR_WRITES,
+  /* Sectors transferred by all commands */
+  FAT_COUNTER_READ_SECTORS,
+  FAT_COUNTER_WRITTEN_SECTORS,
+  /* Sector reads served from the context buffer */
+  FAT_COUNTER_CACHED_READS,
+  /* Lookups of the next cluster in the allocation table */
+  FAT_COUNTER_TABLE_LOOKUPS,
+  /* Allocated clusters */
+  FAT_COUNTER_ALLOCATIONS,
+  /* Failed allocations from the context and node pools */
+  FAT_COUNTER_CONTEXT_EXHAUSTIONS,
+  FAT_COUNTER_NODE_EXHAUSTIONS,
+
+  FAT_COUNTER_END
 };
 /*----------------------------------------------------------------------------*/
 extern const struct FsHandleClass * const FatHandle;
 extern const struct FsNodeClass * const FatNode;
+
+struct Fat32TraceEvent;
 /*----------------------------------------------------------------------------*/
+/* Index of the free entry list head for an empty pool */
+#define POOL_INDEX_EMPTY        0xFFFFU
+/* Pool head contains an index in lower bits and a change counter above */
+#define POOL_INDEX_MASK         0x0000FFFFUL
+#define POOL_TAG_STEP           0x00010000UL
+
+/*
+ * Atomic types are used only when operations on them are lock-free.
+ * On cores without exclusive access instructions, for example ARMv6-M,
+ * atomic operations require library calls, therefore pools and counters
+ * are guarded by the memory mutex instead.
+ */
+#if defined(CONFIG_THREADS) && ATOMIC_SHORT_LOCK_FREE == 2 \
+    && ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LONG_LOCK_FREE == 2
+#  define LOCK_FREE_ATOMICS
+#endif
+
+#ifdef LOCK_FREE_ATOMICS
+typedef _Atomic uint32_t PoolHead;
+typedef _Atomic uint16_t PoolLink;
+typedef _Atomic uint32_t StatCounter;
+#else
+typedef uint32_t PoolHead;
+typedef uint16_t PoolLink;
+typedef uint32_t StatCounter;
+#endif
+
 struct Pool
 {
+  /* Heap block with the storage, null when the storage is external */
+  void *memory;
+  /* Storage for entries */
   void *data;
-  PointerQueue queue;
+  /* Indices of the next free entries */
+  PoolLink *links;
+  /* Index of the first free entry and a counter of head changes */
+  PoolHead head;
+#if defined(CONFIG_THREADS) && !defined(LOCK_FREE_ATOMICS)
+  /* Mutex of the handle that guards the list of free entries */
+  struct Mutex *mutex;
+#endif
+  /* Maximum number of entries, lower than the empty index */
+  uint16_t capacity;
+  /* Size of each entry */
+  uint16_t width;
 };
 /*----------------------------------------------------------------------------*/
+struct FatRelocation
+{
+  /* Position of the first live entry of the processed sector */
+  uint32_t sourceCluster;
+  /* New position of the first live entry */
+  uint32_t destinationCluster;
+  /* Following destination cluster when entries cross the cluster end */
+  uint32_t nextCluster;
+  uint16_t sourceIndex;
+  uint16_t destinationIndex;
+};
+
+struct FatGapHint
+{
+  /* First cluster of the directory, reserved value for an unused hint */
+  uint32_t directory;
+  /* Cluster of the lowest directory entry that may be free */
+  uint32_t cluster;
+  /* Index of the lowest directory entry that may be free */
+  uint16_t index;
+};
+
 struct FatHandle
 {
   struct FsHandle base;
@@ -119,15 +253,49 @@ struct FatHandle
   {
     struct Pool contexts;
     struct Pool nodes;
+#ifdef CONFIG_WRITE
+    /* Contexts used only as second buffers of directory compaction */
+    struct Pool reserved;
+#endif
   } pools;
 
 #ifdef CONFIG_THREADS
-  struct Mutex consistencyMutex;
+  /*
+   * Locks are acquired in the following order: list of dirty files,
+   * directories in ascending order of lock indices, allocation tables.
+   * Directory and table locks are shared between readers.
+   */
+  struct Mutex fileMutex;
+  struct RwLock dirLocks[DIR_LOCK_COUNT];
+  struct RwLock tableLock;
+
+#  ifndef LOCK_FREE_ATOMICS
+  /* Lock for pools and event counters when atomics are not lock-free */
   struct Mutex memoryMutex;
+#  endif
+
+  /* Number of free contexts, used only when the timeout is set */
+  struct Semaphore contextSemaphore;
+  /* Time to wait for a free context in milliseconds */
+  unsigned int timeout;
 #endif
 
 #ifdef CONFIG_WRITE
-  PointerArray openedFiles;
+  /* First node in the list of files with unsaved entries */
+  struct FatNode *dirtyNodes;
+  /* Positions of free entries in recently modified directories */
+  struct FatGapHint gapHints[GAP_HINT_COUNT];
+#endif
+
+#ifdef CONFIG_STATISTICS
+  /* Event counters indexed by FatCounter values */
+  StatCounter counters[FAT_COUNTER_END];
+#endif
+
+#ifdef CONFIG_TRACE
+  /* Function called around sector commands */
+  void (*trace)(void *, const struct Fat32TraceEvent *);
+  void *traceArgument;
 #endif
 
   /* Number of the first sector containing cluster data */
@@ -148,8 +316,10 @@ struct FatHandle
   /* Number of file allocation tables */
   uint8_t tableCount;
 #endif
+#ifndef CONFIG_CLUSTER_SIZE
   /* Sectors per cluster in power of two */
   uint8_t clusterSize;
+#endif
 };
 /*----------------------------------------------------------------------------*/
 struct FatNodeConfig
@@ -163,6 +333,14 @@ struct FatNode
 
   struct FsHandle *handle;
 
+#ifdef CONFIG_WRITE
+  /* Neighbours in the list of files with unsaved entries */
+  struct FatNode *dirtyNext;
+  struct FatNode *dirtyPrev;
+#endif
+
+  /* First cluster of the directory containing the node */
+  uint32_t directoryCluster;
   /* Parent cluster */
   uint32_t parentCluster;
   /* Position in the parent cluster */
@@ -191,6 +369,48 @@ struct FatNode
   uint8_t flags;
   /* Number of LFN entries */
   uint8_t lfn;
+
+#ifdef CONFIG_NAME_CACHE
+  /* Node name in UTF-8 decoded during entry fetching */
+  char name[CONFIG_NAME_LENGTH];
+#endif
+};
+/*----------------------------------------------------------------------------*/
+/* Parameters of a node that is not yet created */
+struct FatNodeTemplate
+{
+  /* Name of the node in UTF-8 */
+  const char *name;
+  /* Payload of the file, directory is created when pointer is null */
+  const struct FsFieldDescriptor *data;
+  /* Existing entry reused for the short name entry of a moved node */
+  const struct DirEntryImage *origin;
+
+  /* Modification time */
+  time64_t time;
+  /* First cluster of the allocated payload */
+  uint32_t payloadCluster;
+  /* Position of the first directory entry of the created node */
+  uint32_t firstCluster;
+  uint16_t firstIndex;
+
+#ifdef CONFIG_UNICODE
+  /* Number of the proposed short name instance */
+  unsigned int instance;
+  /* Length of the name in UTF-16 including terminating character */
+  uint16_t nameLength;
+  /* Short name without extension */
+  char baseName[BASENAME_LENGTH + 1];
+#endif
+
+  /* Short name with extension */
+  char shortName[NAME_LENGTH];
+  /* Access flags */
+  FsAccess access;
+  /* Number of LFN entries */
+  uint8_t chunks;
+  /* Long name is required to store the name */
+  bool longNameRequired;
 };
 /*----------------------------------------------------------------------------*/
 /* Directory entry or long file name entry */
@@ -332,8 +552,7 @@ struct [[gnu::packed]] InfoSectorImage
 /*----------------------------------------------------------------------------*/
 struct CommandContext
 {
-  uint32_t sector;
-
+  /* Buffer is placed first to keep the alignment of the context */
   union
   {
     uint8_t raw[SECTOR_SIZE];
@@ -344,6 +563,12 @@ struct CommandContext
     uint32_t cluster[SECTOR_SIZE / sizeof(uint32_t)];
     struct DirEntryImage entry[SECTOR_SIZE / sizeof(struct DirEntryImage)];
   } buffer;
+
+  uint32_t sector;
+#ifdef CONFIG_TRACE
+  /* Public operation that uses the context */
+  uint8_t origin;
+#endif
 };
 /*----------------------------------------------------------------------------*/
 #endif /* YAF_FAT32_DEFS_H_ */
@@ -7,6 +7,7 @@
 #ifndef YAF_FAT32_HELPERS_H_
 #define YAF_FAT32_HELPERS_H_
 /*----------------------------------------------------------------------------*/
+#include <yaf/fat32.h>
 #include <yaf/fat32_defs.h>
 #include <xcore/memory.h>
 /*----------------------------------------------------------------------------*/
@@ -34,23 +35,39 @@ void fillLongNameEntry(struct DirEntryImage *, uint8_t, uint8_t,
     uint8_t);
 size_t uniqueNameConvert(char *);
 #endif /* CONFIG_UNICODE && CONFIG_WRITE */
+
+#if defined(CONFIG_HASHED_ALIASES) && defined(CONFIG_UNICODE) \
+    && defined(CONFIG_WRITE)
+void fillHashedAlias(char *, const char *);
+#endif /* CONFIG_HASHED_ALIASES && CONFIG_UNICODE && CONFIG_WRITE */
 /*----------------------------------------------------------------------------*/
 static inline size_t calcLfnCount(size_t length)
 {
   return (length - 1) / 2 / LFN_ENTRY_LENGTH;
 }
 
+/* Sectors per cluster in power of two */
+static inline unsigned int clusterExp(const struct FatHandle *handle)
+{
+#ifdef CONFIG_CLUSTER_SIZE
+  (void)handle;
+  return CLUSTER_EXP;
+#else
+  return handle->clusterSize;
+#endif
+}
+
 /* Directory entries per directory cluster */
 static inline uint16_t calcNodeCount(const struct FatHandle *handle)
 {
-  return 1 << ENTRY_EXP << handle->clusterSize;
+  return 1 << ENTRY_EXP << clusterExp(handle);
 }
 
 /* Calculate the number of the first sector for a cluster */
 static inline uint32_t calcSectorNumber(const struct FatHandle *handle,
     uint32_t cluster)
 {
-  return handle->dataSector + (((cluster) - 2) << handle->clusterSize);
+  return handle->dataSector + (((cluster) - 2) << clusterExp(handle));
 }
 
 static inline bool isClusterFree(uint32_t cluster)
@@ -71,19 +88,106 @@ static inline struct DirEntryImage *getDirEntry(struct CommandContext *context,
   return &context->buffer.entry[ENTRY_INDEX(index)];
 }
 
+/* Entry is neither deleted nor the end of the directory */
+static inline bool isLiveEntry(const struct DirEntryImage *entry)
+{
+  return entry->name[0] && entry->name[0] != E_FLAG_EMPTY
+      && ((entry->flags & MASK_LFN) != MASK_LFN
+          || !(entry->ordinal & LFN_DELETED));
+}
+
 static inline uint32_t makeClusterNumber(const struct DirEntryImage *entry)
 {
   return ((uint32_t)fromLittleEndian16(entry->clusterHigh) << 16)
       | (uint32_t)fromLittleEndian16(entry->clusterLow);
 }
 
+/* Remember the public operation that uses the context */
+static inline void setTraceOrigin(struct CommandContext *context,
+    enum Fat32TraceOrigin origin)
+{
+#ifdef CONFIG_TRACE
+  context->origin = (uint8_t)origin;
+#else
+  (void)context;
+  (void)origin;
+#endif
+}
+
+/* Report a sector command, the result is null before the command is issued */
+static inline void traceCommand(const struct CommandContext *context,
+    struct FatHandle *handle, enum Fat32TraceCommand command,
+    uint32_t sector, uint32_t count, const enum Result *result)
+{
+#ifdef CONFIG_TRACE
+  if (handle->trace != NULL)
+  {
+    const struct Fat32TraceEvent event = {
+        .sector = sector,
+        .count = count,
+        .result = result != NULL ? *result : E_OK,
+        .command = (uint8_t)command,
+        .origin = context->origin,
+        .completed = result != NULL
+    };
+
+    handle->trace(handle->traceArgument, &event);
+  }
+#else
+  (void)context;
+  (void)handle;
+  (void)command;
+  (void)sector;
+  (void)count;
+  (void)result;
+#endif
+}
+
+/* Add a value to the event counter when statistics are enabled */
+static inline void updateCounter(struct FatHandle *handle,
+    enum FatCounter counter, uint32_t value)
+{
+#ifdef CONFIG_STATISTICS
+#  if defined(LOCK_FREE_ATOMICS)
+  atomic_fetch_add_explicit(&handle->counters[counter], value,
+      memory_order_relaxed);
+#  elif defined(CONFIG_THREADS)
+  mutexLock(&handle->memoryMutex);
+  handle->counters[counter] += value;
+  mutexUnlock(&handle->memoryMutex);
+#  else
+  handle->counters[counter] += value;
+#  endif
+#else
+  (void)handle;
+  (void)counter;
+  (void)value;
+#endif
+}
+
 /* Calculate current sector in data cluster for read or write operations */
 static inline uint32_t sectorInCluster(const struct FatHandle *handle,
     uint32_t offset)
 {
-  return (offset >> SECTOR_EXP) & ((1U << handle->clusterSize) - 1);
+  return (offset >> SECTOR_EXP) & ((1U << clusterExp(handle)) - 1);
+}
+
+#ifdef CONFIG_WRITE
+static inline struct FatGapHint *getGapHint(struct FatHandle *handle,
+    uint32_t directory)
+{
+  return &handle->gapHints[directory & (GAP_HINT_COUNT - 1)];
 }
 
+static inline void resetGapHint(struct FatHandle *handle, uint32_t directory)
+{
+  struct FatGapHint * const hint = getGapHint(handle, directory);
+
+  if (hint->directory == directory)
+    hint->directory = RESERVED_CLUSTER;
+}
+#endif
+
 #ifdef CONFIG_UNICODE
 static inline bool hasLongName(const struct FatNode *node)
 {
@@ -92,19 +196,113 @@ static inline bool hasLongName(const struct FatNode *node)
 }
 #endif
 
-static inline void lockHandle(struct FatHandle *handle)
+/*
+ * Sectors loaded into the context before the lock is acquired may be changed
+ * by other threads, therefore the loaded sector is dropped. Shared locks
+ * are not used when the volume cannot be modified.
+ */
+static inline void lockDir(struct CommandContext *context,
+    struct FatHandle *handle, uint32_t directory)
 {
 #ifdef CONFIG_THREADS
-  mutexLock(&handle->consistencyMutex);
+  rwLockWriteLock(&handle->dirLocks[directory & (DIR_LOCK_COUNT - 1)]);
+  context->sector = RESERVED_SECTOR;
 #else
+  (void)context;
   (void)handle;
+  (void)directory;
 #endif
 }
 
-static inline void unlockHandle(struct FatHandle *handle)
+static inline void unlockDir(struct FatHandle *handle, uint32_t directory)
 {
 #ifdef CONFIG_THREADS
-  mutexUnlock(&handle->consistencyMutex);
+  rwLockWriteUnlock(&handle->dirLocks[directory & (DIR_LOCK_COUNT - 1)]);
+#else
+  (void)handle;
+  (void)directory;
+#endif
+}
+
+static inline void lockDirShared(struct CommandContext *context,
+    struct FatHandle *handle, uint32_t directory)
+{
+#if defined(CONFIG_THREADS) && defined(CONFIG_WRITE)
+  rwLockReadLock(&handle->dirLocks[directory & (DIR_LOCK_COUNT - 1)]);
+  context->sector = RESERVED_SECTOR;
+#else
+  (void)context;
+  (void)handle;
+  (void)directory;
+#endif
+}
+
+static inline void unlockDirShared(struct FatHandle *handle,
+    uint32_t directory)
+{
+#if defined(CONFIG_THREADS) && defined(CONFIG_WRITE)
+  rwLockReadUnlock(&handle->dirLocks[directory & (DIR_LOCK_COUNT - 1)]);
+#else
+  (void)handle;
+  (void)directory;
+#endif
+}
+
+static inline void lockFiles(struct FatHandle *handle)
+{
+#ifdef CONFIG_THREADS
+  mutexLock(&handle->fileMutex);
+#else
+  (void)handle;
+#endif
+}
+
+static inline void unlockFiles(struct FatHandle *handle)
+{
+#ifdef CONFIG_THREADS
+  mutexUnlock(&handle->fileMutex);
+#else
+  (void)handle;
+#endif
+}
+
+static inline void lockTable(struct CommandContext *context,
+    struct FatHandle *handle)
+{
+#ifdef CONFIG_THREADS
+  rwLockWriteLock(&handle->tableLock);
+  context->sector = RESERVED_SECTOR;
+#else
+  (void)context;
+  (void)handle;
+#endif
+}
+
+static inline void unlockTable(struct FatHandle *handle)
+{
+#ifdef CONFIG_THREADS
+  rwLockWriteUnlock(&handle->tableLock);
+#else
+  (void)handle;
+#endif
+}
+
+static inline void lockTableShared(struct CommandContext *context,
+    struct FatHandle *handle)
+{
+#if defined(CONFIG_THREADS) && defined(CONFIG_WRITE)
+  rwLockReadLock(&handle->tableLock);
+  context->sector = RESERVED_SECTOR;
+#else
+  (void)context;
+  (void)handle;
+#endif
+}
+
+static inline void unlockTableShared(struct FatHandle *handle)
+{
+#if defined(CONFIG_THREADS) && defined(CONFIG_WRITE)
+  rwLockReadUnlock(&handle->tableLock);
 #else
   (void)handle;
 #endif
@@ -9,13 +9,19 @@
 /*----------------------------------------------------------------------------*/
 #include <yaf/fat32_defs.h>
 /*----------------------------------------------------------------------------*/
-bool allocatePool(struct Pool *, size_t, size_t);
+bool allocatePool(struct Pool *, size_t, size_t, size_t);
 struct CommandContext *allocatePoolContext(struct FatHandle *);
 void *allocatePoolNode(struct FatHandle *);
+struct CommandContext *allocateReservedContext(struct FatHandle *);
 void allocateStaticNode(struct FatHandle *, struct FatNode *);
 void freePool(struct Pool *);
 void freePoolContext(struct FatHandle *, struct CommandContext *);
 void freePoolNode(struct FatNode *);
+void freeReservedContext(struct FatHandle *, struct CommandContext *);
 void freeStaticNode(struct FatNode *);
+bool placePool(struct Pool *, uint8_t **, const uint8_t *, size_t, size_t,
+    size_t);
+void *popPoolEntry(struct Pool *);
+void pushPoolEntry(struct Pool *, void *);
 /*----------------------------------------------------------------------------*/
 #endif /* YAF_FAT32_POOLS_H_ */
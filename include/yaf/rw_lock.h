@@ -0,0 +1,32 @@
+/*
+ * yaf/rw_lock.h
+ * Copyright (C) 2026 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#ifndef YAF_RW_LOCK_H_
+#define YAF_RW_LOCK_H_
+/*----------------------------------------------------------------------------*/
+#include <xcore/os/mutex.h>
+#include <xcore/os/semaphore.h>
+/*----------------------------------------------------------------------------*/
+struct RwLock
+{
+  /* Protects the reader counter */
+  struct Mutex mutex;
+  /* Held by a writer or by a group of readers */
+  struct Semaphore room;
+  /* Held by a writer to stop new readers while it waits for the room */
+  struct Semaphore turnstile;
+  /* Number of readers inside the room */
+  unsigned int readers;
+};
+/*----------------------------------------------------------------------------*/
+enum Result rwLockInit(struct RwLock *);
+void rwLockDeinit(struct RwLock *);
+void rwLockReadLock(struct RwLock *);
+void rwLockReadUnlock(struct RwLock *);
+void rwLockWriteLock(struct RwLock *);
+void rwLockWriteUnlock(struct RwLock *);
+/*----------------------------------------------------------------------------*/
+#endif /* YAF_RW_LOCK_H_ */
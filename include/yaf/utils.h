@@ -9,6 +9,7 @@
 /*----------------------------------------------------------------------------*/
 #include <xcore/error.h>
 #include <xcore/helpers.h>
+#include <stdbool.h>
 #include <stdint.h>
 /*----------------------------------------------------------------------------*/
 struct Fat32FsConfig
@@ -17,14 +18,48 @@ struct Fat32FsConfig
   size_t cluster;
   /** Optional: number of reserved sectors. */
   size_t reserved;
+  /**
+   * Optional: size of the erase block or allocation unit of the memory
+   * in bytes. Reserved sectors and tables are padded so that the tables
+   * and the data region start on allocation unit boundaries.
+   */
+  size_t alignment;
   /** Mandatory: number of FAT tables. */
   size_t tables;
   /** Optional: volume label. */
   const char *label;
+  /**
+   * Optional: memory is erased and reads as zeros, only the first sectors
+   * of the tables and of the root directory are written.
+   */
+  bool erased;
+};
+
+struct Fat32CheckReport
+{
+  /** Number of cluster chains not referenced by directory entries. */
+  uint32_t lostChains;
+  /** Number of clusters referenced more than once. */
+  uint32_t crossLinks;
+  /** Number of references to clusters outside of the volume. */
+  uint32_t invalidLinks;
+  /** Number of looped cluster chains without first clusters. */
+  uint32_t loopedChains;
+  /** Number of directory entries with unallocated first clusters. */
+  uint32_t invalidEntries;
+  /** Number of free clusters in the allocation table. */
+  uint32_t freeClusters;
+  /** Number of free clusters stored in the information sector. */
+  uint32_t infoFreeClusters;
 };
 /*----------------------------------------------------------------------------*/
 BEGIN_DECLS
 
+enum Result fat32Check(void *, void *, size_t, bool,
+    struct Fat32CheckReport *);
+
+enum Result fat32Defragment(void *, void *, size_t,
+    void (*)(void *, uint32_t, uint32_t), void *);
 FsCapacity fat32GetCapacity(const void *);
 size_t fat32GetClusterSize(const void *);
 enum Result fat32GetUsage(void *, void *, size_t, FsCapacity *);
@@ -8,13 +8,15 @@
 #include <yaf/fat32.h>
 #include <yaf/fat32_helpers.h>
 #include <yaf/fat32_pools.h>
+#include <stdalign.h>
+#include <stddef.h>
 /*----------------------------------------------------------------------------*/
 enum Cleanup
 {
   FREE_ALL,
   FREE_NODE_POOL,
+  FREE_RESERVED_POOL,
   FREE_CONTEXT_POOL,
-  FREE_NODE_LIST,
   FREE_LOCKS
 };
 /*----------------------------------------------------------------------------*/
@@ -28,10 +30,12 @@ static void freeBuffers(struct FatHandle *, enum Cleanup);
 static enum Result getNextCluster(struct CommandContext *, struct FatHandle *,
     uint32_t *);
 static enum Result mountStorage(struct FatHandle *);
-static enum Result readBuffer(struct FatHandle *, uint32_t, uint8_t *,
-    uint32_t);
+static enum Result readBuffer(struct CommandContext *, struct FatHandle *,
+    uint32_t, uint8_t *, uint32_t);
 static enum Result readClusterChain(struct CommandContext *,
     struct FatNode *, uint32_t, uint8_t *, uint32_t);
+static enum Result readDirRecord(struct CommandContext *, struct FatNode *,
+    struct Fat32DirRecord *, size_t);
 static void readNodeAccess(struct FatNode *, FsAccess *);
 static enum Result readNodeCapacity(struct CommandContext *, struct FatNode *,
     FsCapacity *);
@@ -55,24 +59,48 @@ static enum Result readLongName(struct CommandContext *, char *, size_t,
 #ifdef CONFIG_WRITE
 static enum Result allocateCluster(struct CommandContext *, struct FatHandle *,
     uint32_t *);
+static enum Result allocatePayload(struct CommandContext *,
+    const struct FatNode *, struct FatNodeTemplate *);
+static enum Result checkDirNesting(struct CommandContext *, struct FatHandle *,
+    uint32_t, uint32_t);
 static enum Result clearCluster(struct CommandContext *, struct FatHandle *,
     uint32_t);
 static void clearDirtyFlag(struct FatNode *);
-static enum Result createNode(struct CommandContext *, const struct FatNode *,
-    bool, const char *, FsAccess, uint32_t, time64_t);
+static enum Result compactDirectory(struct CommandContext *,
+    struct CommandContext *, struct FatHandle *, uint32_t);
+static enum Result createEntries(struct CommandContext *,
+    const struct FatNode *, struct FatNodeTemplate *, size_t, size_t *);
+static enum Result createNodeGroup(struct CommandContext *,
+    const struct FatNode *, struct FatNodeTemplate *, size_t, size_t *);
+static enum Result findNodeName(struct CommandContext *,
+    const struct FatNode *, const struct FatNode *, const char *);
 static enum Result findGap(struct CommandContext *, struct FatNode *,
-    const struct FatNode *, uint16_t);
+    const struct FatNode *, uint16_t, struct FatNodeTemplate *, size_t,
+    size_t *);
 static enum Result freeChain(struct CommandContext *, struct FatHandle *,
     uint32_t);
-static enum Result markFree(struct CommandContext *, const struct FatNode *);
+static bool isSameName(const char *, const char *);
+static enum Result markFree(struct CommandContext *, const struct FatNode *,
+    const struct FatNode *);
+static enum Result parseNodeTemplate(struct FatNodeTemplate *,
+    const struct FsFieldDescriptor *, size_t);
+static void relocateNodes(struct CommandContext *, struct FatHandle *,
+    const struct FatRelocation *);
+static void setDirtyFlag(struct FatNode *);
+static enum Result setParentCluster(struct CommandContext *,
+    struct FatHandle *, uint32_t, uint32_t);
 static enum Result setupDirCluster(struct CommandContext *, struct FatHandle *,
     uint32_t, uint32_t, time64_t);
 static enum Result syncDirEntry(struct CommandContext *, struct FatNode *);
+static enum Result syncSharedNodes(struct CommandContext *,
+    const struct FatNode *);
 static enum Result truncatePayload(struct CommandContext *, struct FatNode *);
+static void updateSharedNodes(struct FatHandle *, const struct FatNode *,
+    uint32_t, uint16_t);
 static enum Result updateTable(struct CommandContext *, struct FatHandle *,
     uint32_t);
-static enum Result writeBuffer(struct FatHandle *, uint32_t, const uint8_t *,
-    uint32_t);
+static enum Result writeBuffer(struct CommandContext *, struct FatHandle *,
+    uint32_t, const uint8_t *, uint32_t);
 static enum Result writeClusterChain(struct CommandContext *,
     struct FatNode *, uint32_t, const uint8_t *, uint32_t);
 static enum Result writeNodeAccess(struct CommandContext *, struct FatNode *,
@@ -86,8 +114,9 @@ static enum Result writeSector(struct CommandContext *, struct FatHandle *,
 #endif
 /*----------------------------------------------------------------------------*/
 #if defined(CONFIG_UNICODE) && defined(CONFIG_WRITE)
-static enum Result uniqueNamePropose(struct CommandContext *,
-    const struct FatNode *, char *);
+static size_t proposeShortNames(struct FatNodeTemplate *, size_t);
+static void uniqueNameCheck(const char *, const char *, unsigned int *);
+static enum Result uniqueNamePropose(char *, unsigned int);
 #endif
 /*----------------------------------------------------------------------------*/
 /* Filesystem handle functions */
@@ -138,54 +167,152 @@ const struct FsNodeClass * const FatNode = &(const struct FsNodeClass){
 static enum Result allocateBuffers(struct FatHandle *handle,
     const struct Fat32Config * const config)
 {
+  /* Public size estimations should cover internal structures */
+  static_assert(sizeof(struct CommandContext)
+      <= SECTOR_SIZE + 2 * sizeof(uint32_t),
+      "Incorrect context size estimation");
+  static_assert(sizeof(struct FatNode) + sizeof(PoolLink) <= FAT32_NODE_SIZE,
+      "Incorrect node size estimation");
+
+  const size_t alignment = FAT32_ARENA_ALIGNMENT(config->alignment);
   const size_t contextCount = MAX(config->threads, 1);
+  const size_t contextWidth = FAT32_ALIGN(sizeof(struct CommandContext),
+      alignment);
 
   if (!config->nodes)
     return E_VALUE;
+  if (alignment & (alignment - 1))
+    return E_VALUE;
 
 #ifdef CONFIG_THREADS
+  size_t dirLocks = 0;
   enum Result res;
 
-  /* Create consistency and memory locks */
-  res = mutexInit(&handle->consistencyMutex);
+  /* Create locks for opened files, directories and tables */
+  res = mutexInit(&handle->fileMutex);
   if (res != E_OK)
     return res;
 
-  res = mutexInit(&handle->memoryMutex);
-  if (res != E_OK)
+  while (dirLocks < DIR_LOCK_COUNT)
   {
-    mutexDeinit(&handle->consistencyMutex);
-    return res;
+    res = rwLockInit(&handle->dirLocks[dirLocks]);
+    if (res != E_OK)
+      break;
+    ++dirLocks;
+  }
+
+  if (res == E_OK)
+    res = rwLockInit(&handle->tableLock);
+
+#ifndef LOCK_FREE_ATOMICS
+  if (res == E_OK)
+  {
+    res = mutexInit(&handle->memoryMutex);
+    if (res != E_OK)
+      rwLockDeinit(&handle->tableLock);
   }
-#endif /* CONFIG_THREADS */
 
+  handle->pools.contexts.mutex = &handle->memoryMutex;
+  handle->pools.nodes.mutex = &handle->memoryMutex;
 #ifdef CONFIG_WRITE
-  if (!pointerArrayInit(&handle->openedFiles, config->nodes))
+  handle->pools.reserved.mutex = &handle->memoryMutex;
+#endif
+#endif
+
+  /* Semaphore counts free contexts for the waiting threads */
+  handle->timeout = config->timeout;
+
+  if (res == E_OK && handle->timeout)
   {
-    freeBuffers(handle, FREE_LOCKS);
-    return E_MEMORY;
+    res = semInit(&handle->contextSemaphore, (int)contextCount);
+    if (res != E_OK)
+    {
+#ifndef LOCK_FREE_ATOMICS
+      mutexDeinit(&handle->memoryMutex);
+#endif
+      rwLockDeinit(&handle->tableLock);
+    }
   }
-#endif /* CONFIG_WRITE */
 
-  /* Allocate context pool */
-  if (!allocatePool(&handle->pools.contexts, contextCount,
-      sizeof(struct CommandContext)))
+  if (res != E_OK)
   {
-    freeBuffers(handle, FREE_NODE_LIST);
-    return E_MEMORY;
+    while (dirLocks--)
+      rwLockDeinit(&handle->dirLocks[dirLocks]);
+    mutexDeinit(&handle->fileMutex);
+    return res;
   }
-  DEBUG_PRINT(2, "fat32: context pool:   %zu\n", (sizeof(struct CommandContext)
-      + sizeof(struct CommandContext *)) * contextCount);
+#endif /* CONFIG_THREADS */
+
+#ifdef CONFIG_WRITE
+  handle->dirtyNodes = NULL;
+#endif
 
-  /* Allocate node pool */
-  if (!allocatePool(&handle->pools.nodes, config->nodes,
-      sizeof(struct FatNode)))
+  if (config->arena != NULL)
   {
-    freeBuffers(handle, FREE_CONTEXT_POOL);
-    return E_MEMORY;
+    /* Pools are placed in the memory region provided by the user */
+    uint8_t *position = config->arena;
+    const uint8_t * const end = position + config->size;
+
+    if (!placePool(&handle->pools.contexts, &position, end, contextCount,
+        contextWidth, alignment))
+    {
+      freeBuffers(handle, FREE_LOCKS);
+      return E_MEMORY;
+    }
+
+#ifdef CONFIG_WRITE
+    if (!placePool(&handle->pools.reserved, &position, end,
+        RESERVED_CONTEXT_COUNT, contextWidth, alignment))
+    {
+      freeBuffers(handle, FREE_CONTEXT_POOL);
+      return E_MEMORY;
+    }
+#endif
+
+    if (!placePool(&handle->pools.nodes, &position, end, config->nodes,
+        sizeof(struct FatNode), alignof(struct FatNode)))
+    {
+      freeBuffers(handle, FREE_RESERVED_POOL);
+      return E_MEMORY;
+    }
+  }
+  else
+  {
+    /* Allocate context pool */
+    if (!allocatePool(&handle->pools.contexts, contextCount, contextWidth,
+        alignment))
+    {
+      freeBuffers(handle, FREE_LOCKS);
+      return E_MEMORY;
+    }
+
+#ifdef CONFIG_WRITE
+    /* Allocate pool of reserved contexts */
+    if (!allocatePool(&handle->pools.reserved, RESERVED_CONTEXT_COUNT,
+        contextWidth, alignment))
+    {
+      freeBuffers(handle, FREE_CONTEXT_POOL);
+      return E_MEMORY;
+    }
+#endif
+
+    /* Allocate node pool */
+    if (!allocatePool(&handle->pools.nodes, config->nodes,
+        sizeof(struct FatNode), alignof(struct FatNode)))
+    {
+      freeBuffers(handle, FREE_RESERVED_POOL);
+      return E_MEMORY;
+    }
   }
+
+  DEBUG_PRINT(2, "fat32: context pool:   %zu\n",
+      (contextWidth + sizeof(PoolLink)) * contextCount);
+#ifdef CONFIG_WRITE
+  DEBUG_PRINT(2, "fat32: reserved pool:  %zu\n",
+      (contextWidth + sizeof(PoolLink)) * RESERVED_CONTEXT_COUNT);
+#endif
   DEBUG_PRINT(2, "fat32: node pool:      %zu\n", (sizeof(struct FatNode)
-      + sizeof(struct FatNode *)) * config->nodes);
+      + sizeof(PoolLink)) * config->nodes);
 
   return E_OK;
 }
@@ -258,6 +385,10 @@ static enum Result fetchNode(struct CommandContext *context,
   uint8_t found = 0; /* LFN chunks found */
 #endif
 
+#if defined(CONFIG_UNICODE) && defined(CONFIG_NAME_CACHE)
+  char16_t nameBuffer[CONFIG_NAME_LENGTH / 2];
+#endif
+
   while ((res = fetchEntry(context, node)) == E_OK)
   {
     /* Sector reload is not needed in current context */
@@ -284,6 +415,20 @@ static enum Result fetchNode(struct CommandContext *context,
       extractLongName(nameChunk, entry);
       nameChunk[LFN_ENTRY_LENGTH] = 0;
       node->nameLength += uLengthFromUtf16(nameChunk);
+
+#ifdef CONFIG_NAME_CACHE
+      const uint8_t sequence = (uint8_t)(entry->ordinal & ~LFN_LAST);
+
+      /* Chunks of names longer than the buffer are skipped */
+      if (sequence && sequence <= node->lfn
+          && node->lfn <= calcLfnCount(CONFIG_NAME_LENGTH))
+      {
+        if (entry->ordinal & LFN_LAST)
+          nameBuffer[sequence * LFN_ENTRY_LENGTH] = 0;
+        memcpy(&nameBuffer[(sequence - 1) * LFN_ENTRY_LENGTH], nameChunk,
+            LFN_ENTRY_LENGTH * sizeof(char16_t));
+      }
+#endif
     }
 #endif
 
@@ -317,6 +462,25 @@ static enum Result fetchNode(struct CommandContext *context,
   node->nameLength = computeShortNameLength(entry);
 #endif
 
+#ifdef CONFIG_NAME_CACHE
+#ifdef CONFIG_UNICODE
+  if (node->lfn)
+  {
+    /* Names longer than the buffer are read from the volume on demand */
+    if (node->lfn <= calcLfnCount(CONFIG_NAME_LENGTH))
+    {
+      uFromUtf16(node->name, nameBuffer, sizeof(node->name));
+      node->flags |= FAT_FLAG_NAME;
+    }
+  }
+  else
+#endif
+  {
+    extractShortName(node->name, entry);
+    node->flags |= FAT_FLAG_NAME;
+  }
+#endif
+
   return E_OK;
 }
 /*----------------------------------------------------------------------------*/
@@ -357,20 +521,27 @@ static void freeBuffers(struct FatHandle *handle, enum Cleanup step)
       freePool(&handle->pools.nodes);
       /* Falls through */
 
-    case FREE_CONTEXT_POOL:
-      freePool(&handle->pools.contexts);
-      /* Falls through */
-
-    case FREE_NODE_LIST:
+    case FREE_RESERVED_POOL:
 #ifdef CONFIG_WRITE
-      pointerArrayDeinit(&handle->openedFiles);
+      freePool(&handle->pools.reserved);
 #endif
       /* Falls through */
 
+    case FREE_CONTEXT_POOL:
+      freePool(&handle->pools.contexts);
+      /* Falls through */
+
     case FREE_LOCKS:
 #ifdef CONFIG_THREADS
+      if (handle->timeout)
+        semDeinit(&handle->contextSemaphore);
+#ifndef LOCK_FREE_ATOMICS
       mutexDeinit(&handle->memoryMutex);
-      mutexDeinit(&handle->consistencyMutex);
+#endif
+      rwLockDeinit(&handle->tableLock);
+      for (size_t i = 0; i < DIR_LOCK_COUNT; ++i)
+        rwLockDeinit(&handle->dirLocks[i]);
+      mutexDeinit(&handle->fileMutex);
 #endif
       break;
   }
@@ -379,6 +550,8 @@ static void freeBuffers(struct FatHandle *handle, enum Cleanup step)
 static enum Result getNextCluster(struct CommandContext *context,
     struct FatHandle *handle, uint32_t *cluster)
 {
+  updateCounter(handle, FAT_COUNTER_TABLE_LOOKUPS, 1);
+
   const enum Result res = readSector(context, handle, handle->tableSector
       + (*cluster >> CELL_COUNT_EXP));
 
@@ -405,6 +578,7 @@ static enum Result mountStorage(struct FatHandle *handle)
   enum Result res;
 
   assert(context != NULL);
+  setTraceOrigin(context, FAT32_ORIGIN_MOUNT);
 
   /* Read first sector */
   res = readSector(context, handle, 0);
@@ -429,17 +603,28 @@ static enum Result mountStorage(struct FatHandle *handle)
 
   /* Calculate sectors per cluster count */
   unsigned int sizePow = boot->sectorsPerCluster;
+  uint8_t clusterSize = 0;
 
-  handle->clusterSize = 0;
   while (sizePow >>= 1)
-    ++handle->clusterSize;
+    ++clusterSize;
+
+#ifdef CONFIG_CLUSTER_SIZE
+  /* Check cluster size, fixed size of 2 ^ CLUSTER_EXP sectors allowed */
+  if (clusterSize != CLUSTER_EXP)
+  {
+    res = E_DEVICE;
+    goto exit;
+  }
+#else
+  handle->clusterSize = clusterSize;
+#endif
 
   handle->tableSector = fromLittleEndian16(boot->reservedSectors);
   handle->dataSector = handle->tableSector
       + boot->tableCount * fromLittleEndian32(boot->sectorsPerTable);
   handle->rootCluster = fromLittleEndian32(boot->rootCluster);
 
-  DEBUG_PRINT(1, "fat32: cluster size:   %u\n", 1U << handle->clusterSize);
+  DEBUG_PRINT(1, "fat32: cluster size:   %u\n", 1U << clusterExp(handle));
   DEBUG_PRINT(1, "fat32: table sector:   %"PRIu32"\n", handle->tableSector);
   DEBUG_PRINT(1, "fat32: data sector:    %"PRIu32"\n", handle->dataSector);
 
@@ -447,8 +632,9 @@ static enum Result mountStorage(struct FatHandle *handle)
   handle->tableCount = boot->tableCount;
   handle->tableSize = fromLittleEndian32(boot->sectorsPerTable);
   handle->clusterCount = ((fromLittleEndian32(boot->sectorsPerPartition)
-      - handle->dataSector) >> handle->clusterSize) + CLUSTER_OFFSET;
+      - handle->dataSector) >> clusterExp(handle)) + CLUSTER_OFFSET;
   handle->infoSector = fromLittleEndian16(boot->infoSector);
+  memset(handle->gapHints, 0, sizeof(handle->gapHints));
 
   DEBUG_PRINT(1, "fat32: info sector:    %"PRIu16"\n", handle->infoSector);
   DEBUG_PRINT(1, "fat32: table copies:   %"PRIu8"\n", handle->tableCount);
@@ -482,13 +668,14 @@ exit:
   return res;
 }
 /*----------------------------------------------------------------------------*/
-static enum Result readBuffer(struct FatHandle *handle, uint32_t sector,
-    uint8_t *buffer, uint32_t count)
+static enum Result readBuffer(struct CommandContext *context,
+    struct FatHandle *handle, uint32_t sector, uint8_t *buffer, uint32_t count)
 {
   const uint64_t position = (uint64_t)sector << SECTOR_EXP;
   const uint32_t length = count << SECTOR_EXP;
   enum Result res;
 
+  traceCommand(context, handle, FAT32_TRACE_READ, sector, count, NULL);
   ifSetParam(handle->interface, IF_ACQUIRE, NULL);
 
   res = ifSetParam(handle->interface, IF_POSITION_64, &position);
@@ -499,6 +686,13 @@ static enum Result readBuffer(struct FatHandle *handle, uint32_t sector,
   }
 
   ifSetParam(handle->interface, IF_RELEASE, NULL);
+  traceCommand(context, handle, FAT32_TRACE_READ, sector, count, &res);
+
+  if (res == E_OK)
+  {
+    updateCounter(handle, FAT_COUNTER_BUFFER_READS, 1);
+    updateCounter(handle, FAT_COUNTER_READ_SECTORS, count);
+  }
   return res;
 }
 /*----------------------------------------------------------------------------*/
@@ -514,8 +708,10 @@ static enum Result readClusterChain(struct CommandContext *context,
   /* Seek to the requested position */
   if (currentPosition != dataPosition)
   {
+    lockTableShared(context, handle);
     const enum Result res = seekClusterChain(context, handle, currentPosition,
         dataPosition, node->payloadCluster, &currentCluster);
+    unlockTableShared(handle);
 
     if (res != E_OK)
       return res;
@@ -527,17 +723,19 @@ static enum Result readClusterChain(struct CommandContext *context,
   {
     currentSector = sectorInCluster(handle, currentPosition);
     if (!currentSector && !(currentPosition & (SECTOR_SIZE - 1)))
-      currentSector = 1U << handle->clusterSize;
+      currentSector = 1U << clusterExp(handle);
   }
   else
     currentSector = 0;
 
   while (dataLength)
   {
-    if (currentSector >= 1U << handle->clusterSize)
+    if (currentSector >= 1U << clusterExp(handle))
     {
       /* Try to load the next cluster */
+      lockTableShared(context, handle);
       const enum Result res = getNextCluster(context, handle, &currentCluster);
+      unlockTableShared(handle);
 
       if (res != E_OK)
         return res;
@@ -570,12 +768,12 @@ static enum Result readClusterChain(struct CommandContext *context,
     else
     {
       /* Position is aligned along the first byte of the sector */
-      chunk = ((1U << handle->clusterSize) - currentSector) << SECTOR_EXP;
+      chunk = ((1U << clusterExp(handle)) - currentSector) << SECTOR_EXP;
       chunk = MIN(chunk, dataLength);
       chunk &= ~(SECTOR_SIZE - 1); /* Align along sector boundary */
 
       /* Read data to the buffer directly without additional copying */
-      const enum Result res = readBuffer(handle, sector, dataBuffer,
+      const enum Result res = readBuffer(context, handle, sector, dataBuffer,
           chunk >> SECTOR_EXP);
 
       if (res != E_OK)
@@ -595,6 +793,40 @@ static enum Result readClusterChain(struct CommandContext *context,
   return E_OK;
 }
 /*----------------------------------------------------------------------------*/
+static enum Result readDirRecord(struct CommandContext *context,
+    struct FatNode *node, struct Fat32DirRecord *record, size_t length)
+{
+  struct FatHandle * const handle = (struct FatHandle *)node->handle;
+  const uint32_t sector = calcSectorNumber(handle, node->parentCluster)
+      + ENTRY_SECTOR(node->parentIndex);
+  enum Result res;
+
+  /* Sector is usually still loaded after the node fetching */
+  res = readSector(context, handle, sector);
+  if (res != E_OK)
+    return res;
+
+  const struct DirEntryImage * const entry =
+      getDirEntry(context, node->parentIndex);
+  const uint16_t rawDate = fromLittleEndian16(entry->date);
+  const uint16_t rawTime = fromLittleEndian16(entry->time);
+
+  /* Entries with incorrect timestamps are not treated as errors */
+  if (!rawDateTimeToTimestamp(&record->time, rawDate, rawTime))
+    record->time = 0;
+
+  record->attributes = entry->flags & (FLAG_RO | FLAG_HIDDEN | FLAG_SYSTEM
+      | FLAG_DIR | FLAG_ARCHIVED);
+  record->size = (node->flags & FAT_FLAG_FILE) ? node->payloadSize : 0;
+  record->length = (uint16_t)length;
+  readNodeAccess(node, &record->access);
+  readNodeId(node, &record->id);
+
+  size_t read;
+  return readNodeName(context, node, record->name,
+      length - offsetof(struct Fat32DirRecord, name), &read);
+}
+/*----------------------------------------------------------------------------*/
 static void readNodeAccess(struct FatNode *node, FsAccess *buffer)
 {
   FsAccess value = FS_ACCESS_READ;
@@ -614,7 +846,7 @@ static enum Result readNodeCapacity(struct CommandContext *context,
   if (node->flags & FAT_FLAG_FILE)
   {
     struct FatHandle * const handle = (struct FatHandle *)node->handle;
-    const FsCapacity mask = (1U << (handle->clusterSize + SECTOR_EXP)) - 1;
+    const FsCapacity mask = (1U << (clusterExp(handle) + SECTOR_EXP)) - 1;
 
     value = ((FsCapacity)node->payloadSize + mask) & ~mask;
   }
@@ -626,7 +858,7 @@ static enum Result readNodeCapacity(struct CommandContext *context,
     if (res == E_OK)
     {
       struct FatHandle * const handle = (struct FatHandle *)node->handle;
-      const uint32_t size = 1U << (handle->clusterSize + SECTOR_EXP);
+      const uint32_t size = 1U << (clusterExp(handle) + SECTOR_EXP);
 
       value = (FsCapacity)size * clusters;
     }
@@ -685,6 +917,18 @@ static enum Result readNodeName(struct CommandContext *context,
   if (length <= node->nameLength)
     return E_VALUE;
 
+#ifdef CONFIG_NAME_CACHE
+  if (node->flags & FAT_FLAG_NAME)
+  {
+    /* Name was decoded during entry fetching, no I/O is required */
+    const size_t count = strlen(node->name) + 1;
+
+    memcpy(buffer, node->name, count);
+    *read = count;
+    return E_OK;
+  }
+#endif
+
 #ifdef CONFIG_UNICODE
   if (hasLongName(node))
   {
@@ -741,11 +985,15 @@ static enum Result readSector(struct CommandContext *context,
     struct FatHandle *handle, uint32_t sector)
 {
   if (context->sector == sector)
+  {
+    updateCounter(handle, FAT_COUNTER_CACHED_READS, 1);
     return E_OK;
+  }
 
   const uint64_t position = (uint64_t)sector << SECTOR_EXP;
   enum Result res;
 
+  traceCommand(context, handle, FAT32_TRACE_READ, sector, 1, NULL);
   ifSetParam(handle->interface, IF_ACQUIRE, NULL);
 
   res = ifSetParam(handle->interface, IF_POSITION_64, &position);
@@ -761,6 +1009,13 @@ static enum Result readSector(struct CommandContext *context,
   }
 
   ifSetParam(handle->interface, IF_RELEASE, NULL);
+  traceCommand(context, handle, FAT32_TRACE_READ, sector, 1, &res);
+
+  if (res == E_OK)
+  {
+    updateCounter(handle, FAT_COUNTER_SECTOR_READS, 1);
+    updateCounter(handle, FAT_COUNTER_READ_SECTORS, 1);
+  }
   return res;
 }
 /*----------------------------------------------------------------------------*/
@@ -768,25 +1023,21 @@ static enum Result seekClusterChain(struct CommandContext *context,
     struct FatHandle *handle, uint32_t currentPosition, uint32_t nextPosition,
     uint32_t startCluster, uint32_t *currentCluster)
 {
-  uint32_t clusterCount;
+  /*
+   * Position on the cluster boundary belongs to the end of the previous
+   * cluster, therefore indices of clusters are calculated for both positions.
+   */
+  const unsigned int exp = clusterExp(handle) + SECTOR_EXP;
+  uint32_t clusterCount = nextPosition ? (nextPosition - 1) >> exp : 0;
   uint32_t clusterNumber;
 
   if (currentPosition > nextPosition)
-  {
     clusterNumber = startCluster;
-    clusterCount = nextPosition;
-  }
   else
   {
     clusterNumber = *currentCluster;
-    clusterCount = nextPosition - currentPosition;
-  }
-  clusterCount >>= handle->clusterSize + SECTOR_EXP;
-
-  if (clusterCount && !sectorInCluster(handle, nextPosition)
-      && !(nextPosition & (SECTOR_SIZE - 1)))
-  {
-    --clusterCount;
+    if (currentPosition)
+      clusterCount -= (currentPosition - 1) >> exp;
   }
 
   while (clusterCount--)
@@ -926,6 +1177,7 @@ static enum Result allocateCluster(struct CommandContext *context,
           currentCluster, *cluster);
       handle->lastAllocated = currentCluster;
       *cluster = currentCluster;
+      updateCounter(handle, FAT_COUNTER_ALLOCATIONS, 1);
 
       /* Update information sector */
       res = readSector(context, handle, handle->infoSector);
@@ -951,6 +1203,77 @@ static enum Result allocateCluster(struct CommandContext *context,
 #endif
 /*----------------------------------------------------------------------------*/
 #ifdef CONFIG_WRITE
+static enum Result allocatePayload(struct CommandContext *context,
+    const struct FatNode *root, struct FatNodeTemplate *node)
+{
+  struct FatHandle * const handle = (struct FatHandle *)root->handle;
+  enum Result res = E_OK;
+
+  if (node->data == NULL)
+  {
+    /* Allocate a cluster chain for the directory */
+    lockTable(context, handle);
+    res = allocateCluster(context, handle, &node->payloadCluster);
+    unlockTable(handle);
+
+    if (res == E_OK)
+    {
+      res = setupDirCluster(context, handle, root->payloadCluster,
+          node->payloadCluster, node->time);
+    }
+  }
+  else if (node->data->length)
+  {
+    struct FatNode staticNode;
+    allocateStaticNode(handle, &staticNode);
+
+    res = writeClusterChain(context, &staticNode, 0,
+        node->data->data, (uint32_t)node->data->length);
+    if (res == E_OK)
+      node->payloadCluster = staticNode.payloadCluster;
+  }
+
+  return res;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+/* Check that the directory is not located inside the ancestor directory */
+static enum Result checkDirNesting(struct CommandContext *context,
+    struct FatHandle *handle, uint32_t directory, uint32_t ancestor)
+{
+  uint32_t current = directory;
+
+  for (uint32_t depth = 0; current != handle->rootCluster; ++depth)
+  {
+    if (current == ancestor)
+      return E_VALUE;
+
+    /* Directory tree is too deep or looped */
+    if (depth >= MAX_TREE_DEPTH)
+      return E_ERROR;
+
+    const enum Result res = readSector(context, handle,
+        calcSectorNumber(handle, current));
+
+    if (res != E_OK)
+      return res;
+
+    /* Parent directory is referenced by the second entry */
+    const uint32_t parent = makeClusterNumber(getDirEntry(context, 1));
+
+    /* Legacy volumes may contain parent entries pointing to themselves */
+    if (parent == RESERVED_CLUSTER || parent == current)
+      current = handle->rootCluster;
+    else
+      current = parent;
+  }
+
+  return current == ancestor ? E_VALUE : E_OK;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
 static enum Result clearCluster(struct CommandContext *context,
     struct FatHandle *handle, uint32_t cluster)
 {
@@ -965,7 +1288,7 @@ static enum Result clearCluster(struct CommandContext *context,
     if (res != E_OK)
       return res;
   }
-  while (sector & ((1U << handle->clusterSize) - 1));
+  while (sector & ((1U << clusterExp(handle)) - 1));
 
   return E_OK;
 }
@@ -976,155 +1299,428 @@ static void clearDirtyFlag(struct FatNode *node)
 {
   struct FatHandle * const handle = (struct FatHandle *)node->handle;
 
-  for (size_t i = 0; i < pointerArraySize(&handle->openedFiles); ++i)
-  {
-    if (*pointerArrayAt(&handle->openedFiles, i) == node)
-    {
-      pointerArrayEraseBySwap(&handle->openedFiles, i);
-      break;
-    }
-  }
+  if (node->dirtyPrev != NULL)
+    node->dirtyPrev->dirtyNext = node->dirtyNext;
+  else
+    handle->dirtyNodes = node->dirtyNext;
 
+  if (node->dirtyNext != NULL)
+    node->dirtyNext->dirtyPrev = node->dirtyPrev;
+
+  node->dirtyNext = NULL;
+  node->dirtyPrev = NULL;
   node->flags &= ~FAT_FLAG_DIRTY;
 }
 #endif
 /*----------------------------------------------------------------------------*/
 #ifdef CONFIG_WRITE
-static enum Result createNode(struct CommandContext *context,
-    const struct FatNode *root, bool directory, const char *nodeName,
-    FsAccess nodeAccess, uint32_t nodePayloadCluster, time64_t nodeAccessTime)
+/*
+ * Live entries are moved towards the beginning of the directory. Entries
+ * are staged in the sector buffer of the additional context.
+ */
+static enum Result compactDirectory(struct CommandContext *context,
+    struct CommandContext *staging, struct FatHandle *handle, uint32_t cluster)
 {
-  struct FatHandle * const handle = (struct FatHandle *)root->handle;
-  char shortName[NAME_LENGTH];
-
-  if (!strlen(nodeName))
-    return E_VALUE;
-
-  const bool longNameRequired = !fillShortName(shortName, nodeName, !directory);
+  struct DirEntryImage * const staged = staging->buffer.entry;
+  const uint16_t entriesPerCluster = calcNodeCount(handle);
+  uint32_t readCluster = cluster;
+  uint32_t writeCluster = cluster;
+  uint16_t readIndex = 0;
+  uint16_t writeIndex = 0;
+  bool moved = false;
+  enum Result res;
 
-#ifdef CONFIG_UNICODE
-  const size_t nameLength = uLengthToUtf16(nodeName) + 1;
-  char16_t nameBuffer[CONFIG_NAME_LENGTH / 2];
+  /* Positions of the first live entry of the current read sector */
+  struct FatRelocation relocation = {
+      .sourceCluster = RESERVED_CLUSTER
+  };
 
-  if (nameLength > ARRAY_SIZE(nameBuffer))
-    return E_VALUE;
-#else
-  if (longNameRequired)
-    return E_VALUE;
-#endif
+  memset(staged, 0, SECTOR_SIZE);
 
-  uint16_t chunks = 0;
-  enum Result res;
+  while (1)
+  {
+    if (!ENTRY_INDEX(readIndex) || readIndex >= entriesPerCluster)
+    {
+      /* Entries of the processed sector are still in the buffer */
+      if (relocation.sourceCluster != RESERVED_CLUSTER)
+        relocateNodes(context, handle, &relocation);
+      relocation.sourceCluster = RESERVED_CLUSTER;
+    }
 
-#ifdef CONFIG_UNICODE
-  /* Propose new short name when selected name already exists */
-  res = uniqueNamePropose(context, root, shortName);
-  if (res != E_OK)
-    return res;
+    if (readIndex >= entriesPerCluster)
+    {
+      res = getNextCluster(context, handle, &readCluster);
 
-  if (longNameRequired)
-  {
-    /* Name length contains terminating character */
-    uToUtf16(nameBuffer, nodeName, nameLength);
-    /* Append additional entry when last chunk is incomplete */
-    chunks = (nameLength + LFN_ENTRY_LENGTH - 2) / LFN_ENTRY_LENGTH;
-  }
-#endif
+      if (res == E_EMPTY)
+        break;
+      else if (res != E_OK)
+        return res;
 
-  struct FatNode staticNode;
-  allocateStaticNode(handle, &staticNode);
+      readIndex = 0;
+    }
 
-  /* Find suitable space within the directory */
-  res = findGap(context, &staticNode, root, chunks + 1);
+    res = readSector(context, handle, calcSectorNumber(handle, readCluster)
+        + ENTRY_SECTOR(readIndex));
+    if (res != E_OK)
+      return res;
 
-#ifdef CONFIG_UNICODE
-  if (chunks && res == E_OK)
-  {
-    const uint8_t checksum = calcLongNameChecksum(shortName, NAME_LENGTH);
+    const struct DirEntryImage * const entry = getDirEntry(context, readIndex);
 
-    /* Save start cluster and index values before filling the chain */
-    staticNode.nameCluster = staticNode.parentCluster;
-    staticNode.nameIndex = staticNode.parentIndex;
+    /* Check for the end of the directory */
+    if (!entry->name[0])
+      break;
 
-    for (uint16_t current = chunks; current && res == E_OK; --current)
+    if (isLiveEntry(entry))
     {
-      const uint32_t sector = calcSectorNumber(handle, staticNode.parentCluster)
-          + ENTRY_SECTOR(staticNode.parentIndex);
+      if (writeIndex >= entriesPerCluster)
+      {
+        /*
+         * Chain is not modified yet, next cluster always exists. Staged
+         * sector is already written and the staging buffer is used to keep
+         * the read sector loaded.
+         */
+        res = getNextCluster(staging, handle, &writeCluster);
+        if (res != E_OK)
+          return res;
 
-      res = readSector(context, handle, sector);
-      if (res != E_OK)
-        break;
+        memset(staged, 0, SECTOR_SIZE);
+        staging->sector = RESERVED_SECTOR;
+        writeIndex = 0;
 
-      struct DirEntryImage * const entry =
-          getDirEntry(context, staticNode.parentIndex);
-      const uint16_t offset = (current - 1) * LFN_ENTRY_LENGTH;
-      const uint16_t left = nameLength - 1 - offset;
+        if (relocation.sourceCluster != RESERVED_CLUSTER)
+          relocation.nextCluster = writeCluster;
+      }
+
+      if (relocation.sourceCluster == RESERVED_CLUSTER)
+      {
+        relocation = (struct FatRelocation){
+            .sourceCluster = readCluster,
+            .sourceIndex = readIndex,
+            .destinationCluster = writeCluster,
+            .nextCluster = RESERVED_CLUSTER,
+            .destinationIndex = writeIndex
+        };
+      }
 
-      fillLongName(entry, nameBuffer + offset,
-          left > LFN_ENTRY_LENGTH ? LFN_ENTRY_LENGTH : left);
-      fillLongNameEntry(entry, current, chunks, checksum);
+      staged[ENTRY_INDEX(writeIndex)] = *entry;
 
-      ++staticNode.parentIndex;
+      if (readCluster != writeCluster || readIndex != writeIndex)
+        moved = true;
 
-      if (!(staticNode.parentIndex & (ENTRY_EXP - 1)))
+      /* Sector is written only when at least one entry has been moved */
+      if (!ENTRY_INDEX(++writeIndex))
       {
-        /* Write back updated sector when switching sectors */
-        res = writeSector(context, handle, sector);
-        if (res != E_OK)
-          break;
-
-        if (staticNode.parentIndex >= calcNodeCount(handle))
+        if (moved)
         {
-          /* Read next cluster */
-          res = getNextCluster(context, handle, &staticNode.parentCluster);
+          const uint32_t sector = calcSectorNumber(handle, writeCluster)
+              + ENTRY_SECTOR(writeIndex - 1);
+
+          res = writeBuffer(context, handle, sector, (const uint8_t *)staged, 1);
           if (res != E_OK)
-            break;
+            return res;
 
-          staticNode.parentIndex = 0;
+          if (context->sector == sector)
+            context->sector = RESERVED_SECTOR;
         }
+
+        memset(staged, 0, SECTOR_SIZE);
+        moved = false;
       }
     }
+
+    ++readIndex;
   }
-#endif
 
-  if (res == E_OK)
+  /* Last read sector is still loaded when the end marker is found */
+  if (relocation.sourceCluster != RESERVED_CLUSTER)
+    relocateNodes(context, handle, &relocation);
+
+  /* Directory does not contain deleted entries */
+  if (readCluster == writeCluster && readIndex == writeIndex)
+    return E_OK;
+
+  if (writeIndex < entriesPerCluster)
   {
-    const uint32_t sector = calcSectorNumber(handle, staticNode.parentCluster)
-        + ENTRY_SECTOR(staticNode.parentIndex);
+    const uint32_t firstSector = calcSectorNumber(handle, writeCluster);
+    const uint32_t lastSector = calcSectorNumber(handle, writeCluster + 1);
+    uint32_t sector = firstSector + ENTRY_SECTOR(writeIndex);
+
+    /* Remaining entries of the last cluster are cleared */
+    for (; sector < lastSector; ++sector)
+    {
+      res = writeBuffer(context, handle, sector, (const uint8_t *)staged, 1);
+      if (res != E_OK)
+        return res;
+
+      if (context->sector == sector)
+        context->sector = RESERVED_SECTOR;
+
+      memset(staged, 0, SECTOR_SIZE);
+    }
+  }
+
+  /* Trailing clusters without live entries are released */
+  uint32_t next = writeCluster;
+
+  lockTable(context, handle);
+  res = getNextCluster(context, handle, &next);
+
+  if (res == E_OK)
+  {
+    /* Sector with the cell of the last cluster is already loaded */
+    const uint32_t eoc = toLittleEndian32(CLUSTER_EOC_VAL);
+
+    memcpy(&context->buffer.cluster[CELL_INDEX(writeCluster)], &eoc,
+        sizeof(eoc));
+    res = updateTable(context, handle, writeCluster >> CELL_COUNT_EXP);
 
-    res = readSector(context, handle, sector);
     if (res == E_OK)
+      res = freeChain(context, handle, next);
+  }
+  else if (res == E_EMPTY)
+    res = E_OK;
+
+  unlockTable(handle);
+  return res;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+/* Directory entries of the nodes are created in a single directory pass */
+static enum Result createEntries(struct CommandContext *context,
+    const struct FatNode *root, struct FatNodeTemplate *templates,
+    size_t count, size_t *created)
+{
+  struct FatHandle * const handle = (struct FatHandle *)root->handle;
+  uint16_t chainLength = 0;
+  size_t available;
+  enum Result res;
+
+  for (size_t i = 0; i < count; ++i)
+    chainLength += templates[i].chunks + 1;
+
+  struct FatNode staticNode;
+  allocateStaticNode(handle, &staticNode);
+
+  /*
+   * Find suitable space and collect similar short names in a single pass.
+   * Nodes with names that cannot be used are excluded, preceding nodes
+   * are still created.
+   */
+  res = findGap(context, &staticNode, root, chainLength, templates, count,
+      &available);
+  if (res != E_OK)
+  {
+    freeStaticNode(&staticNode);
+    return res;
+  }
+
+  uint16_t remaining = 0;
+
+  for (size_t i = 0; i < available; ++i)
+    remaining += templates[i].chunks + 1;
+
+  for (size_t i = 0; i < available && res == E_OK; ++i)
+  {
+    const struct FatNodeTemplate * const current = &templates[i];
+
+#ifdef CONFIG_UNICODE
+    const uint8_t checksum = calcLongNameChecksum(current->shortName,
+        NAME_LENGTH);
+    char16_t nameBuffer[CONFIG_NAME_LENGTH / 2];
+
+    if (current->chunks)
+      uToUtf16(nameBuffer, current->name, current->nameLength);
+#endif
+
+    for (int chunk = current->chunks; chunk >= 0 && res == E_OK; --chunk)
     {
+      const uint32_t sector = calcSectorNumber(handle, staticNode.parentCluster)
+          + ENTRY_SECTOR(staticNode.parentIndex);
+
+      res = readSector(context, handle, sector);
+      if (res != E_OK)
+        break;
+
       struct DirEntryImage * const entry =
           getDirEntry(context, staticNode.parentIndex);
 
-      memcpy(entry->filename, shortName, NAME_LENGTH);
-      fillDirEntry(entry, directory, nodeAccess, nodePayloadCluster,
-          nodeAccessTime);
+      if (chunk == current->chunks)
+      {
+        templates[i].firstCluster = staticNode.parentCluster;
+        templates[i].firstIndex = staticNode.parentIndex;
+      }
 
-      freeStaticNode(&staticNode);
-      res = writeSector(context, handle, sector);
+#ifdef CONFIG_UNICODE
+      if (chunk)
+      {
+        const uint16_t offset = (chunk - 1) * LFN_ENTRY_LENGTH;
+        const uint16_t left = current->nameLength - 1 - offset;
+
+        fillLongName(entry, nameBuffer + offset,
+            left > LFN_ENTRY_LENGTH ? LFN_ENTRY_LENGTH : left);
+        fillLongNameEntry(entry, (uint8_t)chunk, current->chunks, checksum);
+      }
+      else
+#endif
+      {
+        if (current->origin != NULL)
+        {
+          /* Attributes, time, payload and size of the moved node are kept */
+          *entry = *current->origin;
+        }
+        else
+        {
+          fillDirEntry(entry, current->data == NULL, current->access,
+              current->payloadCluster, current->time);
+
+          /* Initial payload of the file */
+          if (current->data != NULL)
+            entry->size = toLittleEndian32((uint32_t)current->data->length);
+        }
+
+        memcpy(entry->filename, current->shortName, NAME_LENGTH);
+      }
+
+      ++staticNode.parentIndex;
+      --remaining;
+
+      if (!remaining || !ENTRY_INDEX(staticNode.parentIndex))
+      {
+        /* Write back updated sector when switching sectors */
+        res = writeSector(context, handle, sector);
+        if (res != E_OK)
+          break;
+
+        if (remaining && staticNode.parentIndex >= calcNodeCount(handle))
+        {
+          /* Read next cluster */
+          res = getNextCluster(context, handle, &staticNode.parentCluster);
+          if (res != E_OK)
+            break;
+
+          staticNode.parentIndex = 0;
+        }
+      }
     }
+
+    if (res == E_OK)
+      *created = i + 1;
+  }
+
+  freeStaticNode(&staticNode);
+
+  if (res != E_OK || available != count)
+  {
+    /* Gap may be left partially filled or unused */
+    resetGapHint(handle, root->payloadCluster);
   }
 
+  if (res == E_OK && available != count)
+    res = E_EXIST;
+
   return res;
 }
 #endif
 /*----------------------------------------------------------------------------*/
 #ifdef CONFIG_WRITE
-/* Allocate single node or node chain inside parent node chain. */
+static enum Result createNodeGroup(struct CommandContext *context,
+    const struct FatNode *root, struct FatNodeTemplate *templates,
+    size_t count, size_t *created)
+{
+  struct FatHandle * const handle = (struct FatHandle *)root->handle;
+  size_t allocated = 0;
+  enum Result res = E_OK;
+
+  *created = 0;
+
+  /* Payload is allocated before the creation of directory entries */
+  while (allocated < count)
+  {
+    templates[allocated].payloadCluster = RESERVED_CLUSTER;
+    res = allocatePayload(context, root, &templates[allocated]);
+
+    if (res != E_OK)
+      break;
+    ++allocated;
+  }
+
+  if (allocated)
+  {
+    lockDir(context, handle, root->payloadCluster);
+    const enum Result entriesResult = createEntries(context, root, templates,
+        allocated, created);
+    unlockDir(handle, root->payloadCluster);
+
+    /* Errors of the preceding nodes are returned first */
+    if (entriesResult != E_OK)
+      res = entriesResult;
+  }
+
+  /* Release payload of nodes without directory entries */
+  lockTable(context, handle);
+  for (size_t i = *created; i < count; ++i)
+  {
+    if (templates[i].payloadCluster != RESERVED_CLUSTER)
+      freeChain(context, handle, templates[i].payloadCluster);
+  }
+  unlockTable(handle);
+
+  return res;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+/*
+ * Allocate single node or node chain inside parent node chain. When Unicode
+ * support is enabled, the whole directory is scanned and numbers of the next
+ * free short name instances for all node templates are collected during
+ * the same pass. In this case the gap hint does not reduce the number of
+ * sectors read, entries before the hint position are only excluded from
+ * the gap search. Short names are proposed before the directory is extended
+ * and the number of templates with usable names is returned.
+ */
 static enum Result findGap(struct CommandContext *context, struct FatNode *node,
-    const struct FatNode *root, uint16_t chainLength)
+    const struct FatNode *root, uint16_t chainLength,
+    struct FatNodeTemplate *templates, size_t count, size_t *available)
 {
   struct FatHandle * const handle = (struct FatHandle *)root->handle;
+  struct FatGapHint * const hint = getGapHint(handle, root->payloadCluster);
   uint32_t firstCluster = RESERVED_CLUSTER;
+  uint32_t freeCluster = RESERVED_CLUSTER;
+  uint32_t nextCluster = RESERVED_CLUSTER;
   uint16_t firstIndex = 0;
+  uint16_t freeIndex = 0;
+  uint16_t nextIndex = 0;
   uint16_t chunks = 0;
 
-  node->parentCluster = root->payloadCluster;
-  node->parentIndex = 0;
+  /* Entries before the hint position are known to be occupied */
+  bool skipping = hint->directory == root->payloadCluster;
+
+#ifdef CONFIG_UNICODE
+  bool hintReached = false;
+  bool proposed = false;
+  bool scanning = true;
+#else
+  bool scanning = false;
+
+  (void)templates;
+  (void)count;
+#endif
 
-  while (chunks != chainLength)
+  if (!scanning && skipping)
+  {
+    node->parentCluster = hint->cluster;
+    node->parentIndex = hint->index;
+    skipping = false;
+  }
+  else
+  {
+    node->parentCluster = root->payloadCluster;
+    node->parentIndex = 0;
+  }
+
+  while (chunks != chainLength || scanning)
   {
     enum Result res = fetchEntry(context, node);
     bool clusterRequested = false;
@@ -1133,43 +1729,80 @@ static enum Result findGap(struct CommandContext *context, struct FatNode *node,
     {
       case E_EMPTY:
         /* End of the cluster chain, there are no empty entries */
-        clusterRequested = true;
+        clusterRequested = chunks != chainLength;
+        scanning = false;
+        skipping = false;
         break;
 
-      case E_OK:
       case E_ENTRY:
+        /* Names are not allowed after the end of the directory */
+        scanning = false;
+        break;
+
+      case E_OK:
         break;
 
       default:
         return res;
     }
 
-    if (clusterRequested)
+    if (res == E_EMPTY)
     {
-      const uint16_t entriesPerCluster = calcNodeCount(handle);
-      const uint16_t remainingChunks = chainLength - chunks;
-      uint32_t cluster = node->parentCluster;
-      uint16_t availableEntries = 0;
-
-      while (availableEntries < remainingChunks)
+#ifdef CONFIG_UNICODE
+      if (clusterRequested)
       {
-        res = allocateCluster(context, handle, &cluster);
-        if (res != E_OK)
-          return res;
-        res = clearCluster(context, handle, cluster);
-        if (res != E_OK)
+        /* All similar names are already collected */
+        *available = proposeShortNames(templates, count);
+        proposed = true;
+
+        /* Directory should not be extended when the names cannot be used */
+        if (!*available)
+          return E_EXIST;
+
+        if (*available != count)
         {
-          /*
-           * Cluster allocation is not finished,
-           * directory may contain incorrect entries.
-           */
-          return res;
+          chainLength = 0;
+          for (size_t i = 0; i < *available; ++i)
+            chainLength += templates[i].chunks + 1;
+
+          if (chunks >= chainLength)
+          {
+            /* Free entries at the end are enough for the remaining nodes */
+            chunks = chainLength;
+            clusterRequested = false;
+          }
         }
-
-        availableEntries += entriesPerCluster;
       }
+#endif
 
-      clusterRequested = false;
+      if (clusterRequested)
+      {
+        const uint16_t entriesPerCluster = calcNodeCount(handle);
+        const uint16_t remainingChunks = chainLength - chunks;
+        uint32_t cluster = node->parentCluster;
+        uint16_t availableEntries = 0;
+
+        while (availableEntries < remainingChunks)
+        {
+          lockTable(context, handle);
+          res = allocateCluster(context, handle, &cluster);
+          unlockTable(handle);
+
+          if (res != E_OK)
+            return res;
+          res = clearCluster(context, handle, cluster);
+          if (res != E_OK)
+          {
+            /*
+             * Cluster allocation is not finished,
+             * directory may contain incorrect entries.
+             */
+            return res;
+          }
+
+          availableEntries += entriesPerCluster;
+        }
+      }
     }
     else
     {
@@ -1180,17 +1813,58 @@ static enum Result findGap(struct CommandContext *context, struct FatNode *node,
       const struct DirEntryImage * const entry = getDirEntry(context,
           node->parentIndex);
 
-      /* Empty node, deleted long file name node or deleted node */
-      if (!entry->name[0] || ((entry->flags & MASK_LFN) == MASK_LFN
+#ifdef CONFIG_UNICODE
+      if (scanning && entry->name[0] != E_FLAG_EMPTY
+          && (entry->flags & MASK_LFN) != MASK_LFN)
+      {
+        for (size_t i = 0; i < count; ++i)
+        {
+          uniqueNameCheck(entry->name, templates[i].baseName,
+              &templates[i].instance);
+        }
+      }
+
+      if (skipping)
+      {
+        /* Hint position may point past the last entry of the cluster */
+        if (node->parentCluster == hint->cluster)
+        {
+          hintReached = true;
+          skipping = node->parentIndex < hint->index;
+        }
+        else
+          skipping = !hintReached;
+      }
+#endif
+
+      if (chunks == chainLength || skipping)
+      {
+        /* Gap is already found or not reached, only names are collected */
+      }
+      else if (!entry->name[0] || ((entry->flags & MASK_LFN) == MASK_LFN
           && (entry->ordinal & LFN_DELETED)) || entry->name[0] == E_FLAG_EMPTY)
       {
+        /* Empty node, deleted long file name node or deleted node */
         if (!chunks)
         {
           /* First free node found */
           firstCluster = node->parentCluster;
           firstIndex = node->parentIndex;
+
+          if (freeCluster == RESERVED_CLUSTER)
+          {
+            /* Lowest free node in the directory */
+            freeCluster = firstCluster;
+            freeIndex = firstIndex;
+          }
+        }
+
+        if (++chunks == chainLength)
+        {
+          /* Position of the node after the gap */
+          nextCluster = node->parentCluster;
+          nextIndex = node->parentIndex + 1;
         }
-        ++chunks;
       }
       else
       {
@@ -1203,6 +1877,28 @@ static enum Result findGap(struct CommandContext *context, struct FatNode *node,
     ++node->parentIndex;
   }
 
+#ifdef CONFIG_UNICODE
+  if (!proposed)
+    *available = proposeShortNames(templates, count);
+#else
+  *available = count;
+#endif
+
+  /* Gap is expected to be filled by the caller */
+  hint->directory = root->payloadCluster;
+
+  if (freeCluster == firstCluster && freeIndex == firstIndex)
+  {
+    /* Next free node is located after the gap */
+    hint->cluster = nextCluster;
+    hint->index = nextIndex;
+  }
+  else
+  {
+    hint->cluster = freeCluster;
+    hint->index = freeIndex;
+  }
+
   node->parentCluster = firstCluster;
   node->parentIndex = firstIndex;
   node->flags = 0;
@@ -1212,6 +1908,52 @@ static enum Result findGap(struct CommandContext *context, struct FatNode *node,
 #endif
 /*----------------------------------------------------------------------------*/
 #ifdef CONFIG_WRITE
+/* Search the directory for another node with the same name */
+static enum Result findNodeName(struct CommandContext *context,
+    const struct FatNode *directory, const struct FatNode *node,
+    const char *name)
+{
+  struct FatHandle * const handle = (struct FatHandle *)directory->handle;
+  struct FatNode staticNode;
+  char nameBuffer[CONFIG_NAME_LENGTH];
+  enum Result res;
+
+  allocateStaticNode(handle, &staticNode);
+  staticNode.parentCluster = directory->payloadCluster;
+  staticNode.parentIndex = 0;
+
+  while ((res = fetchNode(context, &staticNode)) == E_OK)
+  {
+    /* Node may be renamed inside the same directory */
+    if (staticNode.parentCluster == node->parentCluster
+        && staticNode.parentIndex == node->parentIndex)
+    {
+      ++staticNode.parentIndex;
+      continue;
+    }
+
+    size_t read;
+
+    res = readNodeName(context, &staticNode, nameBuffer, sizeof(nameBuffer),
+        &read);
+    if (res != E_OK)
+      break;
+
+    if (isSameName(nameBuffer, name))
+    {
+      res = E_EXIST;
+      break;
+    }
+
+    ++staticNode.parentIndex;
+  }
+
+  freeStaticNode(&staticNode);
+  return res == E_EMPTY || res == E_ENTRY ? E_OK : res;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
 static enum Result freeChain(struct CommandContext *context,
     struct FatHandle *handle, uint32_t cluster)
 {
@@ -1271,8 +2013,28 @@ static enum Result freeChain(struct CommandContext *context,
 #endif
 /*----------------------------------------------------------------------------*/
 #ifdef CONFIG_WRITE
+/* Names of the nodes are compared without regard to the case of letters */
+static bool isSameName(const char *a, const char *b)
+{
+  while (*a && *b)
+  {
+    const char x = (*a >= 'a' && *a <= 'z') ? *a - ('a' - 'A') : *a;
+    const char y = (*b >= 'a' && *b <= 'z') ? *b - ('a' - 'A') : *b;
+
+    if (x != y)
+      return false;
+
+    ++a;
+    ++b;
+  }
+
+  return *a == *b;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
 static enum Result markFree(struct CommandContext *context,
-    const struct FatNode *node)
+    const struct FatNode *root, const struct FatNode *node)
 {
   struct FatHandle * const handle = (struct FatHandle *)node->handle;
   const uint32_t lastSector = calcSectorNumber(handle, node->parentCluster)
@@ -1301,75 +2063,307 @@ static enum Result markFree(struct CommandContext *context,
     struct DirEntryImage * const entry = getDirEntry(context,
         staticNode.parentIndex);
 
-    ++staticNode.parentIndex;
+    ++staticNode.parentIndex;
+
+    /* Mark entry as empty by changing first byte of the name */
+    entry->name[0] = E_FLAG_EMPTY;
+
+    if (lastEntry || !(staticNode.parentIndex & (ENTRY_EXP - 1)))
+    {
+      /* Write back updated sector when switching sectors or last entry freed */
+      res = writeSector(context, handle, sector);
+      if (res != E_OK)
+        break;
+    }
+
+    if (lastEntry)
+      break;
+  }
+
+  if (res == E_OK)
+  {
+    struct FatGapHint * const hint = getGapHint(handle, root->payloadCluster);
+
+#ifdef CONFIG_UNICODE
+    const uint32_t freeCluster = node->nameCluster;
+    const uint16_t freeIndex = node->nameIndex;
+#else
+    const uint32_t freeCluster = node->parentCluster;
+    const uint16_t freeIndex = node->parentIndex;
+#endif
+
+    if (hint->directory == root->payloadCluster)
+    {
+      if (hint->cluster == freeCluster)
+      {
+        if (hint->index > freeIndex)
+          hint->index = freeIndex;
+      }
+      else
+      {
+        /* Order of clusters in the chain is unknown, rescan is required */
+        hint->directory = RESERVED_CLUSTER;
+      }
+    }
+  }
+
+  freeStaticNode(&staticNode);
+  return res;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+static enum Result truncatePayload(struct CommandContext *context,
+    struct FatNode *node)
+{
+  struct FatHandle * const handle = (struct FatHandle *)node->handle;
+  enum Result res;
+
+  if ((node->flags & FAT_FLAG_DIR) && node->payloadCluster != RESERVED_CLUSTER)
+  {
+    struct FatNode staticNode;
+    allocateStaticNode(handle, &staticNode);
+
+    /* Directory should stay empty until the gap hint is reset */
+    lockDir(context, handle, node->payloadCluster);
+
+    staticNode.parentCluster = node->payloadCluster;
+    staticNode.parentIndex = 0;
+
+    /* Check whether the directory is not empty */
+    while ((res = fetchNode(context, &staticNode)) == E_OK)
+    {
+      const struct DirEntryImage * const entry = getDirEntry(context,
+          staticNode.parentIndex);
+      char nameBuffer[BASENAME_LENGTH + 1];
+
+      extractShortBasename(nameBuffer, entry->name);
+      if (strcmp(nameBuffer, ".") && strcmp(nameBuffer, ".."))
+      {
+        res = E_EXIST;
+        break;
+      }
+
+      ++staticNode.parentIndex;
+    }
+
+    freeStaticNode(&staticNode);
+
+    if (res == E_EMPTY || res == E_ENTRY)
+    {
+      /* Forget free entries of the directory before releasing clusters */
+      resetGapHint(handle, node->payloadCluster);
+      res = E_OK;
+    }
+
+    unlockDir(handle, node->payloadCluster);
+
+    if (res != E_OK)
+      return res;
+  }
+
+  /* Mark clusters as free */
+  lockTable(context, handle);
+  res = freeChain(context, handle, node->payloadCluster);
+  unlockTable(handle);
+
+  if (res == E_OK)
+    node->payloadCluster = RESERVED_CLUSTER;
+
+  return res;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+static enum Result parseNodeTemplate(struct FatNodeTemplate *node,
+    const struct FsFieldDescriptor *descriptors, size_t number)
+{
+  node->name = NULL;
+  node->data = NULL;
+  node->origin = NULL;
+  node->time = 0;
+  node->payloadCluster = RESERVED_CLUSTER;
+  node->access = FS_ACCESS_READ | FS_ACCESS_WRITE;
+  node->chunks = 0;
+
+  for (size_t i = 0; i < number; ++i)
+  {
+    const struct FsFieldDescriptor * const desc = &descriptors[i];
+
+    switch (desc->type)
+    {
+      case FS_NODE_ACCESS:
+        if (desc->length == sizeof(FsAccess))
+        {
+          memcpy(&node->access, desc->data, sizeof(FsAccess));
+          break;
+        }
+        else
+          return E_VALUE;
+
+      case FS_NODE_DATA:
+        node->data = desc;
+        break;
+
+      case FS_NODE_NAME:
+        if (desc->length <= CONFIG_NAME_LENGTH
+            && desc->length == strlen(desc->data) + 1)
+        {
+          node->name = desc->data;
+          break;
+        }
+        else
+          return E_VALUE;
+
+      case FS_NODE_TIME:
+        if (desc->length == sizeof(node->time))
+        {
+          memcpy(&node->time, desc->data, sizeof(node->time));
+          break;
+        }
+        else
+          return E_VALUE;
+
+      default:
+        break;
+    }
+  }
+
+  /* Node cannot be left unnamed */
+  if (node->name == NULL || !strlen(node->name))
+    return E_VALUE;
+
+  node->longNameRequired = !fillShortName(node->shortName, node->name,
+      node->data != NULL);
+
+#ifdef CONFIG_UNICODE
+  const size_t nameLength = uLengthToUtf16(node->name) + 1;
 
-    /* Mark entry as empty by changing first byte of the name */
-    entry->name[0] = E_FLAG_EMPTY;
+  if (nameLength > CONFIG_NAME_LENGTH / 2)
+    return E_VALUE;
 
-    if (lastEntry || !(staticNode.parentIndex & (ENTRY_EXP - 1)))
-    {
-      /* Write back updated sector when switching sectors or last entry freed */
-      res = writeSector(context, handle, sector);
-      if (res != E_OK)
-        break;
-    }
+  node->instance = 0;
+  node->nameLength = (uint16_t)nameLength;
 
-    if (lastEntry)
-      break;
+  if (node->longNameRequired)
+  {
+    /* Append additional entry when last chunk is incomplete */
+    node->chunks = (uint8_t)((nameLength + LFN_ENTRY_LENGTH - 2)
+        / LFN_ENTRY_LENGTH);
+
+#ifdef CONFIG_HASHED_ALIASES
+    /* Aliases of different long names rarely share the same basis */
+    fillHashedAlias(node->shortName, node->name);
+#endif
   }
 
-  freeStaticNode(&staticNode);
-  return res;
+  extractShortBasename(node->baseName, node->shortName);
+#else
+  if (node->longNameRequired)
+    return E_VALUE;
+#endif
+
+  return E_OK;
 }
 #endif
 /*----------------------------------------------------------------------------*/
 #ifdef CONFIG_WRITE
-static enum Result truncatePayload(struct CommandContext *context,
-    struct FatNode *node)
+/*
+ * Update positions of the allocated nodes after live entries of the sector
+ * have been moved. Entries of the sector should be loaded in the context.
+ */
+static void relocateNodes(struct CommandContext *context,
+    struct FatHandle *handle, const struct FatRelocation *relocation)
 {
-  struct FatHandle * const handle = (struct FatHandle *)node->handle;
-  enum Result res;
+  struct FatNode * const nodes = handle->pools.nodes.data;
+  const size_t capacity = handle->pools.nodes.capacity;
+  const uint16_t entriesPerCluster = calcNodeCount(handle);
+  const uint16_t sectorEnd = relocation->sourceIndex
+      - ENTRY_INDEX(relocation->sourceIndex) + SECTOR_SIZE
+      / sizeof(struct DirEntryImage);
 
-  if ((node->flags & FAT_FLAG_DIR) && node->payloadCluster != RESERVED_CLUSTER)
+  /* Descriptors in the pool are checked regardless of their state */
+  for (size_t i = 0; i < capacity; ++i)
   {
-    struct FatNode staticNode;
-    allocateStaticNode(handle, &staticNode);
-
-    staticNode.parentCluster = node->payloadCluster;
-    staticNode.parentIndex = 0;
+    struct FatNode * const node = &nodes[i];
+    uint32_t *cluster = &node->parentCluster;
+    uint16_t *index = &node->parentIndex;
 
-    /* Check whether the directory is not empty */
-    while ((res = fetchNode(context, &staticNode)) == E_OK)
+#ifdef CONFIG_UNICODE
+    for (size_t field = 0; field < 2; ++field)
+#endif
     {
-      const struct DirEntryImage * const entry = getDirEntry(context,
-          staticNode.parentIndex);
-      char nameBuffer[BASENAME_LENGTH + 1];
-
-      extractShortBasename(nameBuffer, entry->name);
-      if (strcmp(nameBuffer, ".") && strcmp(nameBuffer, ".."))
+      if (*cluster == relocation->sourceCluster
+          && *index >= relocation->sourceIndex && *index < sectorEnd
+          && isLiveEntry(getDirEntry(context, *index)))
       {
-        res = E_EXIST;
-        break;
+        uint16_t position = relocation->destinationIndex;
+
+        /* Live entries are placed one after another */
+        for (uint16_t j = relocation->sourceIndex; j < *index; ++j)
+        {
+          if (isLiveEntry(getDirEntry(context, j)))
+            ++position;
+        }
+
+        if (position >= entriesPerCluster)
+        {
+          *cluster = relocation->nextCluster;
+          *index = position - entriesPerCluster;
+        }
+        else
+        {
+          *cluster = relocation->destinationCluster;
+          *index = position;
+        }
       }
 
-      ++staticNode.parentIndex;
+#ifdef CONFIG_UNICODE
+      cluster = &node->nameCluster;
+      index = &node->nameIndex;
+#endif
     }
+  }
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+static void setDirtyFlag(struct FatNode *node)
+{
+  struct FatHandle * const handle = (struct FatHandle *)node->handle;
 
-    freeStaticNode(&staticNode);
+  node->dirtyNext = handle->dirtyNodes;
+  node->dirtyPrev = NULL;
 
-    if (res != E_EMPTY && res != E_ENTRY)
-      return res;
-  }
+  if (handle->dirtyNodes != NULL)
+    handle->dirtyNodes->dirtyPrev = node;
+  handle->dirtyNodes = node;
 
-  /* Mark clusters as free */
-  lockHandle(handle);
-  res = freeChain(context, handle, node->payloadCluster);
-  unlockHandle(handle);
+  node->flags |= FAT_FLAG_DIRTY;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+static enum Result setParentCluster(struct CommandContext *context,
+    struct FatHandle *handle, uint32_t directory, uint32_t parent)
+{
+  const uint32_t sector = calcSectorNumber(handle, directory);
+  enum Result res;
 
-  if (res == E_OK)
-    node->payloadCluster = RESERVED_CLUSTER;
+  res = readSector(context, handle, sector);
+  if (res != E_OK)
+    return res;
 
-  return res;
+  /* Parent directory entry .. is always the second entry */
+  struct DirEntryImage * const entry = getDirEntry(context, 1);
+
+  if (parent == handle->rootCluster)
+    parent = RESERVED_CLUSTER;
+
+  entry->clusterHigh = toLittleEndian16((uint16_t)(parent >> 16));
+  entry->clusterLow = toLittleEndian16((uint16_t)parent);
+
+  return writeSector(context, handle, sector);
 }
 #endif
 /*----------------------------------------------------------------------------*/
@@ -1398,8 +2392,8 @@ static enum Result setupDirCluster(struct CommandContext *context,
       payloadCluster, timestamp);
   if (parentCluster != handle->rootCluster)
   {
-    entry->clusterHigh = toLittleEndian16((uint16_t)(payloadCluster >> 16));
-    entry->clusterLow = toLittleEndian16((uint16_t)payloadCluster);
+    entry->clusterHigh = toLittleEndian16((uint16_t)(parentCluster >> 16));
+    entry->clusterLow = toLittleEndian16((uint16_t)parentCluster);
   }
   else
     entry->clusterLow = entry->clusterHigh = 0;
@@ -1441,6 +2435,78 @@ static enum Result syncDirEntry(struct CommandContext *context,
 #endif
 /*----------------------------------------------------------------------------*/
 #ifdef CONFIG_WRITE
+/* Save unsaved changes of all descriptors referencing the node entry */
+static enum Result syncSharedNodes(struct CommandContext *context,
+    const struct FatNode *node)
+{
+  struct FatHandle * const handle = (struct FatHandle *)node->handle;
+  struct FatNode *next = handle->dirtyNodes;
+
+  while (next != NULL)
+  {
+    struct FatNode * const current = next;
+
+    /* Node is unlinked from the list after successful synchronization */
+    next = current->dirtyNext;
+
+    if (current->parentCluster == node->parentCluster
+        && current->parentIndex == node->parentIndex)
+    {
+      const enum Result res = syncDirEntry(context, current);
+
+      if (res != E_OK)
+        return res;
+
+      clearDirtyFlag(current);
+    }
+  }
+
+  return E_OK;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+/*
+ * Point descriptors referencing the previous entry of the moved node to the
+ * new entries. Position in the payload of each descriptor is left unchanged.
+ */
+static void updateSharedNodes(struct FatHandle *handle,
+    const struct FatNode *node, uint32_t cluster, uint16_t index)
+{
+  struct FatNode * const nodes = handle->pools.nodes.data;
+  const size_t capacity = handle->pools.nodes.capacity;
+
+  /* Descriptors in the pool are checked regardless of their state */
+  for (size_t i = 0; i < capacity; ++i)
+  {
+    struct FatNode * const current = &nodes[i];
+
+    if (current == node || current->parentCluster != cluster
+        || current->parentIndex != index)
+    {
+      continue;
+    }
+
+    current->directoryCluster = node->directoryCluster;
+    current->parentCluster = node->parentCluster;
+    current->parentIndex = node->parentIndex;
+#ifdef CONFIG_UNICODE
+    current->nameCluster = node->nameCluster;
+    current->nameIndex = node->nameIndex;
+#endif
+    current->nameLength = node->nameLength;
+    current->lfn = node->lfn;
+
+#ifdef CONFIG_NAME_CACHE
+    memcpy(current->name, node->name, sizeof(current->name));
+    current->flags &= ~FAT_FLAG_NAME;
+    current->flags |= node->flags & FAT_FLAG_NAME;
+#endif
+  }
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
 /* Copy current sector into FAT sectors located at offset */
 static enum Result updateTable(struct CommandContext *context,
     struct FatHandle *handle, uint32_t offset)
@@ -1459,13 +2525,15 @@ static enum Result updateTable(struct CommandContext *context,
 #endif
 /*----------------------------------------------------------------------------*/
 #ifdef CONFIG_WRITE
-static enum Result writeBuffer(struct FatHandle *handle,
-    uint32_t sector, const uint8_t *buffer, uint32_t count)
+static enum Result writeBuffer(struct CommandContext *context,
+    struct FatHandle *handle, uint32_t sector, const uint8_t *buffer,
+    uint32_t count)
 {
   const uint64_t position = (uint64_t)sector << SECTOR_EXP;
   const uint32_t length = count << SECTOR_EXP;
   enum Result res;
 
+  traceCommand(context, handle, FAT32_TRACE_WRITE, sector, count, NULL);
   ifSetParam(handle->interface, IF_ACQUIRE, NULL);
 
   res = ifSetParam(handle->interface, IF_POSITION_64, &position);
@@ -1476,6 +2544,13 @@ static enum Result writeBuffer(struct FatHandle *handle,
   }
 
   ifSetParam(handle->interface, IF_RELEASE, NULL);
+  traceCommand(context, handle, FAT32_TRACE_WRITE, sector, count, &res);
+
+  if (res == E_OK)
+  {
+    updateCounter(handle, FAT_COUNTER_BUFFER_WRITES, 1);
+    updateCounter(handle, FAT_COUNTER_WRITTEN_SECTORS, count);
+  }
   return res;
 }
 #endif
@@ -1493,10 +2568,10 @@ static enum Result writeClusterChain(struct CommandContext *context,
   /* Allocate first cluster when the chain is empty */
   if (node->payloadCluster == RESERVED_CLUSTER)
   {
-    lockHandle(handle);
+    lockTable(context, handle);
     const enum Result res = allocateCluster(context, handle,
         &node->payloadCluster);
-    unlockHandle(handle);
+    unlockTable(handle);
 
     if (res != E_OK)
       return res;
@@ -1509,8 +2584,10 @@ static enum Result writeClusterChain(struct CommandContext *context,
   /* Seek to the requested position */
   if (currentPosition != dataPosition)
   {
+    lockTableShared(context, handle);
     const enum Result res = seekClusterChain(context, handle, currentPosition,
         dataPosition, node->payloadCluster, &currentCluster);
+    unlockTableShared(handle);
 
     if (res != E_OK)
       return res;
@@ -1522,25 +2599,28 @@ static enum Result writeClusterChain(struct CommandContext *context,
   {
     currentSector = sectorInCluster(handle, currentPosition);
     if (!currentSector && !(currentPosition & (SECTOR_SIZE - 1)))
-      currentSector = 1U << handle->clusterSize;
+      currentSector = 1U << clusterExp(handle);
   }
   else
     currentSector = 0;
 
   while (dataLength)
   {
-    if (currentSector >= 1U << handle->clusterSize)
+    if (currentSector >= 1U << clusterExp(handle))
     {
       /* Try to load the next cluster */
       enum Result res;
 
+      lockTableShared(context, handle);
       res = getNextCluster(context, handle, &currentCluster);
+      unlockTableShared(handle);
+
       if (res == E_EMPTY)
       {
         /* Allocate new cluster when the cluster is empty */
-        lockHandle(handle);
+        lockTable(context, handle);
         res = allocateCluster(context, handle, &currentCluster);
-        unlockHandle(handle);
+        unlockTable(handle);
       }
 
       if (res != E_OK)
@@ -1579,12 +2659,12 @@ static enum Result writeClusterChain(struct CommandContext *context,
     else
     {
       /* Position is aligned along the first byte of the sector */
-      chunk = ((1U << handle->clusterSize) - currentSector) << SECTOR_EXP;
+      chunk = ((1U << clusterExp(handle)) - currentSector) << SECTOR_EXP;
       chunk = MIN(chunk, dataLength);
       chunk &= ~(SECTOR_SIZE - 1); /* Align along sector boundary */
 
       /* Write data from the buffer directly without additional copying */
-      const enum Result res = writeBuffer(handle, sector, dataBuffer,
+      const enum Result res = writeBuffer(context, handle, sector, dataBuffer,
           chunk >> SECTOR_EXP);
       if (res != E_OK)
         return res;
@@ -1614,17 +2694,19 @@ static enum Result writeNodeAccess(struct CommandContext *context,
     return E_VALUE;
 
   struct FatHandle * const handle = (struct FatHandle *)node->handle;
-  const uint32_t sector = calcSectorNumber(handle, node->parentCluster)
-      + ENTRY_SECTOR(node->parentIndex);
   enum Result res;
 
-  /* Lock handle to prevent directory modifications from other threads */
-  lockHandle(handle);
+  /* Lock directory to prevent entry modifications from other threads */
+  lockDir(context, handle, node->directoryCluster);
+
+  /* Entry position is read under the lock, compaction may move the entry */
+  const uint32_t sector = calcSectorNumber(handle, node->parentCluster)
+      + ENTRY_SECTOR(node->parentIndex);
 
   res = readSector(context, handle, sector);
   if (res != E_OK)
   {
-    unlockHandle(handle);
+    unlockDir(handle, node->directoryCluster);
     return res;
   }
 
@@ -1647,7 +2729,7 @@ static enum Result writeNodeAccess(struct CommandContext *context,
   if (entry->flags != oldFlags)
     res = writeSector(context, handle, sector);
 
-  unlockHandle(handle);
+  unlockDir(handle, node->directoryCluster);
   return res;
 }
 #endif
@@ -1677,11 +2759,9 @@ static enum Result writeNodeData(struct CommandContext *context,
 
       if (!(node->flags & FAT_FLAG_DIRTY))
       {
-        lockHandle(handle);
-        pointerArrayPushBack(&handle->openedFiles, node);
-        unlockHandle(handle);
-
-        node->flags |= FAT_FLAG_DIRTY;
+        lockFiles(handle);
+        setDirtyFlag(node);
+        unlockFiles(handle);
       }
 
       res = writeClusterChain(context, node, position, buffer,
@@ -1708,17 +2788,19 @@ static enum Result writeNodeTime(struct CommandContext *context,
 {
   /* Timestamp writing requires access to the directory entry */
   struct FatHandle * const handle = (struct FatHandle *)node->handle;
-  const uint32_t sector = calcSectorNumber(handle, node->parentCluster)
-      + ENTRY_SECTOR(node->parentIndex);
   enum Result res;
 
-  /* Lock handle to prevent directory modifications from other threads */
-  lockHandle(handle);
+  /* Lock directory to prevent entry modifications from other threads */
+  lockDir(context, handle, node->directoryCluster);
+
+  /* Entry position is read under the lock, compaction may move the entry */
+  const uint32_t sector = calcSectorNumber(handle, node->parentCluster)
+      + ENTRY_SECTOR(node->parentIndex);
 
   res = readSector(context, handle, sector);
   if (res != E_OK)
   {
-    unlockHandle(handle);
+    unlockDir(handle, node->directoryCluster);
     return res;
   }
 
@@ -1735,7 +2817,7 @@ static enum Result writeNodeTime(struct CommandContext *context,
   if (entry->date != oldDate || entry->time != oldTime)
     res = writeSector(context, handle, sector);
 
-  unlockHandle(handle);
+  unlockDir(handle, node->directoryCluster);
   return res;
 }
 #endif
@@ -1747,6 +2829,7 @@ static enum Result writeSector(struct CommandContext *context,
   const uint64_t position = (uint64_t)sector << SECTOR_EXP;
   enum Result res;
 
+  traceCommand(context, handle, FAT32_TRACE_WRITE, sector, 1, NULL);
   ifSetParam(handle->interface, IF_ACQUIRE, NULL);
 
   res = ifSetParam(handle->interface, IF_POSITION_64, &position);
@@ -1762,101 +2845,117 @@ static enum Result writeSector(struct CommandContext *context,
   }
 
   ifSetParam(handle->interface, IF_RELEASE, NULL);
+  traceCommand(context, handle, FAT32_TRACE_WRITE, sector, 1, &res);
+
+  if (res == E_OK)
+  {
+    updateCounter(handle, FAT_COUNTER_SECTOR_WRITES, 1);
+    updateCounter(handle, FAT_COUNTER_WRITTEN_SECTORS, 1);
+  }
   return res;
 }
 #endif
 /*----------------------------------------------------------------------------*/
 #if defined(CONFIG_UNICODE) && defined(CONFIG_WRITE)
-static enum Result uniqueNamePropose(struct CommandContext *context,
-    const struct FatNode *root, char *shortName)
+/* Returns the number of leading templates with unique short names */
+static size_t proposeShortNames(struct FatNodeTemplate *templates,
+    size_t count)
 {
-  struct FatHandle * const handle = (struct FatHandle *)root->handle;
-  struct FatNode staticNode;
-
-  allocateStaticNode(handle, &staticNode);
-  staticNode.parentCluster = root->payloadCluster;
-  staticNode.parentIndex = 0;
-
-  char currentName[BASENAME_LENGTH + 1];
-  unsigned int proposed = 0;
-  enum Result res;
-
-  extractShortBasename(currentName, shortName);
-
-  while ((res = fetchEntry(context, &staticNode)) == E_OK)
+  for (size_t i = 0; i < count; ++i)
   {
-    /* Sector is already loaded during entry fetching */
-    const struct DirEntryImage * const entry = getDirEntry(context,
-        staticNode.parentIndex);
+    struct FatNodeTemplate * const current = &templates[i];
 
-    if (entry->name[0] == E_FLAG_EMPTY || (entry->flags & MASK_LFN) == MASK_LFN)
+#ifdef CONFIG_HASHED_ALIASES
+    if (current->longNameRequired)
     {
-      ++staticNode.parentIndex;
-      continue;
+      /* Hashed aliases always have a single digit numeric tail */
+      if (!current->instance)
+        current->instance = 1;
+      else if (current->instance >= MAX_SIMILAR_ALIASES)
+        return i;
     }
+#endif
 
-    unsigned int instance;
-    char baseName[BASENAME_LENGTH + 1];
-
-    /* Extract short name without extension */
-    extractShortBasename(baseName, entry->name);
+    /* Propose new short name when selected name already exists */
+    if (uniqueNamePropose(current->shortName, current->instance) != E_OK)
+      return i;
 
-    if ((instance = uniqueNameConvert(baseName)))
-    {
-      if (!strncmp(baseName, currentName, strlen(baseName))
-          && proposed <= instance)
-      {
-        proposed = instance + 1;
-      }
-    }
-    else
+    /* Resulting name should not be reused by the following nodes */
+    for (size_t j = i + 1; j < count; ++j)
     {
-      if (!strcmp(currentName, baseName) && !proposed)
-        ++proposed;
+      uniqueNameCheck(current->shortName, templates[j].baseName,
+          &templates[j].instance);
     }
-
-    ++staticNode.parentIndex;
   }
 
-  if (!proposed)
+  return count;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#if defined(CONFIG_UNICODE) && defined(CONFIG_WRITE)
+static void uniqueNameCheck(const char *shortName, const char *currentName,
+    unsigned int *proposed)
+{
+  unsigned int instance;
+  char baseName[BASENAME_LENGTH + 1];
+
+  /* Extract short name without extension */
+  extractShortBasename(baseName, shortName);
+
+  if ((instance = uniqueNameConvert(baseName)))
   {
-    res = E_OK;
+    if (!strncmp(baseName, currentName, strlen(baseName))
+        && *proposed <= instance)
+    {
+      *proposed = instance + 1;
+    }
   }
-  else if (proposed < MAX_SIMILAR_NAMES)
+  else
   {
-    char suffix[BASENAME_LENGTH - 1];
-    char *position = suffix;
+    if (!strcmp(currentName, baseName) && !*proposed)
+      ++*proposed;
+  }
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#if defined(CONFIG_UNICODE) && defined(CONFIG_WRITE)
+static enum Result uniqueNamePropose(char *shortName, unsigned int proposed)
+{
+  if (!proposed)
+    return E_OK;
+  if (proposed >= MAX_SIMILAR_NAMES)
+    return E_EXIST;
 
-    while (proposed)
-    {
-      const char c = (char)(proposed % 10);
+  char currentName[BASENAME_LENGTH + 1];
+  char suffix[BASENAME_LENGTH - 1];
+  char *position = suffix;
 
-      *position++ = c + '0';
-      proposed /= 10;
-    }
+  extractShortBasename(currentName, shortName);
 
-    const size_t proposedLength = position - suffix;
-    const size_t remainingSpace = BASENAME_LENGTH - proposedLength - 1;
-    size_t baseLength = strlen(currentName);
+  while (proposed)
+  {
+    const char c = (char)(proposed % 10);
 
-    if (baseLength > remainingSpace)
-      baseLength = remainingSpace;
+    *position++ = c + '0';
+    proposed /= 10;
+  }
 
-    memset(shortName + baseLength, ' ', BASENAME_LENGTH - baseLength);
-    shortName[baseLength] = '~';
+  const size_t proposedLength = position - suffix;
+  const size_t remainingSpace = BASENAME_LENGTH - proposedLength - 1;
+  size_t baseLength = strlen(currentName);
 
-    for (size_t i = 1; i <= proposedLength; ++i)
-      shortName[baseLength + i] = suffix[proposedLength - i];
+  if (baseLength > remainingSpace)
+    baseLength = remainingSpace;
 
-    DEBUG_PRINT(2, "fat32: proposed short name: \"%.8s\"\n", shortName);
+  memset(shortName + baseLength, ' ', BASENAME_LENGTH - baseLength);
+  shortName[baseLength] = '~';
 
-    res = E_OK;
-  }
-  else
-    res = E_EXIST;
+  for (size_t i = 1; i <= proposedLength; ++i)
+    shortName[baseLength + i] = suffix[proposedLength - i];
 
-  freeStaticNode(&staticNode);
-  return res;
+  DEBUG_PRINT(2, "fat32: proposed short name: \"%.8s\"\n", shortName);
+
+  return E_OK;
 }
 #endif
 /*------------------Filesystem handle functions-------------------------------*/
@@ -1869,11 +2968,20 @@ static enum Result fatHandleInit(void *object, const void *configBase)
   struct FatHandle * const handle = object;
   enum Result res;
 
+#ifdef CONFIG_STATISTICS
+  for (size_t i = 0; i < FAT_COUNTER_END; ++i)
+    handle->counters[i] = 0;
+#endif
+
   res = allocateBuffers(handle, config);
   if (res != E_OK)
     return res;
 
   handle->interface = config->interface;
+#ifdef CONFIG_TRACE
+  handle->trace = config->trace;
+  handle->traceArgument = config->traceArgument;
+#endif
 
   res = mountStorage(handle);
   if (res != E_OK)
@@ -1917,13 +3025,22 @@ static enum Result fatHandleSync(void *object)
 
   if (context == NULL)
     return E_MEMORY;
+  setTraceOrigin(context, FAT32_ORIGIN_SYNC);
+
+  lockFiles(handle);
 
-  lockHandle(handle);
+  struct FatNode *next = handle->dirtyNodes;
 
-  for (size_t i = 0; i < pointerArraySize(&handle->openedFiles); ++i)
+  while (next != NULL)
   {
-    struct FatNode * const node = *pointerArrayAt(&handle->openedFiles, i);
+    struct FatNode * const node = next;
+
+    /* Node is unlinked from the list after successful synchronization */
+    next = node->dirtyNext;
+
+    lockDir(context, handle, node->directoryCluster);
     const enum Result latest = syncDirEntry(context, node);
+    unlockDir(handle, node->directoryCluster);
 
     if (latest == E_OK)
     {
@@ -1936,7 +3053,7 @@ static enum Result fatHandleSync(void *object)
     }
   }
 
-  unlockHandle(handle);
+  unlockFiles(handle);
   freePoolContext(handle, context);
 
   return res;
@@ -1953,6 +3070,12 @@ static enum Result fatNodeInit(void *object, const void *configBase)
 
   node->handle = config->handle;
 
+#ifdef CONFIG_WRITE
+  node->dirtyNext = NULL;
+  node->dirtyPrev = NULL;
+#endif
+
+  node->directoryCluster = RESERVED_CLUSTER;
   node->parentCluster = RESERVED_CLUSTER;
   node->parentIndex = 0;
 
@@ -1971,6 +3094,10 @@ static enum Result fatNodeInit(void *object, const void *configBase)
   node->flags = 0;
   node->lfn = 0;
 
+#ifdef CONFIG_NAME_CACHE
+  node->name[0] = '\0';
+#endif
+
   DEBUG_PRINT(3, "fat32: node allocated, address %p\n", object);
 
   return E_OK;
@@ -1986,18 +3113,22 @@ static void fatNodeDeinit(void *object)
     struct FatHandle * const handle = (struct FatHandle *)node->handle;
     struct CommandContext * const context = allocatePoolContext(handle);
 
-    /* Lock handle to prevent directory modifications from other threads */
-    lockHandle(handle);
+    /* Lock file list before the directory as required by the lock order */
+    lockFiles(handle);
 
     if (context != NULL)
     {
+      setTraceOrigin(context, FAT32_ORIGIN_SYNC);
+      lockDir(context, handle, node->directoryCluster);
       syncDirEntry(context, node);
+      unlockDir(handle, node->directoryCluster);
+
       freePoolContext(handle, context);
     }
-    /* Clear dirty flag and remove from the node array */
+    /* Clear dirty flag and unlink the node from the list of dirty files */
     clearDirtyFlag(node);
 
-    unlockHandle(handle);
+    unlockFiles(handle);
 #endif
   }
 
@@ -2012,111 +3143,25 @@ static enum Result fatNodeCreate(void *rootObject,
   struct FatHandle * const handle = (struct FatHandle *)root->handle;
 
   if (!(root->flags & FAT_FLAG_DIR))
-    return E_VALUE;
-  if (root->flags & FAT_FLAG_RO)
-    return E_ACCESS;
-
-  time64_t nodeTime = 0;
-  FsAccess nodeAccess = FS_ACCESS_READ | FS_ACCESS_WRITE;
-
-  const struct FsFieldDescriptor *dataDesc = NULL;
-  const struct FsFieldDescriptor *nameDesc = NULL;
-
-  for (size_t i = 0; i < number; ++i)
-  {
-    const struct FsFieldDescriptor * const desc = &descriptors[i];
-
-    switch (desc->type)
-    {
-      case FS_NODE_ACCESS:
-        if (desc->length == sizeof(FsAccess))
-        {
-          memcpy(&nodeAccess, desc->data, sizeof(FsAccess));
-          break;
-        }
-        else
-          return E_VALUE;
-
-      case FS_NODE_DATA:
-        dataDesc = desc;
-        break;
-
-      case FS_NODE_NAME:
-        if (desc->length <= CONFIG_NAME_LENGTH
-            && desc->length == strlen(desc->data) + 1)
-        {
-          nameDesc = desc;
-          break;
-        }
-        else
-          return E_VALUE;
-
-      case FS_NODE_TIME:
-        if (desc->length == sizeof(nodeTime))
-        {
-          memcpy(&nodeTime, desc->data, sizeof(nodeTime));
-          break;
-        }
-        else
-          return E_VALUE;
+    return E_VALUE;
+  if (root->flags & FAT_FLAG_RO)
+    return E_ACCESS;
 
-      default:
-        break;
-    }
-  }
+  struct FatNodeTemplate node;
+  enum Result res;
 
-  if (nameDesc == NULL)
-    return E_VALUE; /* Node cannot be left unnamed */
+  res = parseNodeTemplate(&node, descriptors, number);
+  if (res != E_OK)
+    return res;
 
   struct CommandContext * const context = allocatePoolContext(handle);
-  uint32_t nodePayloadCluster = RESERVED_CLUSTER;
-  enum Result res = E_OK;
 
   if (context != NULL)
   {
-    /* Allocate a cluster chain for the directory */
-    if (dataDesc == NULL)
-    {
-      /* Prevent unexpected table modifications from other threads */
-      lockHandle(handle);
-      res = allocateCluster(context, handle, &nodePayloadCluster);
-      unlockHandle(handle);
-
-      if (res == E_OK)
-      {
-        res = setupDirCluster(context, handle, root->payloadCluster,
-            nodePayloadCluster, nodeTime);
-      }
-    }
-    else if (dataDesc->length)
-    {
-      struct FatNode staticNode;
-      allocateStaticNode(handle, &staticNode);
-
-      res = writeClusterChain(context, &staticNode, 0,
-          dataDesc->data, (uint32_t)dataDesc->length);
-      if (res == E_OK)
-        nodePayloadCluster = staticNode.payloadCluster;
-    }
-
-    /* Create an entry in the parent directory */
-    if (res == E_OK)
-    {
-      const bool isDirNode = dataDesc == NULL;
-
-      lockHandle(handle);
-      res = createNode(context, root, isDirNode, nameDesc->data,
-          nodeAccess, nodePayloadCluster, nodeTime);
-      unlockHandle(handle);
-    }
-
-    if (res != E_OK && nodePayloadCluster != RESERVED_CLUSTER)
-    {
-      lockHandle(handle);
-      freeChain(context, handle, nodePayloadCluster);
-      unlockHandle(handle);
-    }
+    size_t created;
 
+    setTraceOrigin(context, FAT32_ORIGIN_CREATE);
+    res = createNodeGroup(context, root, &node, 1, &created);
     freePoolContext(handle, context);
   }
   else
@@ -2145,6 +3190,7 @@ static void *fatNodeHead(void *object)
   if (node == NULL)
     return NULL;
 
+  node->directoryCluster = root->payloadCluster;
   node->parentCluster = root->payloadCluster;
   node->parentIndex = 0;
 
@@ -2153,7 +3199,11 @@ static void *fatNodeHead(void *object)
 
   if (context != NULL)
   {
+    setTraceOrigin(context, FAT32_ORIGIN_LIST);
+    lockDirShared(context, handle, root->payloadCluster);
     res = fetchNode(context, node);
+    unlockDirShared(handle, root->payloadCluster);
+
     freePoolContext(handle, context);
   }
   else
@@ -2231,8 +3281,12 @@ static enum Result fatNodeNext(void *object)
 
   if (context != NULL)
   {
+    setTraceOrigin(context, FAT32_ORIGIN_LIST);
+    lockDirShared(context, handle, node->directoryCluster);
     ++node->parentIndex;
     res = fetchNode(context, node);
+    unlockDirShared(handle, node->directoryCluster);
+
     freePoolContext(handle, context);
 
     if (res == E_EMPTY || res == E_ENTRY)
@@ -2307,12 +3361,16 @@ static enum Result fatNodeRead(void *object, enum FsFieldType type,
 
   if (context == NULL)
     return E_MEMORY;
+  setTraceOrigin(context, FAT32_ORIGIN_READ);
 
   if (type == FS_NODE_CAPACITY)
   {
     if (buffer != NULL && position == 0 && length >= sizeof(FsCapacity))
     {
+      lockTableShared(context, handle);
       res = readNodeCapacity(context, node, buffer);
+      unlockTableShared(handle);
+
       if (res == E_OK)
         bytesRead = sizeof(FsCapacity);
     }
@@ -2326,7 +3384,11 @@ static enum Result fatNodeRead(void *object, enum FsFieldType type,
   else if (type == FS_NODE_NAME)
   {
     if (buffer != NULL && position == 0)
+    {
+      lockDirShared(context, handle, node->directoryCluster);
       res = readNodeName(context, node, buffer, length, &bytesRead);
+      unlockDirShared(handle, node->directoryCluster);
+    }
     else
       res = E_VALUE;
   }
@@ -2334,7 +3396,10 @@ static enum Result fatNodeRead(void *object, enum FsFieldType type,
   {
     if (buffer != NULL && position == 0 && length >= sizeof(time64_t))
     {
+      lockDirShared(context, handle, node->directoryCluster);
       res = readNodeTime(context, node, buffer);
+      unlockDirShared(handle, node->directoryCluster);
+
       if (res == E_OK)
         bytesRead = sizeof(time64_t);
     }
@@ -2363,14 +3428,23 @@ static enum Result fatNodeRemove(void *rootObject, void *object)
 
   if (context == NULL)
     return E_MEMORY;
+  setTraceOrigin(context, FAT32_ORIGIN_REMOVE);
 
   enum Result res = truncatePayload(context, node);
 
   if (res == E_OK)
   {
-    lockHandle(handle);
-    res = markFree(context, node);
-    unlockHandle(handle);
+    lockDir(context, handle, root->payloadCluster);
+    res = markFree(context, root, node);
+    unlockDir(handle, root->payloadCluster);
+  }
+
+  if (res == E_OK && (node->flags & FAT_FLAG_DIRTY))
+  {
+    /* Released entries may be reused before the node is freed */
+    lockFiles(handle);
+    clearDirtyFlag(node);
+    unlockFiles(handle);
   }
 
   freePoolContext(handle, context);
@@ -2404,6 +3478,7 @@ static enum Result fatNodeWrite(void *object, enum FsFieldType type,
 
   if (context == NULL)
     return E_MEMORY;
+  setTraceOrigin(context, FAT32_ORIGIN_WRITE);
 
   size_t bytesWritten = 0;
   enum Result res = E_INVALID;
@@ -2457,3 +3532,406 @@ static enum Result fatNodeWrite(void *object, enum FsFieldType type,
   return E_INVALID;
 #endif
 }
+/*------------------Extended node functions-----------------------------------*/
+/*
+ * Move live entries of the directory, including long name entries, towards
+ * the beginning of the directory and release clusters left without entries.
+ * Positions of the opened nodes are updated, but the directory should not be
+ * accessed by other threads during the compaction. Moved entries are staged
+ * in the reserved context of the handle.
+ */
+enum Result fat32CompactDir(void *object)
+{
+#ifdef CONFIG_WRITE
+  const struct FatNode * const node = object;
+
+  if (!(node->flags & FAT_FLAG_DIR))
+    return E_VALUE;
+  if (node->flags & FAT_FLAG_RO)
+    return E_ACCESS;
+
+  struct FatHandle * const handle = (struct FatHandle *)node->handle;
+  struct CommandContext * const context = allocatePoolContext(handle);
+
+  if (context == NULL)
+    return E_MEMORY;
+  setTraceOrigin(context, FAT32_ORIGIN_COMPACT);
+
+  /* Second sector buffer is used to stage moved entries */
+  struct CommandContext * const staging = allocateReservedContext(handle);
+
+  if (staging == NULL)
+  {
+    freePoolContext(handle, context);
+    return E_MEMORY;
+  }
+  setTraceOrigin(staging, FAT32_ORIGIN_COMPACT);
+
+  lockDir(context, handle, node->payloadCluster);
+  const enum Result res = compactDirectory(context, staging, handle,
+      node->payloadCluster);
+  resetGapHint(handle, node->payloadCluster);
+  unlockDir(handle, node->payloadCluster);
+
+  freeReservedContext(handle, staging);
+  freePoolContext(handle, context);
+  return res;
+#else
+  (void)object;
+  return E_INVALID;
+#endif
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Create several nodes in the same directory. Nodes are processed in groups,
+ * entries of each group are placed during a single directory pass and each
+ * modified directory sector is written once. The number of created nodes is
+ * returned even when an error occurs.
+ */
+enum Result fat32CreateNodes(void *object, const struct Fat32NodeFields *nodes,
+    size_t count, size_t *created)
+{
+#ifdef CONFIG_WRITE
+  const struct FatNode * const root = object;
+  struct FatHandle * const handle = (struct FatHandle *)root->handle;
+  size_t total = 0;
+  enum Result res = E_OK;
+
+  if (created != NULL)
+    *created = 0;
+
+  if (!(root->flags & FAT_FLAG_DIR))
+    return E_VALUE;
+  if (root->flags & FAT_FLAG_RO)
+    return E_ACCESS;
+
+  struct CommandContext * const context = allocatePoolContext(handle);
+
+  if (context == NULL)
+    return E_MEMORY;
+  setTraceOrigin(context, FAT32_ORIGIN_CREATE);
+
+  while (total < count && res == E_OK)
+  {
+    struct FatNodeTemplate templates[CREATE_GROUP_SIZE];
+    size_t number = 0;
+
+    while (number < ARRAY_SIZE(templates) && total + number < count)
+    {
+      const struct Fat32NodeFields * const fields = &nodes[total + number];
+
+      res = parseNodeTemplate(&templates[number], fields->descriptors,
+          fields->number);
+      if (res != E_OK)
+        break;
+
+      ++number;
+    }
+
+    if (number)
+    {
+      size_t groupCreated;
+      const enum Result groupResult = createNodeGroup(context, root,
+          templates, number, &groupCreated);
+
+      total += groupCreated;
+
+      /* Group errors precede parsing errors of the following nodes */
+      if (groupResult != E_OK)
+        res = groupResult;
+    }
+  }
+
+  freePoolContext(handle, context);
+
+  if (created != NULL)
+    *created = total;
+  return res;
+#else
+  (void)object;
+  (void)nodes;
+  (void)count;
+
+  if (created != NULL)
+    *created = 0;
+  return E_INVALID;
+#endif
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Move the node to the destination directory under a new name without
+ * copying the payload. Entries are created in the destination directory
+ * before the old entries are released. The opened node is updated to point
+ * to the new entries. Source should be the parent directory of the node,
+ * E_EXIST is returned when the destination directory already contains
+ * a node with the same name.
+ */
+enum Result fat32MoveNode(void *sourceObject, void *object,
+    void *destinationObject, const char *name)
+{
+#ifdef CONFIG_WRITE
+  const struct FatNode * const source = sourceObject;
+  const struct FatNode * const destination = destinationObject;
+  struct FatNode * const node = object;
+
+  if (!(destination->flags & FAT_FLAG_DIR))
+    return E_VALUE;
+  if (!(source->flags & FAT_FLAG_DIR)
+      || source->payloadCluster != node->directoryCluster)
+  {
+    return E_VALUE;
+  }
+  if ((source->flags & FAT_FLAG_RO) || (node->flags & FAT_FLAG_RO)
+      || (destination->flags & FAT_FLAG_RO))
+  {
+    return E_ACCESS;
+  }
+
+  const bool directory = (node->flags & FAT_FLAG_DIR) != 0;
+  const struct FsFieldDescriptor descriptors[] = {
+      {
+          name,
+          strlen(name) + 1,
+          FS_NODE_NAME
+      }, {
+          NULL,
+          0,
+          FS_NODE_DATA
+      }
+  };
+  struct FatNodeTemplate template;
+  enum Result res;
+
+  /* Data descriptor is used only to select the short name format */
+  res = parseNodeTemplate(&template, descriptors, directory ? 1 : 2);
+  if (res != E_OK)
+    return res;
+
+  struct FatHandle * const handle = (struct FatHandle *)node->handle;
+  struct CommandContext * const context = allocatePoolContext(handle);
+
+  if (context == NULL)
+    return E_MEMORY;
+  setTraceOrigin(context, FAT32_ORIGIN_MOVE);
+
+  /*
+   * Directory moves inspect ancestors of the destination, therefore all
+   * directory locks are acquired. File moves lock only both parent directories.
+   */
+  const uint32_t dirLocks = directory ? MASK(DIR_LOCK_COUNT)
+      : BIT(source->payloadCluster & (DIR_LOCK_COUNT - 1))
+          | BIT(destination->payloadCluster & (DIR_LOCK_COUNT - 1));
+
+  lockFiles(handle);
+  for (uint32_t i = 0; i < DIR_LOCK_COUNT; ++i)
+  {
+    if (dirLocks & BIT(i))
+      lockDir(context, handle, i);
+  }
+
+  /* Names are checked before entries of the destination are modified */
+  res = findNodeName(context, destination, node, template.name);
+
+  if (res == E_OK && directory)
+  {
+    /* Directory cannot be moved inside itself */
+    res = checkDirNesting(context, handle, destination->payloadCluster,
+        node->payloadCluster);
+  }
+  else if (res == E_OK)
+  {
+    /*
+     * Size and first cluster of the file are copied from the entry,
+     * unsaved changes of other descriptors of the file are saved as well.
+     */
+    res = syncSharedNodes(context, node);
+  }
+
+  struct DirEntryImage origin;
+
+  if (res == E_OK)
+  {
+    res = readSector(context, handle, calcSectorNumber(handle,
+        node->parentCluster) + ENTRY_SECTOR(node->parentIndex));
+  }
+
+  if (res == E_OK)
+  {
+    size_t created = 0;
+
+    origin = *getDirEntry(context, node->parentIndex);
+    template.origin = &origin;
+
+    res = createEntries(context, destination, &template, 1, &created);
+  }
+
+  if (res == E_OK)
+    res = markFree(context, source, node);
+
+  if (res == E_OK && directory
+      && source->payloadCluster != destination->payloadCluster)
+  {
+    res = setParentCluster(context, handle, node->payloadCluster,
+        destination->payloadCluster);
+  }
+
+  if (res == E_OK)
+  {
+    const uint32_t previousCluster = node->parentCluster;
+    const uint16_t previousIndex = node->parentIndex;
+
+    /* Reload the node from the new entries */
+    node->directoryCluster = destination->payloadCluster;
+    node->parentCluster = template.firstCluster;
+    node->parentIndex = template.firstIndex;
+    res = fetchNode(context, node);
+
+    /* Other descriptors of the node should not refer to released entries */
+    if (res == E_OK)
+      updateSharedNodes(handle, node, previousCluster, previousIndex);
+  }
+
+  for (uint32_t i = DIR_LOCK_COUNT; i > 0; --i)
+  {
+    if (dirLocks & BIT(i - 1))
+      unlockDir(handle, i - 1);
+  }
+  unlockFiles(handle);
+
+  freePoolContext(handle, context);
+  return res;
+#else
+  (void)sourceObject;
+  (void)object;
+  (void)destinationObject;
+  (void)name;
+
+  return E_INVALID;
+#endif
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Fill the buffer with records for consecutive directory entries, starting
+ * from the entry the node currently points to. The node should be obtained
+ * with the head function and it is advanced past the last returned record.
+ * The buffer should be aligned along the boundary of struct Fat32DirRecord.
+ */
+enum Result fat32ReadDir(void *object, void *buffer, size_t length,
+    size_t *read)
+{
+  struct FatNode * const node = object;
+
+  if (node->parentCluster == RESERVED_CLUSTER)
+    return E_ENTRY;
+
+  struct FatHandle * const handle = (struct FatHandle *)node->handle;
+  struct CommandContext * const context = allocatePoolContext(handle);
+
+  if (context == NULL)
+    return E_MEMORY;
+  setTraceOrigin(context, FAT32_ORIGIN_LIST);
+
+  uint8_t *position = buffer;
+  size_t left = length;
+  enum Result res = E_OK;
+
+  lockDirShared(context, handle, node->directoryCluster);
+
+  while (1)
+  {
+    const size_t alignment = alignof(struct Fat32DirRecord);
+    const size_t recordLength = (offsetof(struct Fat32DirRecord, name)
+        + node->nameLength + 1 + alignment - 1) & ~(alignment - 1);
+
+    if (recordLength > left)
+    {
+      /* Buffer is too short even for a single record */
+      if (position == buffer)
+        res = E_VALUE;
+      break;
+    }
+
+    res = readDirRecord(context, node, (struct Fat32DirRecord *)position,
+        recordLength);
+    if (res != E_OK)
+      break;
+
+    position += recordLength;
+    left -= recordLength;
+
+    /* Entries are fetched sequentially using the same context */
+    ++node->parentIndex;
+    res = fetchNode(context, node);
+
+    if (res != E_OK)
+    {
+      if (res == E_EMPTY || res == E_ENTRY)
+      {
+        /* Reached the end of the directory */
+        node->parentCluster = RESERVED_CLUSTER;
+        node->parentIndex = 0;
+        res = E_OK;
+      }
+      break;
+    }
+  }
+
+  unlockDirShared(handle, node->directoryCluster);
+  freePoolContext(handle, context);
+
+  if (res == E_OK)
+    *read = (size_t)(position - (uint8_t *)buffer);
+  return res;
+}
+/*------------------Extended handle functions---------------------------------*/
+/*
+ * Read event counters of the handle. Counters are updated without
+ * synchronization between each other, so values read while other threads
+ * use the handle may be inconsistent.
+ */
+enum Result fat32GetStatistics(const void *object,
+    struct Fat32Statistics *statistics)
+{
+#ifdef CONFIG_STATISTICS
+  const struct FatHandle * const handle = object;
+  uint32_t values[FAT_COUNTER_END];
+
+  for (size_t i = 0; i < FAT_COUNTER_END; ++i)
+    values[i] = handle->counters[i];
+
+  statistics->readBytes =
+      (uint64_t)values[FAT_COUNTER_READ_SECTORS] << SECTOR_EXP;
+  statistics->writtenBytes =
+      (uint64_t)values[FAT_COUNTER_WRITTEN_SECTORS] << SECTOR_EXP;
+  statistics->sectorReads = values[FAT_COUNTER_SECTOR_READS];
+  statistics->sectorWrites = values[FAT_COUNTER_SECTOR_WRITES];
+  statistics->bufferReads = values[FAT_COUNTER_BUFFER_READS];
+  statistics->bufferWrites = values[FAT_COUNTER_BUFFER_WRITES];
+  statistics->cachedReads = values[FAT_COUNTER_CACHED_READS];
+  statistics->tableLookups = values[FAT_COUNTER_TABLE_LOOKUPS];
+  statistics->allocations = values[FAT_COUNTER_ALLOCATIONS];
+  statistics->contextExhaustions = values[FAT_COUNTER_CONTEXT_EXHAUSTIONS];
+  statistics->nodeExhaustions = values[FAT_COUNTER_NODE_EXHAUSTIONS];
+
+  return E_OK;
+#else
+  (void)object;
+  (void)statistics;
+  return E_INVALID;
+#endif
+}
+/*----------------------------------------------------------------------------*/
+enum Result fat32ResetStatistics(void *object)
+{
+#ifdef CONFIG_STATISTICS
+  struct FatHandle * const handle = object;
+
+  for (size_t i = 0; i < FAT_COUNTER_END; ++i)
+    handle->counters[i] = 0;
+
+  return E_OK;
+#else
+  (void)object;
+  return E_INVALID;
+#endif
+}
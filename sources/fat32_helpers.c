@@ -248,6 +248,34 @@ uint16_t timeToRawTime(const struct RtDateTime *value)
 }
 #endif
 /*----------------------------------------------------------------------------*/
+#if defined(CONFIG_HASHED_ALIASES) && defined(CONFIG_UNICODE) \
+    && defined(CONFIG_WRITE)
+/* Replace the tail of a short name basis with a hash of the long name */
+void fillHashedAlias(char *shortName, const char *name)
+{
+  static const char hexDigits[] = "0123456789ABCDEF";
+  uint32_t hash = 0x811C9DC5UL;
+
+  /* 32-bit FNV-1a hash folded to 16 bits */
+  while (*name)
+  {
+    hash ^= (uint8_t)*name++;
+    hash *= 0x01000193UL;
+  }
+  hash = (hash >> 16) ^ (hash & 0xFFFFU);
+
+  size_t position = 0;
+
+  while (position < ALIAS_PREFIX_LENGTH && shortName[position] != ' ')
+    ++position;
+
+  for (size_t i = 0; i < 4; ++i)
+    shortName[position++] = hexDigits[(hash >> (12 - i * 4)) & 0x0F];
+
+  memset(shortName + position, ' ', BASENAME_LENGTH - position);
+}
+#endif
+/*----------------------------------------------------------------------------*/
 #if defined(CONFIG_UNICODE) && defined(CONFIG_WRITE)
 /* Save Unicode characters to long file name entry */
 void fillLongName(struct DirEntryImage *entry, const char16_t *name,
@@ -4,75 +4,90 @@
  * Project is distributed under the terms of the MIT License
  */
 
+#include <yaf/fat32_helpers.h>
 #include <yaf/fat32_pools.h>
 #include <stdlib.h>
 /*----------------------------------------------------------------------------*/
-static inline void lockPools(struct FatHandle *);
-static inline void unlockPools(struct FatHandle *);
+static inline size_t calcPoolSize(size_t, size_t);
+static void initPool(struct Pool *, uint8_t *, size_t, size_t);
 /*----------------------------------------------------------------------------*/
-bool allocatePool(struct Pool *pool, size_t capacity, size_t width)
+bool allocatePool(struct Pool *pool, size_t capacity, size_t width,
+    size_t alignment)
 {
   assert(capacity > 0);
 
-  uint8_t *data = malloc(width * capacity);
-
-  if (data == NULL)
+  if (capacity >= POOL_INDEX_EMPTY || width > UINT16_MAX)
     return false;
 
-  if (!pointerQueueInit(&pool->queue, capacity))
-  {
-    free(data);
+  /* Block is extended to align the first entry */
+  uint8_t * const memory = malloc(calcPoolSize(capacity, width)
+      + alignment - 1);
+
+  if (memory == NULL)
     return false;
-  }
 
-  pool->data = data;
-  data += capacity * width;
+  const uintptr_t address = (uintptr_t)memory;
+  const uintptr_t mask = (uintptr_t)alignment - 1;
 
-  do
-  {
-    data -= width;
-    pointerQueuePushBack(&pool->queue, data);
-  }
-  while (data != pool->data);
+  initPool(pool, memory + (((address + mask) & ~mask) - address), capacity,
+      width);
+  pool->memory = memory;
 
   return true;
 }
 /*----------------------------------------------------------------------------*/
 struct CommandContext *allocatePoolContext(struct FatHandle *handle)
 {
-  struct CommandContext *context = NULL;
-
-  lockPools(handle);
-  if (!pointerQueueEmpty(&handle->pools.contexts.queue))
+#ifdef CONFIG_THREADS
+  /* Semaphore is acquired only when there is a free context in the pool */
+  if (handle->timeout && !semTryWait(&handle->contextSemaphore,
+      handle->timeout))
   {
-    context = pointerQueueFront(&handle->pools.contexts.queue);
-    pointerQueuePopFront(&handle->pools.contexts.queue);
+    updateCounter(handle, FAT_COUNTER_CONTEXT_EXHAUSTIONS, 1);
+    return NULL;
   }
-  unlockPools(handle);
+#endif
+
+  struct CommandContext * const context = popPoolEntry(&handle->pools.contexts);
 
   if (context != NULL)
     context->sector = RESERVED_SECTOR;
+  else
+    updateCounter(handle, FAT_COUNTER_CONTEXT_EXHAUSTIONS, 1);
+
   return context;
 }
 /*----------------------------------------------------------------------------*/
 void *allocatePoolNode(struct FatHandle *handle)
 {
-  struct FatNode *node = NULL;
-
-  lockPools(handle);
-  if (!pointerQueueEmpty(&handle->pools.nodes.queue))
-  {
-    node = pointerQueueFront(&handle->pools.nodes.queue);
-    pointerQueuePopFront(&handle->pools.nodes.queue);
-  }
-  unlockPools(handle);
+  struct FatNode * const node = popPoolEntry(&handle->pools.nodes);
 
   if (node != NULL)
     allocateStaticNode(handle, node);
+  else
+    updateCounter(handle, FAT_COUNTER_NODE_EXHAUSTIONS, 1);
 
   return node;
 }
 /*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+/*
+ * Additional context is taken without waiting from a separate pool, regular
+ * operations are unable to exhaust reserved contexts.
+ */
+struct CommandContext *allocateReservedContext(struct FatHandle *handle)
+{
+  struct CommandContext * const context = popPoolEntry(&handle->pools.reserved);
+
+  if (context != NULL)
+    context->sector = RESERVED_SECTOR;
+  else
+    updateCounter(handle, FAT_COUNTER_CONTEXT_EXHAUSTIONS, 1);
+
+  return context;
+}
+#endif
+/*----------------------------------------------------------------------------*/
 void allocateStaticNode(struct FatHandle *handle, struct FatNode *node)
 {
   const struct FatNodeConfig config = {
@@ -88,15 +103,17 @@ void allocateStaticNode(struct FatHandle *handle, struct FatNode *node)
 /*----------------------------------------------------------------------------*/
 void freePool(struct Pool *pool)
 {
-  pointerQueueDeinit(&pool->queue);
-  free(pool->data);
+  free(pool->memory);
 }
 /*----------------------------------------------------------------------------*/
 void freePoolContext(struct FatHandle *handle, struct CommandContext *context)
 {
-  lockPools(handle);
-  pointerQueuePushBack(&handle->pools.contexts.queue, context);
-  unlockPools(handle);
+  pushPoolEntry(&handle->pools.contexts, context);
+
+#ifdef CONFIG_THREADS
+  if (handle->timeout)
+    semPost(&handle->contextSemaphore);
+#endif
 }
 /*----------------------------------------------------------------------------*/
 void freePoolNode(struct FatNode *node)
@@ -104,31 +121,143 @@ void freePoolNode(struct FatNode *node)
   struct FatHandle * const handle = (struct FatHandle *)node->handle;
 
   freeStaticNode(node);
-
-  lockPools(handle);
-  pointerQueuePushBack(&handle->pools.nodes.queue, node);
-  unlockPools(handle);
+  pushPoolEntry(&handle->pools.nodes, node);
+}
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+void freeReservedContext(struct FatHandle *handle,
+    struct CommandContext *context)
+{
+  pushPoolEntry(&handle->pools.reserved, context);
 }
+#endif
 /*----------------------------------------------------------------------------*/
 void freeStaticNode(struct FatNode *node)
 {
   FatNode->deinit(node);
 }
 /*----------------------------------------------------------------------------*/
-static inline void lockPools(struct FatHandle *handle)
+/*
+ * Place the pool in the external memory region starting at the position.
+ * The position is aligned and advanced past the pool on success.
+ */
+bool placePool(struct Pool *pool, uint8_t **position, const uint8_t *end,
+    size_t capacity, size_t width, size_t alignment)
 {
-#ifdef CONFIG_THREADS
-  mutexLock(&handle->memoryMutex);
+  assert(capacity > 0);
+
+  if (capacity >= POOL_INDEX_EMPTY || width > UINT16_MAX)
+    return false;
+
+  const uintptr_t address = (uintptr_t)*position;
+  const uintptr_t mask = (uintptr_t)alignment - 1;
+  uint8_t * const data = *position + (((address + mask) & ~mask) - address);
+  const size_t size = calcPoolSize(capacity, width);
+
+  if (data > end || (size_t)(end - data) < size)
+    return false;
+
+  initPool(pool, data, capacity, width);
+  pool->memory = NULL;
+  *position = data + size;
+
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Free entries form a stack of indices. In multithreaded configurations
+ * the head of the stack is replaced atomically and the change counter stored
+ * in the head prevents reuse of a stale link when the same entry was taken
+ * and returned by other threads between reading and replacing the head.
+ */
+void *popPoolEntry(struct Pool *pool)
+{
+  uint32_t index;
+
+#ifdef LOCK_FREE_ATOMICS
+  uint32_t head = atomic_load_explicit(&pool->head, memory_order_acquire);
+  uint32_t next;
+
+  do
+  {
+    index = head & POOL_INDEX_MASK;
+    if (index == POOL_INDEX_EMPTY)
+      return NULL;
+
+    next = ((head + POOL_TAG_STEP) & ~POOL_INDEX_MASK)
+        | atomic_load_explicit(&pool->links[index], memory_order_relaxed);
+  }
+  while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, next,
+      memory_order_acquire, memory_order_acquire));
 #else
-  (void)handle;
+#ifdef CONFIG_THREADS
+  mutexLock(pool->mutex);
 #endif
+
+  index = pool->head;
+  if (index != POOL_INDEX_EMPTY)
+    pool->head = pool->links[index];
+
+#ifdef CONFIG_THREADS
+  mutexUnlock(pool->mutex);
+#endif
+
+  if (index == POOL_INDEX_EMPTY)
+    return NULL;
+#endif
+
+  return (uint8_t *)pool->data + index * pool->width;
 }
 /*----------------------------------------------------------------------------*/
-static inline void unlockPools(struct FatHandle *handle)
+void pushPoolEntry(struct Pool *pool, void *entry)
 {
-#ifdef CONFIG_THREADS
-  mutexUnlock(&handle->memoryMutex);
+  const uint32_t index =
+      (uint32_t)(((uint8_t *)entry - (uint8_t *)pool->data) / pool->width);
+
+  assert(index < pool->capacity);
+
+#ifdef LOCK_FREE_ATOMICS
+  uint32_t head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+  uint32_t next;
+
+  do
+  {
+    atomic_store_explicit(&pool->links[index],
+        (uint16_t)(head & POOL_INDEX_MASK), memory_order_relaxed);
+    next = ((head + POOL_TAG_STEP) & ~POOL_INDEX_MASK) | index;
+  }
+  while (!atomic_compare_exchange_weak_explicit(&pool->head, &head, next,
+      memory_order_release, memory_order_relaxed));
 #else
-  (void)handle;
+#ifdef CONFIG_THREADS
+  mutexLock(pool->mutex);
 #endif
+
+  pool->links[index] = (uint16_t)pool->head;
+  pool->head = index;
+
+#ifdef CONFIG_THREADS
+  mutexUnlock(pool->mutex);
+#endif
+#endif
+}
+/*----------------------------------------------------------------------------*/
+static inline size_t calcPoolSize(size_t capacity, size_t width)
+{
+  /* Links are placed after entries, entry size keeps them aligned */
+  return (width + sizeof(PoolLink)) * capacity;
+}
+/*----------------------------------------------------------------------------*/
+static void initPool(struct Pool *pool, uint8_t *data, size_t capacity,
+    size_t width)
+{
+  pool->data = data;
+  pool->links = (PoolLink *)(data + capacity * width);
+  pool->capacity = (uint16_t)capacity;
+  pool->width = (uint16_t)width;
+
+  /* Entries with higher indices are allocated first */
+  for (size_t index = 0; index < capacity; ++index)
+    pool->links[index] = index ? (uint16_t)(index - 1) : POOL_INDEX_EMPTY;
+  pool->head = (uint32_t)(capacity - 1);
 }
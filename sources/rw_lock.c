@@ -0,0 +1,74 @@
+/*
+ * rw_lock.c
+ * Copyright (C) 2026 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#include <yaf/rw_lock.h>
+/*----------------------------------------------------------------------------*/
+enum Result rwLockInit(struct RwLock *lock)
+{
+  enum Result res;
+
+  res = mutexInit(&lock->mutex);
+  if (res != E_OK)
+    return res;
+
+  res = semInit(&lock->room, 1);
+  if (res != E_OK)
+  {
+    mutexDeinit(&lock->mutex);
+    return res;
+  }
+
+  res = semInit(&lock->turnstile, 1);
+  if (res != E_OK)
+  {
+    semDeinit(&lock->room);
+    mutexDeinit(&lock->mutex);
+    return res;
+  }
+
+  lock->readers = 0;
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+void rwLockDeinit(struct RwLock *lock)
+{
+  semDeinit(&lock->turnstile);
+  semDeinit(&lock->room);
+  mutexDeinit(&lock->mutex);
+}
+/*----------------------------------------------------------------------------*/
+void rwLockReadLock(struct RwLock *lock)
+{
+  /* Wait for the writer that is already queued */
+  semWait(&lock->turnstile);
+  semPost(&lock->turnstile);
+
+  mutexLock(&lock->mutex);
+  if (++lock->readers == 1)
+    semWait(&lock->room);
+  mutexUnlock(&lock->mutex);
+}
+/*----------------------------------------------------------------------------*/
+void rwLockReadUnlock(struct RwLock *lock)
+{
+  /* Room may be released by a thread other than the one that took it */
+  mutexLock(&lock->mutex);
+  if (--lock->readers == 0)
+    semPost(&lock->room);
+  mutexUnlock(&lock->mutex);
+}
+/*----------------------------------------------------------------------------*/
+void rwLockWriteLock(struct RwLock *lock)
+{
+  semWait(&lock->turnstile);
+  semWait(&lock->room);
+}
+/*----------------------------------------------------------------------------*/
+void rwLockWriteUnlock(struct RwLock *lock)
+{
+  semPost(&lock->turnstile);
+  semPost(&lock->room);
+}
@@ -10,31 +10,1077 @@
 #include <xcore/interface.h>
 #include <xcore/memory.h>
 /*----------------------------------------------------------------------------*/
-static enum Result readSector(void *, uint32_t, uint8_t *, size_t);
+#ifdef CONFIG_WRITE
+struct VolumeContext
+{
+  struct FatHandle *handle;
+
+  /* Buffer for a sector with directory entries */
+  uint8_t *entries;
+  /* Buffer for allocation table sectors and payload data */
+  uint8_t *buffer;
+
+  /* Number of the sector loaded into the entry buffer */
+  uint32_t entrySector;
+  /* Offset of the first table sector loaded into the buffer */
+  uint32_t tableOffset;
+  /* Number of table sectors loaded into the buffer */
+  uint32_t tableLength;
+  /* Size of the buffer in sectors */
+  uint32_t capacity;
+  /* Table sectors in the buffer were modified */
+  bool tableDirty;
+};
+
+struct TreePosition
+{
+  /* Cluster and index of the entry following the entered directory */
+  uint32_t cluster;
+  uint16_t index;
+};
+
+struct CheckState
+{
+  struct Fat32CheckReport *report;
+
+  /* Clusters referenced by the allocation table or by directory entries */
+  uint8_t *bitmap;
+  /* Number of chains referenced by directory entries */
+  uint32_t owned;
+};
+
+struct DefragState
+{
+  void (*callback)(void *, uint32_t, uint32_t);
+  void *argument;
+
+  /* Number of clusters in processed chains */
+  uint32_t processed;
+  /* Number of used clusters */
+  uint32_t total;
+
+  /* Cluster where the search for the next free run starts */
+  uint32_t searchCluster;
+  /* Length of the free run that was not found, zero when unknown */
+  uint32_t missingRun;
+};
+#endif
+/*----------------------------------------------------------------------------*/
+static enum Result formatRegion(void *, uint32_t, uint32_t, uint8_t *,
+    uint32_t, bool);
+static enum Result readSector(struct FatHandle *, uint32_t, uint8_t *,
+    size_t);
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+static enum Result checkNode(struct VolumeContext *, struct DirEntryImage *,
+    void *);
+static bool claimCluster(uint8_t *, uint32_t);
+static enum Result copyClusters(struct VolumeContext *, uint32_t, uint32_t,
+    uint32_t);
+static enum Result countUsedClusters(struct VolumeContext *, uint32_t *);
+static enum Result defragmentNode(struct VolumeContext *,
+    struct DirEntryImage *, void *);
+static enum Result fetchTreeEntry(struct VolumeContext *, uint32_t *,
+    uint16_t *, struct DirEntryImage **);
+static enum Result findFreeRun(struct VolumeContext *, struct DefragState *,
+    uint32_t, uint32_t *);
+static enum Result findLoopedChains(struct VolumeContext *, uint8_t *,
+    uint32_t *);
+static enum Result flushTable(struct VolumeContext *);
+static void initVolumeContext(struct VolumeContext *, struct FatHandle *,
+    uint8_t *, size_t);
+static bool isNodeEntry(const struct DirEntryImage *);
+static enum Result loadTable(struct VolumeContext *, uint32_t);
+static enum Result measureChain(struct VolumeContext *, uint32_t, uint32_t *,
+    bool *);
+static enum Result readCell(struct VolumeContext *, uint32_t, uint32_t *);
+static enum Result releaseLostChains(struct VolumeContext *, const uint8_t *,
+    uint32_t *);
+static enum Result relocateFile(struct VolumeContext *, struct DefragState *,
+    struct DirEntryImage *, uint32_t *);
+static enum Result scanTable(struct VolumeContext *, struct CheckState *,
+    uint32_t *);
+static enum Result walkTree(struct VolumeContext *,
+    enum Result (*)(struct VolumeContext *, struct DirEntryImage *, void *),
+    void *);
+static enum Result writeCell(struct VolumeContext *, uint32_t, uint32_t);
+static enum Result writeSector(struct FatHandle *, uint32_t,
+    const uint8_t *, size_t);
+#endif
+/*----------------------------------------------------------------------------*/
+/*
+ * Write the first sector of the buffer to the beginning of the region
+ * and clear the rest of the region with commands of up to the buffer size.
+ * Sectors of the buffer except for the first one should be zeroed.
+ * Clearing is skipped when the memory is known to be erased.
+ */
+static enum Result formatRegion(void *interface, uint32_t sector,
+    uint32_t count, uint8_t *buffer, uint32_t capacity, bool erased)
+{
+  uint32_t chunk = erased ? 1 : MIN(count, capacity);
+
+  while (count)
+  {
+    const uint64_t position = (uint64_t)sector << SECTOR_EXP;
+    const size_t length = (size_t)chunk << SECTOR_EXP;
+    enum Result res;
+
+    if ((res = ifSetParam(interface, IF_POSITION_64, &position)) != E_OK)
+      return res;
+    if (ifWrite(interface, buffer, length) != length)
+      return ifGetParam(interface, IF_STATUS, NULL);
+
+    /* Remaining sectors of the region are filled with zeros */
+    memset(buffer, 0, 1 << SECTOR_EXP);
+
+    if (erased)
+      break;
+
+    sector += chunk;
+    count -= chunk;
+    chunk = MIN(count, capacity);
+  }
+
+  return E_OK;
+}
 /*----------------------------------------------------------------------------*/
-static enum Result readSector(void *interface, uint32_t sector,
+static enum Result readSector(struct FatHandle *handle, uint32_t sector,
     uint8_t *buffer, size_t length)
 {
   const uint64_t position = (uint64_t)sector << SECTOR_EXP;
   enum Result res;
 
-  ifSetParam(interface, IF_ACQUIRE, NULL);
+  ifSetParam(handle->interface, IF_ACQUIRE, NULL);
+
+  res = ifSetParam(handle->interface, IF_POSITION_64, &position);
+  if (res == E_OK)
+  {
+    if (ifRead(handle->interface, buffer, length) != length)
+      res = ifGetParam(handle->interface, IF_STATUS, NULL);
+  }
+
+  ifSetParam(handle->interface, IF_RELEASE, NULL);
+
+  /* Utility commands are accounted like the commands of the handle */
+  if (res == E_OK)
+  {
+    updateCounter(handle, length > SECTOR_SIZE ?
+        FAT_COUNTER_BUFFER_READS : FAT_COUNTER_SECTOR_READS, 1);
+    updateCounter(handle, FAT_COUNTER_READ_SECTORS, length >> SECTOR_EXP);
+  }
+
+  return res;
+}
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+static enum Result checkNode(struct VolumeContext *context,
+    struct DirEntryImage *entry, void *argument)
+{
+  struct CheckState * const state = argument;
+  const uint32_t first = makeClusterNumber(entry);
+
+  if (first == RESERVED_CLUSTER)
+    return E_OK;
+
+  if (first < CLUSTER_OFFSET || first >= context->handle->clusterCount)
+  {
+    ++state->report->invalidEntries;
+    return E_EXIST;
+  }
+
+  uint32_t value;
+  const enum Result res = readCell(context, first, &value);
+
+  if (res != E_OK)
+    return res;
+
+  /* First cluster of the node is not allocated */
+  if (isClusterFree(value) || (value & 0x0FFFFFFFUL) == CLUSTER_BAD_VAL)
+  {
+    ++state->report->invalidEntries;
+    return E_EXIST;
+  }
+
+  /* Chain is referenced by another entry or by the allocation table */
+  if (!claimCluster(state->bitmap, first))
+  {
+    ++state->report->crossLinks;
+    return E_EXIST;
+  }
+
+  ++state->owned;
+  return E_OK;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+static bool claimCluster(uint8_t *bitmap, uint32_t cluster)
+{
+  const uint8_t mask = 1 << (cluster & 7);
+  uint8_t * const position = bitmap + (cluster >> 3);
+
+  if (*position & mask)
+    return false;
+
+  *position |= mask;
+  return true;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+static enum Result copyClusters(struct VolumeContext *context,
+    uint32_t source, uint32_t destination, uint32_t count)
+{
+  struct FatHandle * const handle = context->handle;
+  const uint32_t sourceSector = calcSectorNumber(handle, source);
+  const uint32_t destinationSector = calcSectorNumber(handle, destination);
+  const uint32_t total = count << clusterExp(handle);
+  enum Result res;
+
+  /* Buffer with table sectors is reused for the payload */
+  res = flushTable(context);
+  if (res != E_OK)
+    return res;
+  context->tableLength = 0;
+
+  for (uint32_t offset = 0; offset < total;)
+  {
+    const uint32_t chunk = MIN(context->capacity, total - offset);
+
+    res = readSector(handle, sourceSector + offset,
+        context->buffer, chunk << SECTOR_EXP);
+    if (res != E_OK)
+      return res;
+    res = writeSector(handle, destinationSector + offset,
+        context->buffer, chunk << SECTOR_EXP);
+    if (res != E_OK)
+      return res;
+
+    offset += chunk;
+  }
+
+  return E_OK;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+static enum Result countUsedClusters(struct VolumeContext *context,
+    uint32_t *count)
+{
+  *count = 0;
+
+  for (uint32_t cluster = CLUSTER_OFFSET;
+      cluster < context->handle->clusterCount; ++cluster)
+  {
+    uint32_t value;
+    const enum Result res = readCell(context, cluster, &value);
+
+    if (res != E_OK)
+      return res;
+
+    if (!isClusterFree(value))
+      ++*count;
+  }
+
+  return E_OK;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+static enum Result defragmentNode(struct VolumeContext *context,
+    struct DirEntryImage *entry, void *argument)
+{
+  struct DefragState * const state = argument;
+  uint32_t length;
+  enum Result res;
+
+  if (entry->flags & FLAG_DIR)
+  {
+    bool contiguous;
+
+    res = measureChain(context, makeClusterNumber(entry), &length,
+        &contiguous);
+    if (res == E_OK)
+      state->processed += length;
+  }
+  else
+  {
+    res = relocateFile(context, state, entry, &length);
+
+    if (res == E_OK)
+    {
+      state->processed += length;
+
+      if (state->callback != NULL)
+        state->callback(state->argument, state->processed, state->total);
+    }
+  }
+
+  return res;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+static enum Result fetchTreeEntry(struct VolumeContext *context,
+    uint32_t *cluster, uint16_t *index, struct DirEntryImage **entry)
+{
+  struct FatHandle * const handle = context->handle;
+
+  if (*index >= calcNodeCount(handle))
+  {
+    uint32_t next;
+    const enum Result res = readCell(context, *cluster, &next);
+
+    if (res != E_OK)
+      return res;
+    if (!isClusterUsed(next))
+      return E_EMPTY;
+
+    *cluster = next;
+    *index = 0;
+  }
+
+  const uint32_t sector = calcSectorNumber(handle, *cluster)
+      + ENTRY_SECTOR(*index);
+
+  if (sector != context->entrySector)
+  {
+    const enum Result res = readSector(handle, sector,
+        context->entries, SECTOR_SIZE);
+
+    if (res != E_OK)
+    {
+      context->entrySector = RESERVED_SECTOR;
+      return res;
+    }
+
+    context->entrySector = sector;
+  }
+
+  *entry = (struct DirEntryImage *)context->entries + ENTRY_INDEX(*index);
+  return E_OK;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+/*
+ * Search starts after the previously found run and wraps around the end
+ * of the table. Clusters following the start position are checked again
+ * after the wrap to find runs spanning the start position. Lengths of runs
+ * that were not found are remembered until clusters are released.
+ */
+static enum Result findFreeRun(struct VolumeContext *context,
+    struct DefragState *state, uint32_t length, uint32_t *first)
+{
+  const uint32_t count = context->handle->clusterCount;
+  uint32_t cluster = state->searchCluster;
+  uint32_t found = 0;
+  uint32_t remaining = count - CLUSTER_OFFSET + length - 1;
+
+  if (state->missingRun && length >= state->missingRun)
+    return E_FULL;
+
+  do
+  {
+    uint32_t value;
+    const enum Result res = readCell(context, cluster, &value);
+
+    if (res != E_OK)
+      return res;
+
+    if (isClusterFree(value))
+    {
+      if (++found == length)
+      {
+        *first = cluster + 1 - length;
+        state->searchCluster = cluster + 1 < count ?
+            cluster + 1 : CLUSTER_OFFSET;
+        return E_OK;
+      }
+    }
+    else
+      found = 0;
+
+    if (++cluster == count)
+    {
+      /* Runs are not continued across the end of the table */
+      cluster = CLUSTER_OFFSET;
+      found = 0;
+    }
+  }
+  while (--remaining);
+
+  state->missingRun = length;
+  return E_FULL;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+/*
+ * Clusters of looped chains are referenced by other clusters but are not
+ * reachable from first clusters of the chains. Bits of the referenced
+ * clusters are cleared during the search and restored afterwards.
+ */
+static enum Result findLoopedChains(struct VolumeContext *context,
+    uint8_t *bitmap, uint32_t *looped)
+{
+  const uint32_t count = context->handle->clusterCount;
+  enum Result res;
+
+  *looped = 0;
+
+  for (uint32_t pass = 0; pass < 2; ++pass)
+  {
+    for (uint32_t cluster = CLUSTER_OFFSET; cluster < count; ++cluster)
+    {
+      const bool marked = (bitmap[cluster >> 3] & (1 << (cluster & 7))) != 0;
+
+      /* First pass starts from heads, second pass starts from loops */
+      if (marked != (pass != 0))
+        continue;
+
+      uint32_t current = cluster;
+      uint32_t value;
+
+      res = readCell(context, current, &value);
+      if (res != E_OK)
+        return res;
+      if (pass)
+        ++*looped;
+
+      while (isClusterUsed(value) && (value & 0x0FFFFFFFUL) < count)
+      {
+        const uint32_t next = value & 0x0FFFFFFFUL;
+        const uint8_t mask = 1 << (next & 7);
+
+        if (!(bitmap[next >> 3] & mask))
+          break;
+        bitmap[next >> 3] &= ~mask;
+
+        current = next;
+        res = readCell(context, current, &value);
+        if (res != E_OK)
+          return res;
+      }
+    }
+  }
+
+  /* Restore references between clusters */
+  for (uint32_t cluster = CLUSTER_OFFSET; cluster < count; ++cluster)
+  {
+    uint32_t value;
+
+    res = readCell(context, cluster, &value);
+    if (res != E_OK)
+      return res;
+
+    if (isClusterUsed(value) && (value & 0x0FFFFFFFUL) < count)
+      claimCluster(bitmap, value & 0x0FFFFFFFUL);
+  }
+
+  return E_OK;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+static enum Result flushTable(struct VolumeContext *context)
+{
+  struct FatHandle * const handle = context->handle;
+
+  if (!context->tableDirty)
+    return E_OK;
+
+  for (size_t fat = 0; fat < handle->tableCount; ++fat)
+  {
+    const enum Result res = writeSector(handle,
+        handle->tableSector + handle->tableSize * fat + context->tableOffset,
+        context->buffer, context->tableLength << SECTOR_EXP);
+
+    if (res != E_OK)
+      return res;
+  }
+
+  context->tableDirty = false;
+  return E_OK;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+static void initVolumeContext(struct VolumeContext *context,
+    struct FatHandle *handle, uint8_t *arena, size_t size)
+{
+  /* First sector of the arena is reserved for directory entries */
+  context->handle = handle;
+  context->entries = arena;
+  context->buffer = arena + SECTOR_SIZE;
+  context->entrySector = RESERVED_SECTOR;
+  context->tableOffset = 0;
+  context->tableLength = 0;
+  context->capacity = (uint32_t)(size >> SECTOR_EXP) - 1;
+  context->tableDirty = false;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+static bool isNodeEntry(const struct DirEntryImage *entry)
+{
+  /* Skip deleted entries, long name entries, volume labels and dot entries */
+  return entry->name[0] && entry->name[0] != E_FLAG_EMPTY
+      && entry->name[0] != '.' && !(entry->flags & FLAG_VOLUME);
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+/* Load a group of table sectors containing the required sector */
+static enum Result loadTable(struct VolumeContext *context, uint32_t offset)
+{
+  struct FatHandle * const handle = context->handle;
+
+  if (offset - context->tableOffset < context->tableLength)
+    return E_OK;
+
+  enum Result res = flushTable(context);
+
+  if (res != E_OK)
+    return res;
+
+  const uint32_t first = offset - offset % context->capacity;
+  const uint32_t length = MIN(context->capacity, handle->tableSize - first);
+
+  context->tableLength = 0;
+
+  res = readSector(handle, handle->tableSector + first,
+      context->buffer, length << SECTOR_EXP);
+  if (res != E_OK)
+    return res;
+
+  context->tableOffset = first;
+  context->tableLength = length;
+  return E_OK;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+static enum Result measureChain(struct VolumeContext *context, uint32_t first,
+    uint32_t *length, bool *contiguous)
+{
+  uint32_t current = first;
+
+  *contiguous = true;
+  *length = 0;
+
+  if (!isClusterUsed(first))
+    return E_OK;
+
+  while (1)
+  {
+    uint32_t next;
+    const enum Result res = readCell(context, current, &next);
+
+    if (res != E_OK)
+      return res;
+
+    /* Chain is looped */
+    if (++*length >= context->handle->clusterCount)
+      return E_ERROR;
+
+    if (!isClusterUsed(next))
+      return E_OK;
+    if (next != current + 1)
+      *contiguous = false;
+
+    current = next;
+  }
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+static enum Result readCell(struct VolumeContext *context, uint32_t cluster,
+    uint32_t *value)
+{
+  const enum Result res = loadTable(context, cluster >> CELL_COUNT_EXP);
+
+  if (res != E_OK)
+    return res;
+
+  const uint32_t position = cluster - (context->tableOffset << CELL_COUNT_EXP);
+
+  memcpy(value, context->buffer + position * sizeof(*value), sizeof(*value));
+  *value = fromLittleEndian32(*value);
+  return E_OK;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+/* Heads of the lost chains are used clusters without references */
+static enum Result releaseLostChains(struct VolumeContext *context,
+    const uint8_t *bitmap, uint32_t *released)
+{
+  for (uint32_t cluster = CLUSTER_OFFSET;
+      cluster < context->handle->clusterCount; ++cluster)
+  {
+    if (bitmap[cluster >> 3] & (1 << (cluster & 7)))
+      continue;
+
+    uint32_t current = cluster;
+    uint32_t value;
+    enum Result res;
+
+    res = readCell(context, current, &value);
+    if (res != E_OK)
+      return res;
+    if (isClusterFree(value) || (value & 0x0FFFFFFFUL) == CLUSTER_BAD_VAL)
+      continue;
+
+    /* Cross-links are absent, clusters of the chain have no other owners */
+    while (1)
+    {
+      res = writeCell(context, current, 0);
+      if (res != E_OK)
+        return res;
+
+      ++*released;
+
+      if (!isClusterUsed(value)
+          || (value & 0x0FFFFFFFUL) >= context->handle->clusterCount)
+      {
+        break;
+      }
+
+      current = value & 0x0FFFFFFFUL;
+
+      res = readCell(context, current, &value);
+      if (res != E_OK)
+        return res;
+      if (isClusterFree(value))
+        break;
+    }
+  }
+
+  return flushTable(context);
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+static enum Result relocateFile(struct VolumeContext *context,
+    struct DefragState *state, struct DirEntryImage *entry, uint32_t *length)
+{
+  struct FatHandle * const handle = context->handle;
+  const uint32_t first = makeClusterNumber(entry);
+  uint32_t count;
+  bool contiguous;
+  enum Result res;
+
+  res = measureChain(context, first, &count, &contiguous);
+  *length = count;
+
+  if (res != E_OK || contiguous)
+    return res;
+
+  uint32_t target;
+
+  res = findFreeRun(context, state, count, &target);
+  if (res == E_FULL)
+    return E_OK; /* Chain is left fragmented */
+  else if (res != E_OK)
+    return res;
+
+  /* Payload is copied using contiguous runs of the source chain */
+  uint32_t destination = target;
+  uint32_t current = first;
+
+  for (uint32_t remaining = count; remaining;)
+  {
+    uint32_t run = 1;
+    uint32_t next;
+
+    while (1)
+    {
+      res = readCell(context, current + run - 1, &next);
+      if (res != E_OK)
+        return res;
+
+      if (run < remaining && next == current + run)
+        ++run;
+      else
+        break;
+    }
+
+    res = copyClusters(context, current, destination, run);
+    if (res != E_OK)
+      return res;
+
+    destination += run;
+    remaining -= run;
+    current = next;
+  }
+
+  /* Link clusters of the new chain */
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    res = writeCell(context, target + i,
+        i + 1 < count ? target + i + 1 : CLUSTER_EOC_VAL);
+    if (res != E_OK)
+      return res;
+  }
+
+  res = flushTable(context);
+  if (res != E_OK)
+    return res;
+
+  /* Switch the directory entry to the new chain */
+  entry->clusterHigh = toLittleEndian16((uint16_t)(target >> 16));
+  entry->clusterLow = toLittleEndian16((uint16_t)target);
+
+  res = writeSector(handle, context->entrySector,
+      context->entries, SECTOR_SIZE);
+  if (res != E_OK)
+    return res;
+
+  /* Release clusters of the old chain */
+  current = first;
+
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    uint32_t next;
+
+    res = readCell(context, current, &next);
+    if (res != E_OK)
+      return res;
+    res = writeCell(context, current, 0);
+    if (res != E_OK)
+      return res;
+
+    current = next;
+  }
+
+  /* Released clusters may form runs that were not found before */
+  state->missingRun = 0;
+  return flushTable(context);
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+/* References between clusters are collected during a single table pass */
+static enum Result scanTable(struct VolumeContext *context,
+    struct CheckState *state, uint32_t *heads)
+{
+  struct Fat32CheckReport * const report = state->report;
+  const uint32_t count = context->handle->clusterCount;
+  uint32_t referenced = 0;
+  uint32_t used = 0;
+
+  for (uint32_t cluster = CLUSTER_OFFSET; cluster < count; ++cluster)
+  {
+    uint32_t value;
+    const enum Result res = readCell(context, cluster, &value);
+
+    if (res != E_OK)
+      return res;
+
+    if (isClusterFree(value))
+    {
+      ++report->freeClusters;
+      continue;
+    }
+
+    /* Bad clusters do not belong to chains */
+    if ((value & 0x0FFFFFFFUL) == CLUSTER_BAD_VAL)
+      continue;
+
+    ++used;
+
+    if (isClusterUsed(value))
+    {
+      const uint32_t next = value & 0x0FFFFFFFUL;
+
+      if (next >= count)
+        ++report->invalidLinks;
+      else if (!claimCluster(state->bitmap, next))
+        ++report->crossLinks;
+      else
+        ++referenced;
+    }
+  }
+
+  /* Remaining used clusters are first clusters of the chains */
+  *heads = used - referenced;
+  return E_OK;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+/*
+ * Visitor is called for each node of the directory tree. Directories are
+ * entered when the visitor returns E_OK, E_EXIST result means that the
+ * directory should be skipped, other results stop the walk. Positions in
+ * parent directories are kept in a bounded stack and dot entries are not
+ * followed, so the walk does not depend on parent links of directories.
+ */
+static enum Result walkTree(struct VolumeContext *context,
+    enum Result (*visit)(struct VolumeContext *, struct DirEntryImage *,
+        void *), void *argument)
+{
+  struct TreePosition stack[MAX_TREE_DEPTH];
+  size_t depth = 0;
+  uint32_t cluster = context->handle->rootCluster;
+  uint16_t index = 0;
+
+  while (1)
+  {
+    struct DirEntryImage *entry;
+    enum Result res;
+
+    res = fetchTreeEntry(context, &cluster, &index, &entry);
+    if (res != E_OK && res != E_EMPTY)
+      return res;
+
+    if (res == E_EMPTY || !entry->name[0])
+    {
+      /* End of the directory */
+      if (!depth)
+        return E_OK;
+
+      /* Scan of the parent directory continues after the entry */
+      --depth;
+      cluster = stack[depth].cluster;
+      index = stack[depth].index;
+      continue;
+    }
+
+    ++index;
+
+    if (!isNodeEntry(entry))
+      continue;
+
+    res = visit(context, entry, argument);
+
+    if (res == E_OK)
+    {
+      const uint32_t first = makeClusterNumber(entry);
+
+      if ((entry->flags & FLAG_DIR) && isClusterUsed(first))
+      {
+        /* Directory tree is too deep or contains a loop */
+        if (depth == MAX_TREE_DEPTH)
+          return E_ERROR;
+
+        stack[depth++] = (struct TreePosition){cluster, index};
+        cluster = first;
+        index = 0;
+      }
+    }
+    else if (res != E_EXIST)
+      return res;
+  }
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+static enum Result writeCell(struct VolumeContext *context, uint32_t cluster,
+    uint32_t value)
+{
+  const enum Result res = loadTable(context, cluster >> CELL_COUNT_EXP);
+
+  if (res != E_OK)
+    return res;
+
+  const uint32_t position = cluster - (context->tableOffset << CELL_COUNT_EXP);
+  const uint32_t cell = toLittleEndian32(value);
+
+  memcpy(context->buffer + position * sizeof(cell), &cell, sizeof(cell));
+  context->tableDirty = true;
+  return E_OK;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_WRITE
+static enum Result writeSector(struct FatHandle *handle, uint32_t sector,
+    const uint8_t *buffer, size_t length)
+{
+  const uint64_t position = (uint64_t)sector << SECTOR_EXP;
+  enum Result res;
+
+  ifSetParam(handle->interface, IF_ACQUIRE, NULL);
 
-  res = ifSetParam(interface, IF_POSITION_64, &position);
+  res = ifSetParam(handle->interface, IF_POSITION_64, &position);
   if (res == E_OK)
   {
-    if (ifRead(interface, buffer, length) != length)
-      res = ifGetParam(interface, IF_STATUS, NULL);
+    if (ifWrite(handle->interface, buffer, length) != length)
+      res = ifGetParam(handle->interface, IF_STATUS, NULL);
+  }
+
+  ifSetParam(handle->interface, IF_RELEASE, NULL);
+
+  /* Utility commands are accounted like the commands of the handle */
+  if (res == E_OK)
+  {
+    updateCounter(handle, length > SECTOR_SIZE ?
+        FAT_COUNTER_BUFFER_WRITES : FAT_COUNTER_SECTOR_WRITES, 1);
+    updateCounter(handle, FAT_COUNTER_WRITTEN_SECTORS, length >> SECTOR_EXP);
   }
 
-  ifSetParam(interface, IF_RELEASE, NULL);
   return res;
 }
+#endif
+/*----------------------------------------------------------------------------*/
+/*
+ * Verify the allocation table and the directory tree of the volume.
+ * The arena should hold a bitmap with one bit per cluster followed by
+ * at least two sectors used as buffers. In the repair mode lost chains
+ * are released when there are no cross-links and the number of free
+ * clusters in the information sector is updated. Looped chains and
+ * directory entries with unallocated first clusters are only reported.
+ * Other nodes of the handle should not be used during the check.
+ */
+enum Result fat32Check(void *object, void *arena, size_t size, bool repair,
+    struct Fat32CheckReport *report)
+{
+#ifdef CONFIG_WRITE
+  struct FatHandle * const handle = object;
+  const size_t bitmapSize = (handle->clusterCount + 7) >> 3;
+
+  if (size < bitmapSize + 2 * SECTOR_SIZE)
+    return E_MEMORY;
+
+  struct CheckState state = {
+      .report = report,
+      .bitmap = arena,
+      .owned = 0
+  };
+  struct VolumeContext context;
+  uint32_t heads;
+  enum Result res;
+
+  memset(report, 0, sizeof(*report));
+  memset(state.bitmap, 0, bitmapSize);
+  initVolumeContext(&context, handle, (uint8_t *)arena + bitmapSize,
+      size - bitmapSize);
+
+  res = scanTable(&context, &state, &heads);
+  if (res != E_OK)
+    return res;
+
+  res = findLoopedChains(&context, state.bitmap, &report->loopedChains);
+  if (res != E_OK)
+    return res;
+
+  /* Root directory is owned by the volume */
+  if (claimCluster(state.bitmap, handle->rootCluster))
+    ++state.owned;
+  else
+    ++report->crossLinks;
+
+  res = walkTree(&context, checkNode, &state);
+  if (res != E_OK)
+    return res;
+
+  if (heads > state.owned)
+    report->lostChains = heads - state.owned;
+
+  /* Information sector is loaded into the entry buffer */
+  struct InfoSectorImage * const info =
+      (struct InfoSectorImage *)context.entries;
+
+  context.entrySector = RESERVED_SECTOR;
+
+  res = readSector(handle, handle->infoSector, context.entries,
+      SECTOR_SIZE);
+  if (res != E_OK)
+    return res;
+
+  report->infoFreeClusters = fromLittleEndian32(info->freeClusters);
+
+  if (!repair)
+    return E_OK;
+
+  if (report->lostChains && !report->crossLinks)
+  {
+    uint32_t released = 0;
+
+    res = releaseLostChains(&context, state.bitmap, &released);
+    if (res != E_OK)
+      return res;
+
+    report->freeClusters += released;
+  }
+
+  if (report->infoFreeClusters != report->freeClusters)
+  {
+    info->freeClusters = toLittleEndian32(report->freeClusters);
+
+    res = writeSector(handle, handle->infoSector, context.entries,
+        SECTOR_SIZE);
+    if (res != E_OK)
+      return res;
+  }
+
+  return E_OK;
+#else
+  (void)object;
+  (void)arena;
+  (void)size;
+  (void)repair;
+  (void)report;
+
+  return E_INVALID;
+#endif
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Relocate fragmented file chains into contiguous runs of free clusters.
+ * The arena should hold at least two sectors, larger arenas allow copying
+ * of the payload with fewer requests. Directories are not relocated.
+ * The callback function, when provided, receives the number of processed
+ * clusters and the total number of used clusters after each file.
+ * Locks of the handle are not taken, the volume should be quiescent: other
+ * nodes of the handle should not be used and the handle should not be
+ * accessed from other threads during the defragmentation.
+ */
+enum Result fat32Defragment(void *object, void *arena, size_t size,
+    void (*callback)(void *, uint32_t, uint32_t), void *argument)
+{
+#ifdef CONFIG_WRITE
+  if (size < 2 * SECTOR_SIZE)
+    return E_MEMORY;
+
+  struct FatHandle * const handle = object;
+  struct DefragState state = {
+      .callback = callback,
+      .argument = argument,
+      .searchCluster = CLUSTER_OFFSET,
+      .missingRun = 0
+  };
+  struct VolumeContext context;
+  bool contiguous;
+  enum Result res;
+
+  initVolumeContext(&context, handle, arena, size);
+
+  res = countUsedClusters(&context, &state.total);
+  if (res != E_OK)
+    return res;
+  res = measureChain(&context, handle->rootCluster, &state.processed,
+      &contiguous);
+  if (res != E_OK)
+    return res;
+
+  return walkTree(&context, defragmentNode, &state);
+#else
+  (void)object;
+  (void)arena;
+  (void)size;
+  (void)callback;
+  (void)argument;
+
+  return E_INVALID;
+#endif
+}
 /*----------------------------------------------------------------------------*/
 FsCapacity fat32GetCapacity(const void *object)
 {
   const struct FatHandle * const handle = object;
-  const uint32_t clusterSize = SECTOR_SIZE * (1 << handle->clusterSize);
+  const uint32_t clusterSize = SECTOR_SIZE * (1 << clusterExp(handle));
   const uint32_t clustersTotal = handle->clusterCount - CLUSTER_OFFSET;
 
   return (FsCapacity)clusterSize * clustersTotal;
@@ -43,13 +1089,13 @@ FsCapacity fat32GetCapacity(const void *object)
 size_t fat32GetClusterSize(const void *object)
 {
   const struct FatHandle * const handle = object;
-  return (size_t)(SECTOR_SIZE * (1 << handle->clusterSize));
+  return (size_t)(SECTOR_SIZE * (1 << clusterExp(handle)));
 }
 /*----------------------------------------------------------------------------*/
 enum Result fat32GetUsage(void *object, void *arena, size_t size,
     FsCapacity *result)
 {
-  const struct FatHandle * const handle = object;
+  struct FatHandle * const handle = object;
   uint8_t * const buffer = arena;
   uint32_t cluster = 0;
   uint32_t used = 0;
@@ -64,7 +1110,7 @@ enum Result fat32GetUsage(void *object, void *arena, size_t size,
 
       const uint32_t sector = handle->tableSector + (cluster >> CELL_COUNT_EXP);
 
-      res = readSector(handle->interface, sector, buffer, size);
+      res = readSector(handle, sector, buffer, size);
       if (res != E_OK)
         break;
     }
@@ -83,7 +1129,7 @@ enum Result fat32GetUsage(void *object, void *arena, size_t size,
 
   if (res == E_OK)
   {
-    const uint32_t count = 1U << (handle->clusterSize + SECTOR_EXP);
+    const uint32_t count = 1U << (clusterExp(handle) + SECTOR_EXP);
     *result = (FsCapacity)count * used;
   }
 
@@ -106,18 +1152,47 @@ enum Result fat32MakeFs(void *interface, const struct Fat32FsConfig *config,
     return res;
   partitionSize >>= SECTOR_EXP;
 
-  const uint32_t reservedSectors = config->reserved ?
+  /* Allocation unit should be a multiple of the sector size */
+  if (config->alignment & ((1 << SECTOR_EXP) - 1))
+    return E_VALUE;
+
+  const uint64_t alignment = config->alignment >> SECTOR_EXP;
+  uint64_t reservedSectors = config->reserved ?
       config->reserved : reservedSectorsDefault;
+
+  /* Tables start on the allocation unit boundary */
+  if (alignment)
+    reservedSectors = (reservedSectors + alignment - 1) / alignment * alignment;
+  if (reservedSectors > UINT16_MAX)
+    return E_VALUE;
+
   const uint32_t sectorsPerCluster = config->cluster >> SECTOR_EXP;
   const uint32_t sectorCount = MIN(partitionSize, UINT32_MAX);
 
   if (sectorCount < reservedSectors + sectorsPerCluster + config->tables)
     return E_VALUE;
 
-  const uint32_t clusterCount =
+  const uint64_t clusterCount =
       ((sectorCount - reservedSectors) * clustersPerSector
           - config->tables * (clustersPerSector - 1))
       / (config->tables + sectorsPerCluster * clustersPerSector);
+  uint64_t sectorsPerTable =
+      (clusterCount + (clustersPerSector - 1)) / clustersPerSector;
+
+  /*
+   * Tables are padded to a multiple of the allocation unit, so that
+   * each table copy and the data region start on unit boundaries.
+   */
+  if (alignment)
+  {
+    sectorsPerTable = (sectorsPerTable + alignment - 1) / alignment * alignment;
+
+    if (sectorCount < reservedSectors + sectorsPerTable * config->tables
+        + sectorsPerCluster)
+    {
+      return E_VALUE;
+    }
+  }
 
   static const uint64_t bootPosition = 0;
   struct BootSectorImage bImage;
@@ -137,14 +1212,13 @@ enum Result fat32MakeFs(void *interface, const struct Fat32FsConfig *config,
   /* OEM identifier */
   memcpy(bImage.oemName, "libyaf", 6);
   /* Reserved sectors in front of the FAT */
-  bImage.reservedSectors = reservedSectors;
+  bImage.reservedSectors = (uint16_t)reservedSectors;
   /* Number of FAT copies */
   bImage.tableCount = config->tables;
   /* Sectors per partition */
   bImage.sectorsPerPartition = sectorCount;
   /* Sectors per FAT record */
-  bImage.sectorsPerTable =
-      (clusterCount + (clustersPerSector - 1)) / clustersPerSector;
+  bImage.sectorsPerTable = (uint32_t)sectorsPerTable;
   /* Root directory cluster */
   bImage.rootCluster = CLUSTER_OFFSET;
   /* Information sector number */
@@ -170,7 +1244,9 @@ enum Result fat32MakeFs(void *interface, const struct Fat32FsConfig *config,
 
   iImage.firstSignature = TO_BIG_ENDIAN_32(0x52526141UL);
   iImage.infoSignature = TO_BIG_ENDIAN_32(0x72724161UL);
-  iImage.freeClusters = clusterCount - 3;
+  /* Clusters of the data region except for the root directory cluster */
+  iImage.freeClusters = (sectorCount - bImage.reservedSectors
+      - bImage.sectorsPerTable * bImage.tableCount) / sectorsPerCluster - 1;
   iImage.lastAllocated = bImage.rootCluster;
   iImage.bootSignature = TO_BIG_ENDIAN_16(0x55AA);
 
@@ -179,78 +1255,52 @@ enum Result fat32MakeFs(void *interface, const struct Fat32FsConfig *config,
   if (ifWrite(interface, &iImage, sizeof(iImage)) != sizeof(iImage))
     return ifGetParam(interface, IF_STATUS, NULL);
 
-  uint8_t buffer[1 << SECTOR_EXP];
+  uint8_t sectorBuffer[1 << SECTOR_EXP];
+  uint8_t *buffer;
+  uint32_t capacity;
+
+  /* The arena allows clearing of many sectors with a single command */
+  if (arena != NULL)
+  {
+    buffer = arena;
+    capacity = (uint32_t)MIN(size >> SECTOR_EXP, UINT32_MAX);
+  }
+  else
+  {
+    buffer = sectorBuffer;
+    capacity = 1;
+  }
+  memset(buffer, 0, (size_t)capacity << SECTOR_EXP);
 
   /* Format FAT tables */
   for (size_t fat = 0; fat < bImage.tableCount; ++fat)
   {
-    size_t tableArenaSize;
-    uint8_t *tableArena;
-
-    if (arena != NULL)
-    {
-      tableArena = arena;
-      tableArenaSize = size & ~((1 << SECTOR_EXP) - 1);
-    }
-    else
-    {
-      tableArena = buffer;
-      tableArenaSize = 1 << SECTOR_EXP;
-    }
-
-    for (uint32_t i = 0; i < bImage.sectorsPerTable;)
-    {
-      if (i == 0)
-      {
-        static const uint32_t pattern[] = {
-            TO_LITTLE_ENDIAN_32(CLUSTER_EOC_VAL),
-            TO_LITTLE_ENDIAN_32(CLUSTER_RES_VAL),
-            TO_LITTLE_ENDIAN_32(CLUSTER_EOC_VAL)
-        };
-
-        memcpy(tableArena, pattern, sizeof(pattern));
-        memset(tableArena + sizeof(pattern), 0,
-            tableArenaSize - sizeof(pattern));
-      }
-
-      const uint32_t sectors = i + bImage.reservedSectors
-          + bImage.sectorsPerTable * fat;
-      const uint64_t position = (uint64_t)sectors << SECTOR_EXP;
-
-      if ((res = ifSetParam(interface, IF_POSITION_64, &position)) != E_OK)
-        return res;
-      if (ifWrite(interface, tableArena, tableArenaSize) != tableArenaSize)
-        return ifGetParam(interface, IF_STATUS, NULL);
+    static const uint32_t pattern[] = {
+        TO_LITTLE_ENDIAN_32(CLUSTER_EOC_VAL),
+        TO_LITTLE_ENDIAN_32(CLUSTER_RES_VAL),
+        TO_LITTLE_ENDIAN_32(CLUSTER_EOC_VAL)
+    };
+    const uint32_t sector = bImage.reservedSectors
+        + bImage.sectorsPerTable * fat;
 
-      if (i == 0)
-        memset(tableArena, 0, tableArenaSize);
+    memcpy(buffer, pattern, sizeof(pattern));
 
-      i += tableArenaSize >> SECTOR_EXP;
-    }
+    res = formatRegion(interface, sector, bImage.sectorsPerTable, buffer,
+        capacity, config->erased);
+    if (res != E_OK)
+      return res;
   }
 
-  /* Clear root cluster */
-  memset(buffer, 0, sizeof(buffer));
-
-  for (size_t i = 0; i < sectorsPerCluster; ++i)
+  /* Add volume label */
+  if (config->label != NULL)
   {
-    /* Add volume label */
-    if (i == 0 && config->label != NULL)
-    {
-      struct DirEntryImage * const entry = (struct DirEntryImage *)buffer;
-      memcpy(entry->filename, config->label, strlen(config->label));
-      entry->flags = FLAG_VOLUME;
-    }
-
-    const uint32_t sectors = i + bImage.reservedSectors
-        + bImage.sectorsPerTable * bImage.tableCount;
-    const uint64_t position = (uint64_t)sectors << SECTOR_EXP;
-
-    if ((res = ifSetParam(interface, IF_POSITION_64, &position)) != E_OK)
-      return res;
-    if (ifWrite(interface, buffer, sizeof(buffer)) != sizeof(buffer))
-      return ifGetParam(interface, IF_STATUS, NULL);
+    struct DirEntryImage * const entry = (struct DirEntryImage *)buffer;
+    memcpy(entry->filename, config->label, strlen(config->label));
+    entry->flags = FLAG_VOLUME;
   }
 
-  return E_OK;
+  /* Clear root cluster */
+  return formatRegion(interface,
+      bImage.reservedSectors + bImage.sectorsPerTable * bImage.tableCount,
+      sectorsPerCluster, buffer, capacity, config->erased);
 }
@@ -6,9 +6,129 @@
 
 #include "default_fs.h"
 #include "helpers.h"
+#include <yaf/fat32.h>
 #include <xcore/fs/utils.h>
 #include <check.h>
 #include <stdlib.h>
+
+#ifdef CONFIG_THREADS
+#include <pthread.h>
+#include <semaphore.h>
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_THREADS
+struct ContextRelease
+{
+  struct FsHandle *handle;
+  PointerQueue contexts;
+
+  /* Posted by the waiting thread before the operation starts */
+  sem_t started;
+  /* Posted by the releasing thread after contexts are returned */
+  sem_t released;
+};
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_THREADS
+static void *releaseContexts(void *argument)
+{
+  struct ContextRelease * const release = argument;
+
+  sem_wait(&release->started);
+  restoreContextPool(release->handle, &release->contexts);
+  sem_post(&release->released);
+
+  return NULL;
+}
+#endif
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_THREADS
+START_TEST(testContextWaiting)
+{
+  struct TestContext context = makeTestHandle();
+
+  /*
+   * Second handle waits for free contexts, timeout covers scheduling delays
+   * of the releasing thread.
+   */
+  const struct Fat32Config fsConfig = {
+      .interface = context.interface,
+      .nodes = FS_NODE_POOL_SIZE,
+      .threads = 1,
+      .timeout = 500
+  };
+  struct FsHandle * const handle = init(FatHandle, &fsConfig);
+  ck_assert_ptr_nonnull(handle);
+
+  /* Operation fails after the timeout when contexts are not returned */
+  PointerQueue contexts = drainContextPool(handle);
+  struct FsNode *node = fsOpenNode(handle, PATH_HOME_USER);
+  ck_assert_ptr_null(node);
+
+  /* Operation continues after the context is returned by another thread */
+  struct ContextRelease release = {
+      .handle = handle,
+      .contexts = contexts
+  };
+  pthread_t thread;
+  int status;
+
+  status = sem_init(&release.started, 0, 0);
+  ck_assert_int_eq(status, 0);
+  status = sem_init(&release.released, 0, 0);
+  ck_assert_int_eq(status, 0);
+
+  status = pthread_create(&thread, NULL, releaseContexts, &release);
+  ck_assert_int_eq(status, 0);
+
+  sem_post(&release.started);
+  node = fsOpenNode(handle, PATH_HOME_USER);
+  ck_assert_ptr_nonnull(node);
+
+  /* Contexts are returned exactly once before the thread finishes */
+  status = sem_wait(&release.released);
+  ck_assert_int_eq(status, 0);
+  status = pthread_join(thread, NULL);
+  ck_assert_int_eq(status, 0);
+
+  sem_destroy(&release.released);
+  sem_destroy(&release.started);
+
+  /* Release all resources */
+  fsNodeFree(node);
+  deinit(handle);
+  freeTestHandle(context);
+}
+END_TEST
+#endif
+/*----------------------------------------------------------------------------*/
+START_TEST(testDirCompactionReserve)
+{
+  struct TestContext context = makeTestHandle();
+  struct FsNode * const node = fsOpenNode(context.handle, PATH_HOME_USER);
+  ck_assert_ptr_nonnull(node);
+
+  /* Other operations use all contexts except one */
+  PointerQueue contexts = drainContextPool(context.handle);
+  PointerQueue released;
+
+  const bool queued = pointerQueueInit(&released, 1);
+  ck_assert(queued);
+  ck_assert(!pointerQueueEmpty(&contexts));
+  pointerQueuePushBack(&released, pointerQueueFront(&contexts));
+  pointerQueuePopFront(&contexts);
+  restoreContextPool(context.handle, &released);
+
+  /* Second buffer of the compaction is taken from the reserved pool */
+  const enum Result res = fat32CompactDir(node);
+  ck_assert_uint_eq(res, E_OK);
+
+  /* Release all resources */
+  restoreContextPool(context.handle, &contexts);
+  fsNodeFree(node);
+  freeTestHandle(context);
+}
+END_TEST
 /*----------------------------------------------------------------------------*/
 START_TEST(testDirOpsFailure)
 {
@@ -153,6 +273,10 @@ int main(void)
   Suite * const suite = suite_create("ContextFailures");
   TCase * const testcase = tcase_create("Core");
 
+#ifdef CONFIG_THREADS
+  tcase_add_test(testcase, testContextWaiting);
+#endif
+  tcase_add_test(testcase, testDirCompactionReserve);
   tcase_add_test(testcase, testDirOpsFailure);
   tcase_add_test(testcase, testHandleSyncFailure);
   tcase_add_test(testcase, testNodeCreationFailure);
@@ -5,8 +5,11 @@
  */
 
 #include "default_fs.h"
+#include "helpers.h"
+#include <yaf/fat32.h>
 #include <xcore/fs/utils.h>
 #include <check.h>
+#include <stdalign.h>
 #include <stdlib.h>
 /*----------------------------------------------------------------------------*/
 START_TEST(testAuxStreams)
@@ -36,6 +39,93 @@ START_TEST(testAuxStreams)
 }
 END_TEST
 /*----------------------------------------------------------------------------*/
+START_TEST(testBatchRead)
+{
+  static const char *names[] = {
+      ".", "..", "TEMP1.TXT", "TEMP2.TXT", "TEMP3.TXT", "TEMP4.TXT"
+  };
+
+  struct TestContext context = makeTestHandle();
+  struct FsNode * const parent = fsOpenNode(context.handle, PATH_HOME_USER);
+  ck_assert_ptr_nonnull(parent);
+  struct FsNode *node;
+
+  alignas(struct Fat32DirRecord) uint8_t buffer[MAX_BUFFER_LENGTH];
+  size_t count;
+  size_t index;
+  enum Result res;
+
+  /* Read all entries at once */
+  node = fsNodeHead(parent);
+  ck_assert_ptr_nonnull(node);
+
+  res = fat32ReadDir(node, buffer, sizeof(buffer), &count);
+  ck_assert_uint_eq(res, E_OK);
+
+  index = 0;
+  for (size_t offset = 0; offset < count;)
+  {
+    const struct Fat32DirRecord * const record =
+        (const struct Fat32DirRecord *)(buffer + offset);
+
+    ck_assert_uint_lt(index, ARRAY_SIZE(names));
+    ck_assert_str_eq(record->name, names[index]);
+    ck_assert_uint_eq(record->access, FS_ACCESS_READ | FS_ACCESS_WRITE);
+    ck_assert_uint_ne(record->time, 0);
+
+    if (index < 2)
+      ck_assert_uint_ne(record->attributes & FAT32_ATTRIBUTE_DIR, 0);
+    else
+      ck_assert_uint_eq(record->attributes & FAT32_ATTRIBUTE_DIR, 0);
+
+    offset += record->length;
+    ++index;
+  }
+  ck_assert_uint_eq(index, ARRAY_SIZE(names));
+
+  /* End of the directory is reached */
+  res = fat32ReadDir(node, buffer, sizeof(buffer), &count);
+  ck_assert_uint_eq(res, E_ENTRY);
+  fsNodeFree(node);
+
+  /* Read entries one by one using a short buffer */
+  node = fsNodeHead(parent);
+  ck_assert_ptr_nonnull(node);
+
+  res = fat32ReadDir(node, buffer, sizeof(struct Fat32DirRecord), &count);
+  ck_assert_uint_eq(res, E_VALUE);
+
+  index = 0;
+  while ((res = fat32ReadDir(node, buffer, sizeof(struct Fat32DirRecord)
+      + sizeof(FsIdentifier) * 2, &count)) == E_OK)
+  {
+    const struct Fat32DirRecord * const record =
+        (const struct Fat32DirRecord *)buffer;
+
+    ck_assert_uint_eq(count, record->length);
+    ck_assert_str_eq(record->name, names[index]);
+    ++index;
+  }
+  ck_assert_uint_eq(res, E_ENTRY);
+  ck_assert_uint_eq(index, ARRAY_SIZE(names));
+  fsNodeFree(node);
+
+  /* Simulate context allocation error */
+  node = fsNodeHead(parent);
+  ck_assert_ptr_nonnull(node);
+
+  PointerQueue contexts = drainContextPool(context.handle);
+  res = fat32ReadDir(node, buffer, sizeof(buffer), &count);
+  ck_assert_uint_eq(res, E_MEMORY);
+  restoreContextPool(context.handle, &contexts);
+  fsNodeFree(node);
+
+  /* Release all resources */
+  fsNodeFree(parent);
+  freeTestHandle(context);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
 START_TEST(testIteration)
 {
   static const char path[] = PATH_HOME_USER "/NONE.TXT";
@@ -96,6 +186,7 @@ int main(void)
   TCase * const testcase = tcase_create("Core");
 
   tcase_add_test(testcase, testAuxStreams);
+  tcase_add_test(testcase, testBatchRead);
   tcase_add_test(testcase, testIteration);
   tcase_add_test(testcase, testLength);
   suite_add_tcase(suite, testcase);
@@ -8,10 +8,14 @@
 #include "helpers.h"
 #include "virtual_mem.h"
 #include <yaf/fat32.h>
+#include <yaf/fat32_defs.h>
+#include <yaf/utils.h>
 #include <xcore/fs/utils.h>
+#include <xcore/memory.h>
 #include <check.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 /*----------------------------------------------------------------------------*/
 static void freeFillingNode(struct FsHandle *, const char *, size_t);
 static void insertFillingNode(struct FsHandle *, const char *, size_t);
@@ -84,6 +88,92 @@ START_TEST(testAuxStreams)
 }
 END_TEST
 /*----------------------------------------------------------------------------*/
+START_TEST(testBatchCreation)
+{
+  static const char data[] = "0123456789";
+
+  struct TestContext context = makeTestHandle();
+  const size_t count = getMaxEntriesPerCluster(context.handle) + 3;
+
+  struct FsFieldDescriptor * const desc =
+      malloc(sizeof(struct FsFieldDescriptor) * 2 * (count + 1));
+  ck_assert_ptr_nonnull(desc);
+  struct Fat32NodeFields * const nodes =
+      malloc(sizeof(struct Fat32NodeFields) * (count + 2));
+  ck_assert_ptr_nonnull(nodes);
+  char (* const names)[16] = malloc(sizeof(*names) * (count + 1));
+  ck_assert_ptr_nonnull(names);
+
+  for (size_t i = 0; i <= count; ++i)
+  {
+    sprintf(names[i], "F_%05u.TXT", (unsigned int)i);
+
+    desc[i * 2] = (struct FsFieldDescriptor){
+        names[i],
+        strlen(names[i]) + 1,
+        FS_NODE_NAME
+    };
+    desc[i * 2 + 1] = (struct FsFieldDescriptor){
+        (i & 1) ? data : NULL,
+        (i & 1) ? sizeof(data) : 0,
+        FS_NODE_DATA
+    };
+    nodes[i] = (struct Fat32NodeFields){&desc[i * 2], 2};
+  }
+
+  struct FsNode * const parent = fsOpenNode(context.handle, PATH_SYS);
+  ck_assert_ptr_nonnull(parent);
+
+  size_t created;
+  enum Result res;
+
+  /* Create nodes in several groups with directory extension */
+  res = fat32CreateNodes(parent, nodes, count, &created);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(created, count);
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    char path[128];
+    sprintf(path, "%s/%s", PATH_SYS, names[i]);
+
+    struct FsNode * const node = fsOpenNode(context.handle, path);
+    ck_assert_ptr_nonnull(node);
+
+    if (i & 1)
+    {
+      char buffer[sizeof(data)];
+      size_t read;
+
+      res = fsNodeRead(node, FS_NODE_DATA, 0, buffer, sizeof(buffer), &read);
+      ck_assert_uint_eq(res, E_OK);
+      ck_assert_uint_eq(read, sizeof(data));
+      ck_assert_str_eq(buffer, data);
+    }
+
+    fsNodeFree(node);
+  }
+
+  /* Only nodes preceding the unnamed one are created */
+  nodes[count + 1] = (struct Fat32NodeFields){&desc[1], 1};
+  res = fat32CreateNodes(parent, &nodes[count + 1], 1, &created);
+  ck_assert_uint_eq(res, E_VALUE);
+  ck_assert_uint_eq(created, 0);
+  res = fat32CreateNodes(parent, &nodes[count], 2, &created);
+  ck_assert_uint_eq(res, E_VALUE);
+  ck_assert_uint_eq(created, 1);
+
+  /* Release all resources */
+  fsNodeFree(parent);
+  freeFillingNodes(context.handle, PATH_SYS, count + 1);
+  freeTestHandle(context);
+
+  free(names);
+  free(nodes);
+  free(desc);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
 START_TEST(testDirClusterAllocation)
 {
   struct TestContext context = makeTestHandle();
@@ -98,6 +188,118 @@ START_TEST(testDirClusterAllocation)
 }
 END_TEST
 /*----------------------------------------------------------------------------*/
+START_TEST(testDirCompaction)
+{
+  struct TestContext context = makeTestHandle();
+  const size_t count = getMaxEntriesPerCluster(context.handle) * 3 - 2;
+  const size_t last = count - 1;
+  enum Result res;
+
+  makeFillingNodes(context.handle, PATH_SYS, count);
+
+  char path[128];
+  sprintf(path, "%s/F_%05u.TXT", PATH_SYS, (unsigned int)last);
+
+  struct FsNode * const node = fsOpenNode(context.handle, path);
+  ck_assert_ptr_nonnull(node);
+
+  /* Only every eighth node remains in the directory */
+  for (size_t i = 0; i < last; ++i)
+  {
+    if (i % 8)
+      freeFillingNode(context.handle, PATH_SYS, i);
+  }
+
+  struct FsNode * const parent = fsOpenNode(context.handle, PATH_SYS);
+  ck_assert_ptr_nonnull(parent);
+
+  const FsCapacity used = fsFindUsedSpace(context.handle, NULL);
+
+  res = fat32CompactDir(parent);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_lt(fsFindUsedSpace(context.handle, NULL), used);
+
+  /* Compaction of the already compacted directory has no effect */
+  res = fat32CompactDir(parent);
+  ck_assert_uint_eq(res, E_OK);
+
+  /* Only directories can be compacted */
+  res = fat32CompactDir(node);
+  ck_assert_uint_eq(res, E_VALUE);
+
+  /* Opened node should be relocated together with the entry */
+  char name[16];
+
+  res = fsNodeRead(node, FS_NODE_NAME, 0, name, sizeof(name), NULL);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_str_eq(name, fsExtractName(path));
+
+  res = fsNodeRemove(parent, node);
+  ck_assert_uint_eq(res, E_OK);
+  fsNodeFree(node);
+  fsNodeFree(parent);
+
+  /* Remaining nodes should be accessible and new nodes should be placed */
+  for (size_t i = 0; i < last; i += 8)
+    freeFillingNode(context.handle, PATH_SYS, i);
+  makeFillingNodes(context.handle, PATH_SYS, count);
+
+  /* Release all resources */
+  freeFillingNodes(context.handle, PATH_SYS, count);
+  freeTestHandle(context);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
+START_TEST(testDirCompactionShift)
+{
+  struct TestContext context = makeTestHandle();
+  const size_t entriesPerCluster = getMaxEntriesPerCluster(context.handle);
+  const size_t count = entriesPerCluster * 2;
+  /* Entry of the node is located in the second cluster of the directory */
+  const size_t number = entriesPerCluster + 3;
+  const size_t removed = 3;
+  enum Result res;
+
+  makeFillingNodes(context.handle, PATH_SYS, count);
+
+  char path[128];
+  sprintf(path, "%s/F_%05u.TXT", PATH_SYS, (unsigned int)number);
+
+  struct FsNode * const node = fsOpenNode(context.handle, path);
+  ck_assert_ptr_nonnull(node);
+
+  /* Entries of each sector are split between two clusters */
+  for (size_t i = 0; i < removed; ++i)
+    freeFillingNode(context.handle, PATH_SYS, i);
+
+  struct FsNode * const parent = fsOpenNode(context.handle, PATH_SYS);
+  ck_assert_ptr_nonnull(parent);
+
+  res = fat32CompactDir(parent);
+  ck_assert_uint_eq(res, E_OK);
+
+  /* Opened node should be relocated to the following cluster */
+  char name[16];
+
+  res = fsNodeRead(node, FS_NODE_NAME, 0, name, sizeof(name), NULL);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_str_eq(name, fsExtractName(path));
+
+  res = fsNodeRemove(parent, node);
+  ck_assert_uint_eq(res, E_OK);
+  fsNodeFree(node);
+  fsNodeFree(parent);
+
+  /* Release all resources */
+  for (size_t i = removed; i < count; ++i)
+  {
+    if (i != number)
+      freeFillingNode(context.handle, PATH_SYS, i);
+  }
+  freeTestHandle(context);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
 START_TEST(testDirWrite)
 {
   static const char path[] = PATH_HOME_USER_TEMP1 "/FILE.JPG";
@@ -182,6 +384,63 @@ START_TEST(testGapFind)
 }
 END_TEST
 /*----------------------------------------------------------------------------*/
+START_TEST(testGapHint)
+{
+  struct TestContext context = makeTestHandle();
+  const size_t count = getMaxEntriesPerSector() * 2;
+
+  makeFillingNodes(context.handle, PATH_SYS, count);
+
+  struct FsNode * const parent = fsOpenNode(context.handle, PATH_SYS);
+  ck_assert_ptr_nonnull(parent);
+
+#ifndef CONFIG_UNICODE
+  /* Occupied entries at the beginning of the directory should be skipped */
+  vmemAddRegion(context.interface,
+      vmemExtractNodeDataRegion(context.interface, parent, 0));
+#endif
+  insertFillingNode(context.handle, PATH_SYS, count);
+  vmemClearRegions(context.interface);
+
+  /* Entry released without updating the hint should stay unused */
+  const struct VirtualMemRegion region =
+      vmemExtractNodeDataRegion(context.interface, parent, 0);
+  uint8_t * const sector = vmemGetAddress(context.interface) + region.begin;
+  uint8_t *entry = NULL;
+
+  for (size_t i = 0; i < getMaxEntriesPerSector(); ++i)
+  {
+    uint8_t * const current = sector + i * sizeof(struct DirEntryImage);
+
+    if (!memcmp(current, "F_00001 TXT", NAME_LENGTH))
+    {
+      entry = current;
+      break;
+    }
+  }
+  ck_assert_ptr_nonnull(entry);
+
+  entry[0] = 0xE5;
+  insertFillingNode(context.handle, PATH_SYS, count + 1);
+  ck_assert_uint_eq(entry[0], 0xE5);
+  entry[0] = 'F';
+
+  /* Freed entry at the beginning should be reused */
+  freeFillingNode(context.handle, PATH_SYS, 0);
+#ifndef CONFIG_UNICODE
+  vmemAddRegion(context.interface,
+      vmemExtractNodeDataRegion(context.interface, parent, 1));
+#endif
+  insertFillingNode(context.handle, PATH_SYS, 0);
+  vmemClearRegions(context.interface);
+
+  /* Release all resources */
+  fsNodeFree(parent);
+  freeFillingNodes(context.handle, PATH_SYS, count + 2);
+  freeTestHandle(context);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
 START_TEST(testNodeCreation)
 {
   static const char path[] = PATH_HOME_USER "/FILE.JPG";
@@ -327,6 +586,296 @@ START_TEST(testNodeCreation)
 }
 END_TEST
 /*----------------------------------------------------------------------------*/
+START_TEST(testNodeMove)
+{
+  static const char data[] = "0123456789";
+  static const char dirPath[] = PATH_SYS "/MOVE";
+  static const char filePath[] = PATH_SYS "/SOURCE.TXT";
+
+  struct TestContext context = makeTestHandle();
+  struct FsNode *destination;
+  struct FsNode *node;
+  struct FsNode *source;
+  enum Result res;
+
+  makeNode(context.handle, dirPath, true, false);
+  makeNode(context.handle, filePath, false, false);
+
+  /* Move the file with unsaved changes and a new name */
+  node = fsOpenNode(context.handle, filePath);
+  ck_assert_ptr_nonnull(node);
+
+  size_t count;
+
+  res = fsNodeWrite(node, FS_NODE_DATA, 0, data, sizeof(data), &count);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(count, sizeof(data));
+
+  source = fsOpenNode(context.handle, PATH_SYS);
+  ck_assert_ptr_nonnull(source);
+  destination = fsOpenNode(context.handle, dirPath);
+  ck_assert_ptr_nonnull(destination);
+
+  res = fat32MoveNode(source, node, node, "FILE.TXT");
+  ck_assert_uint_eq(res, E_VALUE);
+  res = fat32MoveNode(source, node, destination, "FILE.TXT");
+  ck_assert_uint_eq(res, E_OK);
+
+  char buffer[sizeof(data)];
+
+  res = fsNodeRead(node, FS_NODE_NAME, 0, buffer, sizeof(buffer), NULL);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_str_eq(buffer, "FILE.TXT");
+
+  fsNodeFree(destination);
+  fsNodeFree(source);
+  fsNodeFree(node);
+
+  node = fsOpenNode(context.handle, filePath);
+  ck_assert_ptr_null(node);
+  node = fsOpenNode(context.handle, PATH_SYS "/MOVE/FILE.TXT");
+  ck_assert_ptr_nonnull(node);
+
+  res = fsNodeRead(node, FS_NODE_DATA, 0, buffer, sizeof(buffer), &count);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(count, sizeof(data));
+  ck_assert_str_eq(buffer, data);
+  fsNodeFree(node);
+
+  /* Move the directory to another parent directory */
+  source = fsOpenNode(context.handle, PATH_SYS);
+  ck_assert_ptr_nonnull(source);
+  node = fsOpenNode(context.handle, dirPath);
+  ck_assert_ptr_nonnull(node);
+  destination = fsOpenNode(context.handle, PATH_LIB);
+  ck_assert_ptr_nonnull(destination);
+
+  res = fat32MoveNode(source, node, node, "MOVED");
+  ck_assert_uint_eq(res, E_VALUE);
+  res = fat32MoveNode(source, node, destination, "MOVED");
+  ck_assert_uint_eq(res, E_OK);
+
+  fsNodeFree(destination);
+  fsNodeFree(node);
+  fsNodeFree(source);
+
+  node = fsOpenNode(context.handle, PATH_LIB "/MOVED/FILE.TXT");
+  ck_assert_ptr_nonnull(node);
+  fsNodeFree(node);
+
+  /* Parent entry of the moved directory should be updated */
+  static const size_t arenaSize = 16384;
+  struct Fat32CheckReport report;
+
+  uint8_t * const arena = malloc(arenaSize);
+  ck_assert_ptr_nonnull(arena);
+
+  res = fat32Check(context.handle, arena, arenaSize, false, &report);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(report.lostChains, 0);
+  ck_assert_uint_eq(report.crossLinks, 0);
+
+  free(arena);
+
+  /* Release all resources */
+  freeNode(context.handle, PATH_LIB "/MOVED/FILE.TXT");
+  freeNode(context.handle, PATH_LIB "/MOVED");
+  freeTestHandle(context);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
+START_TEST(testNodeMoveConflicts)
+{
+  static const char dirPath[] = PATH_SYS "/MOVE";
+  static const char innerPath[] = PATH_SYS "/MOVE/INNER";
+  static const char filePath[] = PATH_SYS "/SOURCE.TXT";
+  static const char otherPath[] = PATH_SYS "/OTHER";
+
+  struct TestContext context = makeTestHandle();
+  struct FsNode *destination;
+  struct FsNode *node;
+  struct FsNode *source;
+  enum Result res;
+
+  makeNode(context.handle, dirPath, true, false);
+  makeNode(context.handle, innerPath, true, false);
+  makeNode(context.handle, PATH_SYS "/MOVE/FILE.TXT", false, false);
+  makeNode(context.handle, filePath, false, false);
+  makeNode(context.handle, otherPath, true, false);
+
+  source = fsOpenNode(context.handle, PATH_SYS);
+  ck_assert_ptr_nonnull(source);
+  destination = fsOpenNode(context.handle, dirPath);
+  ck_assert_ptr_nonnull(destination);
+  node = fsOpenNode(context.handle, filePath);
+  ck_assert_ptr_nonnull(node);
+
+  /* Source should be the parent directory of the node */
+  res = fat32MoveNode(destination, node, destination, "NEW.TXT");
+  ck_assert_uint_eq(res, E_VALUE);
+
+  /* Names of the nodes in the destination directory should be unique */
+  res = fat32MoveNode(source, node, destination, "FILE.TXT");
+  ck_assert_uint_eq(res, E_EXIST);
+  res = fat32MoveNode(source, node, source, "MOVE");
+  ck_assert_uint_eq(res, E_EXIST);
+
+#ifdef CONFIG_UNICODE
+  /* Names are compared without regard to the case of letters */
+  res = fat32MoveNode(source, node, destination, "file.txt");
+  ck_assert_uint_eq(res, E_EXIST);
+
+  /* Node can be renamed inside the same directory */
+  res = fat32MoveNode(source, node, source, "source.txt");
+  ck_assert_uint_eq(res, E_OK);
+#endif
+
+  fsNodeFree(node);
+  fsNodeFree(destination);
+
+#ifdef CONFIG_UNICODE
+  node = fsOpenNode(context.handle, PATH_SYS "/source.txt");
+#else
+  node = fsOpenNode(context.handle, filePath);
+#endif
+  ck_assert_ptr_nonnull(node);
+  fsNodeFree(node);
+  node = fsOpenNode(context.handle, PATH_SYS "/MOVE/FILE.TXT");
+  ck_assert_ptr_nonnull(node);
+  fsNodeFree(node);
+
+  /* Parent entry of the legacy directory points to the directory itself */
+  destination = fsOpenNode(context.handle, innerPath);
+  ck_assert_ptr_nonnull(destination);
+
+  const uint32_t cluster = ((struct FatNode *)destination)->payloadCluster;
+  const struct VirtualMemRegion region =
+      vmemExtractNodeDataRegion(context.interface, destination, 0);
+  struct DirEntryImage * const parent = (struct DirEntryImage *)
+      (vmemGetAddress(context.interface) + region.begin) + 1;
+
+  ck_assert(!memcmp(parent->name, "..         ", NAME_LENGTH));
+  parent->clusterHigh = toLittleEndian16((uint16_t)(cluster >> 16));
+  parent->clusterLow = toLittleEndian16((uint16_t)cluster);
+
+  node = fsOpenNode(context.handle, otherPath);
+  ck_assert_ptr_nonnull(node);
+
+  res = fat32MoveNode(source, node, destination, "OTHER");
+  ck_assert_uint_eq(res, E_OK);
+
+  fsNodeFree(node);
+  fsNodeFree(destination);
+  fsNodeFree(source);
+
+  /* Release all resources */
+  freeNode(context.handle, PATH_SYS "/MOVE/INNER/OTHER");
+  freeNode(context.handle, innerPath);
+  freeNode(context.handle, PATH_SYS "/MOVE/FILE.TXT");
+  freeNode(context.handle, dirPath);
+#ifdef CONFIG_UNICODE
+  freeNode(context.handle, PATH_SYS "/source.txt");
+#else
+  freeNode(context.handle, filePath);
+#endif
+  freeTestHandle(context);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
+START_TEST(testNodeMoveShared)
+{
+  static const char data[] = "0123456789";
+  static const char filePath[] = PATH_SYS "/SOURCE.TXT";
+  static const char movedPath[] = PATH_SYS "/FILE.TXT";
+  static const char newPath[] = PATH_SYS "/NEW.TXT";
+
+  struct TestContext context = makeTestHandle();
+  enum Result res;
+
+  makeNode(context.handle, filePath, false, false);
+
+  /* File is opened twice and unsaved changes are made through the copy */
+  struct FsNode * const node = fsOpenNode(context.handle, filePath);
+  ck_assert_ptr_nonnull(node);
+  struct FsNode * const copy = fsOpenNode(context.handle, filePath);
+  ck_assert_ptr_nonnull(copy);
+
+  size_t count;
+
+  res = fsNodeWrite(copy, FS_NODE_DATA, 0, data, sizeof(data), &count);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(count, sizeof(data));
+
+  /* Node is renamed, source and destination directories are the same */
+  struct FsNode * const parent = fsOpenNode(context.handle, PATH_SYS);
+  ck_assert_ptr_nonnull(parent);
+
+  res = fat32MoveNode(parent, node, parent, "FILE.TXT");
+  ck_assert_uint_eq(res, E_OK);
+
+  fsNodeFree(parent);
+
+  /* Released entries may be reused by the new node */
+  makeNode(context.handle, newPath, false, false);
+
+  res = fsNodeWrite(copy, FS_NODE_DATA, sizeof(data), data, sizeof(data),
+      &count);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(count, sizeof(data));
+
+  res = fsHandleSync(context.handle);
+  ck_assert_uint_eq(res, E_OK);
+
+  /* Copy of the moved file refers to the new entry */
+  char buffer[sizeof(data) * 2];
+
+  res = fsNodeRead(copy, FS_NODE_NAME, 0, buffer, sizeof(buffer), NULL);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_str_eq(buffer, "FILE.TXT");
+
+  fsNodeFree(copy);
+  fsNodeFree(node);
+
+  struct FsNode *other;
+  FsLength length;
+
+  other = fsOpenNode(context.handle, newPath);
+  ck_assert_ptr_nonnull(other);
+  res = fsNodeLength(other, FS_NODE_DATA, &length);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(length, 0);
+  fsNodeFree(other);
+
+  other = fsOpenNode(context.handle, movedPath);
+  ck_assert_ptr_nonnull(other);
+  res = fsNodeRead(other, FS_NODE_DATA, 0, buffer, sizeof(buffer), &count);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(count, sizeof(buffer));
+  ck_assert_str_eq(buffer, data);
+  ck_assert_str_eq(buffer + sizeof(data), data);
+  fsNodeFree(other);
+
+  /* Payload of the moved file should not be shared or lost */
+  static const size_t arenaSize = 16384;
+  struct Fat32CheckReport report;
+
+  uint8_t * const arena = malloc(arenaSize);
+  ck_assert_ptr_nonnull(arena);
+
+  res = fat32Check(context.handle, arena, arenaSize, false, &report);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(report.lostChains, 0);
+  ck_assert_uint_eq(report.crossLinks, 0);
+
+  free(arena);
+
+  /* Release all resources */
+  freeNode(context.handle, newPath);
+  freeNode(context.handle, movedPath);
+  freeTestHandle(context);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
 START_TEST(testReadOnlyDirWriting)
 {
   static const char path[] = PATH_HOME_USER "/FILE.JPG";
@@ -414,10 +963,17 @@ int main(void)
   TCase * const testcase = tcase_create("Core");
 
   tcase_add_test(testcase, testAuxStreams);
+  tcase_add_test(testcase, testBatchCreation);
   tcase_add_test(testcase, testDirClusterAllocation);
+  tcase_add_test(testcase, testDirCompaction);
+  tcase_add_test(testcase, testDirCompactionShift);
   tcase_add_test(testcase, testDirWrite);
   tcase_add_test(testcase, testGapFind);
+  tcase_add_test(testcase, testGapHint);
   tcase_add_test(testcase, testNodeCreation);
+  tcase_add_test(testcase, testNodeMove);
+  tcase_add_test(testcase, testNodeMoveConflicts);
+  tcase_add_test(testcase, testNodeMoveShared);
   tcase_add_test(testcase, testReadOnlyDirWriting);
   suite_add_tcase(suite, testcase);
 
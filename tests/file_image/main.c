@@ -0,0 +1,241 @@
+/*
+ * main.c
+ * Copyright (C) 2026 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#include "default_fs.h"
+#include "file_image.h"
+#include <xcore/fs/utils.h>
+#include <yaf/fat32.h>
+#include <yaf/utils.h>
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+/*----------------------------------------------------------------------------*/
+#define IMAGE_TEMPLATE "/tmp/yaf_image_XXXXXX"
+/*----------------------------------------------------------------------------*/
+static void makeImageFile(char *path, size_t size)
+{
+  strcpy(path, IMAGE_TEMPLATE);
+
+  const int descriptor = mkstemp(path);
+  ck_assert_int_ne(descriptor, -1);
+  ck_assert_int_eq(ftruncate(descriptor, (off_t)size), 0);
+  close(descriptor);
+}
+/*----------------------------------------------------------------------------*/
+static void checkPersistence(bool mapped)
+{
+  static const char data[] = "Persistent data";
+  char path[] = IMAGE_TEMPLATE;
+  enum Result res;
+
+  makeImageFile(path, FS_TOTAL_SIZE);
+
+  const struct FileImageConfig writableConfig = {
+      .path = path,
+      .mapped = mapped,
+      .readonly = false
+  };
+  struct Interface *image = init(FileImage, &writableConfig);
+  ck_assert_ptr_nonnull(image);
+  ck_assert((fileImageGetAddress(image) != NULL) == mapped);
+
+  static const struct Fat32FsConfig makeFsConfig =  {
+      .cluster = FS_CLUSTER_SIZE,
+      .tables = FS_TABLE_COUNT
+  };
+  res = fat32MakeFs(image, &makeFsConfig, NULL, 0);
+  ck_assert_uint_eq(res, E_OK);
+
+  const struct Fat32Config writableFsConfig = {
+      .interface = image,
+      .nodes = FS_NODE_POOL_SIZE,
+      .threads = FS_THREAD_POOL_SIZE
+  };
+  struct FsHandle *handle = init(FatHandle, &writableFsConfig);
+  ck_assert_ptr_nonnull(handle);
+
+#ifdef CONFIG_WRITE
+  struct FsNode * const root = fsHandleRoot(handle);
+  ck_assert_ptr_nonnull(root);
+
+  const struct FsFieldDescriptor desc[] = {
+      {
+          PATH_IMAGE + 1,
+          strlen(PATH_IMAGE + 1) + 1,
+          FS_NODE_NAME
+      }, {
+          data,
+          sizeof(data),
+          FS_NODE_DATA
+      }
+  };
+  res = fsNodeCreate(root, desc, ARRAY_SIZE(desc));
+  ck_assert_uint_eq(res, E_OK);
+  fsNodeFree(root);
+#endif
+
+  deinit(handle);
+  deinit(image);
+
+  /* Image is opened again in the other mode without write access */
+  const struct FileImageConfig readonlyConfig = {
+      .path = path,
+      .mapped = !mapped,
+      .readonly = true
+  };
+  image = init(FileImage, &readonlyConfig);
+  ck_assert_ptr_nonnull(image);
+
+  const struct Fat32Config readonlyFsConfig = {
+      .interface = image,
+      .nodes = FS_NODE_POOL_SIZE,
+      .threads = FS_THREAD_POOL_SIZE
+  };
+  handle = init(FatHandle, &readonlyFsConfig);
+  ck_assert_ptr_nonnull(handle);
+
+#ifdef CONFIG_WRITE
+  struct FsNode * const node = fsOpenNode(handle, PATH_IMAGE);
+  ck_assert_ptr_nonnull(node);
+
+  char buffer[sizeof(data)];
+  size_t count;
+
+  res = fsNodeRead(node, FS_NODE_DATA, 0, buffer, sizeof(buffer), &count);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(count, sizeof(data));
+  ck_assert_str_eq(buffer, data);
+  fsNodeFree(node);
+#endif
+
+  deinit(handle);
+  deinit(image);
+  unlink(path);
+}
+/*----------------------------------------------------------------------------*/
+START_TEST(testImageErrors)
+{
+  char path[] = IMAGE_TEMPLATE;
+  struct Interface *image;
+
+  /* Nonexistent image */
+  const struct FileImageConfig missingConfig = {
+      .path = "/nonexistent/image.img"
+  };
+  image = init(FileImage, &missingConfig);
+  ck_assert_ptr_null(image);
+
+  /* Empty image */
+  makeImageFile(path, 0);
+
+  const struct FileImageConfig emptyConfig = {
+      .path = path
+  };
+  image = init(FileImage, &emptyConfig);
+  ck_assert_ptr_null(image);
+
+  unlink(path);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
+START_TEST(testImageParams)
+{
+  char path[] = IMAGE_TEMPLATE;
+
+  makeImageFile(path, FS_TOTAL_SIZE);
+
+  const struct FileImageConfig config = {
+      .path = path,
+      .readonly = true
+  };
+  struct Interface * const image = init(FileImage, &config);
+  ck_assert_ptr_nonnull(image);
+
+  uint8_t buffer[MAX_BUFFER_LENGTH];
+  uint64_t value;
+  size_t count;
+  enum Result res;
+
+  /* Unsupported parameters */
+  res = ifGetParam(image, IF_ZEROCOPY, NULL);
+  ck_assert_uint_eq(res, E_INVALID);
+  res = ifSetParam(image, IF_ZEROCOPY, NULL);
+  ck_assert_uint_eq(res, E_INVALID);
+
+  /* Image size */
+  res = ifGetParam(image, IF_SIZE_64, &value);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(value, FS_TOTAL_SIZE);
+
+  /* Position outside of the image */
+  value = FS_TOTAL_SIZE;
+  res = ifSetParam(image, IF_POSITION_64, &value);
+  ck_assert_uint_eq(res, E_ADDRESS);
+
+  /* Read is truncated at the end of the image */
+  value = FS_TOTAL_SIZE - sizeof(buffer) / 2;
+  res = ifSetParam(image, IF_POSITION_64, &value);
+  ck_assert_uint_eq(res, E_OK);
+  count = ifRead(image, buffer, sizeof(buffer));
+  ck_assert_uint_eq(count, sizeof(buffer) / 2);
+  res = ifGetParam(image, IF_STATUS, NULL);
+  ck_assert_uint_eq(res, E_INTERFACE);
+
+  /* Write to the read-only image */
+  value = 0;
+  res = ifSetParam(image, IF_POSITION_64, &value);
+  ck_assert_uint_eq(res, E_OK);
+  count = ifWrite(image, buffer, sizeof(buffer));
+  ck_assert_uint_eq(count, 0);
+  res = ifGetParam(image, IF_STATUS, NULL);
+  ck_assert_uint_eq(res, E_ACCESS);
+
+  /* Successful read clears the status */
+  count = ifRead(image, buffer, sizeof(buffer));
+  ck_assert_uint_eq(count, sizeof(buffer));
+  res = ifGetParam(image, IF_STATUS, NULL);
+  ck_assert_uint_eq(res, E_OK);
+  res = ifGetParam(image, IF_POSITION_64, &value);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(value, sizeof(buffer));
+
+  deinit(image);
+  unlink(path);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
+START_TEST(testMappedPersistence)
+{
+  checkPersistence(true);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
+START_TEST(testUnmappedPersistence)
+{
+  checkPersistence(false);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
+int main(void)
+{
+  Suite * const suite = suite_create("FileImage");
+  TCase * const testcase = tcase_create("Core");
+
+  tcase_add_test(testcase, testImageErrors);
+  tcase_add_test(testcase, testImageParams);
+  tcase_add_test(testcase, testMappedPersistence);
+  tcase_add_test(testcase, testUnmappedPersistence);
+  suite_add_tcase(suite, testcase);
+
+  SRunner * const runner = srunner_create(suite);
+
+  srunner_run_all(runner, CK_NORMAL);
+  const int failed = srunner_ntests_failed(runner);
+  srunner_free(runner);
+
+  return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
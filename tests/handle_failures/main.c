@@ -27,6 +27,71 @@ void *malloc(size_t size)
   return allocate ? __libc_malloc(size) : NULL;
 }
 /*----------------------------------------------------------------------------*/
+START_TEST(testArenaErrors)
+{
+  static const struct VirtualMemConfig vmemConfig = {
+      .size = FS_TOTAL_SIZE
+  };
+  struct Interface * const vmem = init(VirtualMem, &vmemConfig);
+  ck_assert_ptr_nonnull(vmem);
+
+  static const struct Fat32FsConfig makeFsConfig =  {
+      .cluster = FS_CLUSTER_SIZE,
+      .tables = FS_TABLE_COUNT
+  };
+  const enum Result res = fat32MakeFs(vmem, &makeFsConfig, NULL, 0);
+  ck_assert_uint_eq(res, E_OK);
+
+  static const size_t arenaSize = FAT32_ARENA_SIZE(CONFIG_SECTOR_SIZE, 64,
+      FS_NODE_POOL_SIZE, FS_THREAD_POOL_SIZE);
+  uint8_t * const arena = __libc_malloc(arenaSize);
+  ck_assert_ptr_nonnull(arena);
+
+  struct Fat32Config fsConfig = {
+      .interface = vmem,
+      .nodes = FS_NODE_POOL_SIZE,
+      .threads = FS_THREAD_POOL_SIZE,
+      .arena = arena,
+      .size = arenaSize,
+      .alignment = 64
+  };
+  struct FsHandle *handle;
+
+  /* Only the handle object is allocated dynamically */
+  mallocHookFails = 2;
+  handle = init(FatHandle, &fsConfig);
+  mallocHookFails = 0;
+  ck_assert_ptr_nonnull(handle);
+
+  struct FsNode * const node = fsOpenNode(handle, "/");
+  ck_assert_ptr_nonnull(node);
+  ck_assert((uint8_t *)node >= arena);
+  ck_assert((uint8_t *)node < arena + arenaSize);
+  fsNodeFree(node);
+  deinit(handle);
+
+  /* Arena is too small for the node pool */
+  fsConfig.size = arenaSize - FAT32_NODE_SIZE * FS_NODE_POOL_SIZE;
+  handle = init(FatHandle, &fsConfig);
+  ck_assert_ptr_null(handle);
+
+  /* Arena is too small for the context pool */
+  fsConfig.size = 1;
+  handle = init(FatHandle, &fsConfig);
+  ck_assert_ptr_null(handle);
+
+  /* Alignment is not a power of two */
+  fsConfig.size = arenaSize;
+  fsConfig.alignment = 48;
+  handle = init(FatHandle, &fsConfig);
+  ck_assert_ptr_null(handle);
+
+  /* Release all resources */
+  free(arena);
+  deinit(vmem);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
 START_TEST(testClusterAllocationErrors)
 {
   struct TestContext context = makeTestHandle();
@@ -124,6 +189,15 @@ START_TEST(testMountErrors)
   ck_assert_ptr_null(handle);
   memcpy(&arena[0x00B], &value16, sizeof(value16));
 
+#ifdef CONFIG_CLUSTER_SIZE
+  /* Sectors per cluster differ from the fixed cluster size */
+  const uint8_t value8 = arena[0x00D];
+  arena[0x00D] = value8 < 128 ? value8 << 1 : value8 >> 1;
+  handle = init(FatHandle, &fsConfig);
+  ck_assert_ptr_null(handle);
+  arena[0x00D] = value8;
+#endif
+
   /* Incorrect boot signature */
   memcpy(&value16, &arena[0x1FE], sizeof(value16));
   memset(&arena[0x1FE], 0xFF, sizeof(value16));
@@ -157,11 +231,7 @@ START_TEST(testMountErrors)
   ck_assert_ptr_null(handle);
   vmemClearRegions(vmem);
 
-#ifdef CONFIG_WRITE
-  const unsigned int memoryFailureCount = 6;
-#else
-  const unsigned int memoryFailureCount = 5;
-#endif
+  const unsigned int memoryFailureCount = 3;
 
   for (unsigned int i = 2; i <= memoryFailureCount; ++i)
   {
@@ -207,6 +277,7 @@ int main(void)
   Suite * const suite = suite_create("HandleFailures");
   TCase * const testcase = tcase_create("Core");
 
+  tcase_add_test(testcase, testArenaErrors);
   tcase_add_test(testcase, testClusterAllocationErrors);
   tcase_add_test(testcase, testMountErrors);
   tcase_add_test(testcase, testSyncErrors);
@@ -5,6 +5,7 @@
  */
 
 #include "default_fs.h"
+#include <yaf/fat32.h>
 #include <xcore/fs/utils.h>
 #include <check.h>
 #include <stdlib.h>
@@ -39,12 +40,67 @@ START_TEST(testHandleSync)
 }
 END_TEST
 /*----------------------------------------------------------------------------*/
+START_TEST(testHandleSyncMultiple)
+{
+  static const char *paths[] = {
+      PATH_HOME_USER_TEMP1,
+      PATH_HOME_USER_TEMP2
+  };
+  static const char data[MAX_BUFFER_LENGTH] = {0};
+
+  struct TestContext context = makeTestHandle();
+  struct FsNode *nodes[ARRAY_SIZE(paths)];
+  enum Result res;
+
+  /* Several files are modified before the synchronization */
+  for (size_t i = 0; i < ARRAY_SIZE(paths); ++i)
+  {
+    nodes[i] = fsOpenNode(context.handle, paths[i]);
+    ck_assert_ptr_nonnull(nodes[i]);
+
+    res = fsNodeWrite(nodes[i], FS_NODE_DATA, 0, data, sizeof(data), NULL);
+    ck_assert_uint_eq(res, E_OK);
+  }
+
+  res = fsHandleSync(context.handle);
+  ck_assert_uint_eq(res, E_OK);
+
+  /* Entries of all files are updated while the nodes are still opened */
+  const struct Fat32Config fsConfig = {
+      .interface = context.interface,
+      .nodes = FS_NODE_POOL_SIZE
+  };
+  struct FsHandle * const handle = init(FatHandle, &fsConfig);
+  ck_assert_ptr_nonnull(handle);
+
+  for (size_t i = 0; i < ARRAY_SIZE(paths); ++i)
+  {
+    struct FsNode * const node = fsOpenNode(handle, paths[i]);
+    ck_assert_ptr_nonnull(node);
+
+    FsLength length;
+
+    res = fsNodeLength(node, FS_NODE_DATA, &length);
+    ck_assert_uint_eq(res, E_OK);
+    ck_assert_uint_eq(length, sizeof(data));
+    fsNodeFree(node);
+  }
+
+  /* Release all resources */
+  deinit(handle);
+  for (size_t i = 0; i < ARRAY_SIZE(paths); ++i)
+    fsNodeFree(nodes[i]);
+  freeTestHandle(context);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
 int main(void)
 {
   Suite * const suite = suite_create("HandleFuncs");
   TCase * const testcase = tcase_create("Core");
 
   tcase_add_test(testcase, testHandleSync);
+  tcase_add_test(testcase, testHandleSyncMultiple);
   suite_add_tcase(suite, testcase);
 
   SRunner * const runner = srunner_create(suite);
@@ -9,10 +9,27 @@
 #include "virtual_mem.h"
 #include <xcore/fs/utils.h>
 #include <yaf/fat32.h>
+#include <yaf/fat32_defs.h>
 #include <yaf/utils.h>
 #include <check.h>
 #include <stdlib.h>
 /*----------------------------------------------------------------------------*/
+struct TraceLog
+{
+  struct Fat32TraceEvent events[64];
+  size_t count;
+  size_t total;
+};
+/*----------------------------------------------------------------------------*/
+static void onTraceEvent(void *argument, const struct Fat32TraceEvent *event)
+{
+  struct TraceLog * const log = argument;
+
+  if (log->count < ARRAY_SIZE(log->events))
+    log->events[log->count++] = *event;
+  ++log->total;
+}
+/*----------------------------------------------------------------------------*/
 START_TEST(testCapacityReading)
 {
   struct TestContext context = makeTestHandle();
@@ -59,6 +76,212 @@ START_TEST(testClusterSizeReading)
   freeTestHandle(context);
 }
 /*----------------------------------------------------------------------------*/
+START_TEST(testConsistencyCheck)
+{
+  static const size_t arenaSize = 16384;
+
+  struct TestContext context = makeTestHandle();
+  const uint32_t cluster = getClusterCount(context.handle) - 2;
+  struct Fat32CheckReport report;
+  enum Result res;
+
+  uint8_t * const arena = malloc(arenaSize);
+  ck_assert_ptr_nonnull(arena);
+
+  /* Arena is too small for the bitmap */
+  res = fat32Check(context.handle, arena, CONFIG_SECTOR_SIZE * 2, false,
+      &report);
+  ck_assert_uint_eq(res, E_MEMORY);
+
+  /* Consistent volume */
+  res = fat32Check(context.handle, arena, arenaSize, false, &report);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(report.lostChains, 0);
+  ck_assert_uint_eq(report.crossLinks, 0);
+  ck_assert_uint_eq(report.invalidLinks, 0);
+  ck_assert_uint_eq(report.loopedChains, 0);
+  ck_assert_uint_eq(report.invalidEntries, 0);
+  ck_assert_uint_eq(report.freeClusters, report.infoFreeClusters);
+
+  const uint32_t freeClusters = report.freeClusters;
+
+  /* Lost chain without directory entries */
+  writeTableCell(context.handle, cluster, cluster + 1);
+  writeTableCell(context.handle, cluster + 1, 0x0FFFFFFFUL);
+
+  res = fat32Check(context.handle, arena, arenaSize, false, &report);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(report.lostChains, 1);
+  ck_assert_uint_eq(report.crossLinks, 0);
+  ck_assert_uint_eq(report.freeClusters, freeClusters - 2);
+  ck_assert_uint_eq(report.infoFreeClusters, freeClusters);
+
+  res = fat32Check(context.handle, arena, arenaSize, true, &report);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(report.lostChains, 1);
+  ck_assert_uint_eq(report.freeClusters, freeClusters);
+
+  res = fat32Check(context.handle, arena, arenaSize, false, &report);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(report.lostChains, 0);
+  ck_assert_uint_eq(report.freeClusters, freeClusters);
+  ck_assert_uint_eq(report.infoFreeClusters, freeClusters);
+
+  /* Looped chain without first cluster, loops are not released */
+  writeTableCell(context.handle, cluster, cluster + 1);
+  writeTableCell(context.handle, cluster + 1, cluster);
+
+  res = fat32Check(context.handle, arena, arenaSize, true, &report);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(report.lostChains, 0);
+  ck_assert_uint_eq(report.crossLinks, 0);
+  ck_assert_uint_eq(report.loopedChains, 1);
+  ck_assert_uint_eq(report.freeClusters, freeClusters - 2);
+
+  writeTableCell(context.handle, cluster + 1, 0);
+
+  /* Chain linked to the root directory, chains are left unchanged */
+  writeTableCell(context.handle, cluster, 2);
+
+  res = fat32Check(context.handle, arena, arenaSize, true, &report);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(report.crossLinks, 1);
+  ck_assert_uint_eq(report.freeClusters, freeClusters - 1);
+
+  /* Link outside of the volume */
+  writeTableCell(context.handle, cluster, cluster + 4);
+
+  res = fat32Check(context.handle, arena, arenaSize, false, &report);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(report.invalidLinks, 1);
+
+  writeTableCell(context.handle, cluster, 0);
+
+  /* First cluster of the file is not allocated */
+  struct FsNode * const node = fsOpenNode(context.handle, PATH_HOME_ROOT_ALIG);
+  ck_assert_ptr_nonnull(node);
+  writeTableCell(context.handle, ((struct FatNode *)node)->payloadCluster, 0);
+  fsNodeFree(node);
+
+  res = fat32Check(context.handle, arena, arenaSize, false, &report);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(report.invalidEntries, 1);
+  ck_assert_uint_eq(report.invalidLinks, 0);
+  ck_assert_uint_eq(report.crossLinks, 0);
+  /* Remaining clusters of the file form a lost chain */
+  ck_assert_uint_eq(report.lostChains, 1);
+
+  /* Release all resources */
+  free(arena);
+  freeTestHandle(context);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
+struct DefragProgress
+{
+  uint32_t calls;
+  uint32_t processed;
+  uint32_t total;
+};
+
+static void onDefragProgress(void *argument, uint32_t processed,
+    uint32_t total)
+{
+  struct DefragProgress * const progress = argument;
+
+  ck_assert_uint_ge(processed, progress->processed);
+  ck_assert_uint_le(processed, total);
+
+  ++progress->calls;
+  progress->processed = processed;
+  progress->total = total;
+}
+/*----------------------------------------------------------------------------*/
+START_TEST(testDefragmentation)
+{
+  static const char * const paths[] = {
+      PATH_HOME_ROOT "/FIRST.BIN",
+      PATH_HOME_ROOT "/SECOND.BIN"
+  };
+  static const size_t chunks = 4;
+
+  struct TestContext context = makeTestHandle();
+  struct FsNode *nodes[ARRAY_SIZE(paths)];
+  uint8_t buffer[FS_CLUSTER_SIZE];
+  enum Result res;
+
+  for (size_t i = 0; i < ARRAY_SIZE(paths); ++i)
+  {
+    makeNode(context.handle, paths[i], false, false);
+    nodes[i] = fsOpenNode(context.handle, paths[i]);
+    ck_assert_ptr_nonnull(nodes[i]);
+  }
+
+  /* Interleave clusters of both files */
+  for (size_t chunk = 0; chunk < chunks; ++chunk)
+  {
+    for (size_t i = 0; i < ARRAY_SIZE(paths); ++i)
+    {
+      size_t count;
+
+      memset(buffer, (int)(chunk * ARRAY_SIZE(paths) + i), sizeof(buffer));
+      res = fsNodeWrite(nodes[i], FS_NODE_DATA, chunk * sizeof(buffer),
+          buffer, sizeof(buffer), &count);
+      ck_assert_uint_eq(res, E_OK);
+      ck_assert_uint_eq(count, sizeof(buffer));
+    }
+  }
+
+  for (size_t i = 0; i < ARRAY_SIZE(paths); ++i)
+  {
+    ck_assert_uint_ne(countChainFragments(nodes[i]), 0);
+    fsNodeFree(nodes[i]);
+  }
+
+  const FsCapacity used = fsFindUsedSpace(context.handle, NULL);
+
+  /* Arena is too small */
+  res = fat32Defragment(context.handle, buffer, CONFIG_SECTOR_SIZE, NULL,
+      NULL);
+  ck_assert_uint_eq(res, E_MEMORY);
+
+  struct DefragProgress progress = {0, 0, 0};
+  uint8_t arena[CONFIG_SECTOR_SIZE * 4];
+
+  res = fat32Defragment(context.handle, arena, sizeof(arena),
+      onDefragProgress, &progress);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_ne(progress.calls, 0);
+  ck_assert_uint_eq(fsFindUsedSpace(context.handle, NULL), used);
+
+  /* Payload should be preserved in contiguous chains */
+  for (size_t i = 0; i < ARRAY_SIZE(paths); ++i)
+  {
+    struct FsNode * const node = fsOpenNode(context.handle, paths[i]);
+    ck_assert_ptr_nonnull(node);
+    ck_assert_uint_eq(countChainFragments(node), 0);
+
+    for (size_t chunk = 0; chunk < chunks; ++chunk)
+    {
+      size_t count;
+
+      res = fsNodeRead(node, FS_NODE_DATA, chunk * sizeof(buffer),
+          buffer, sizeof(buffer), &count);
+      ck_assert_uint_eq(res, E_OK);
+      ck_assert_uint_eq(count, sizeof(buffer));
+
+      for (size_t j = 0; j < sizeof(buffer); ++j)
+        ck_assert_uint_eq(buffer[j], chunk * ARRAY_SIZE(paths) + i);
+    }
+
+    fsNodeFree(node);
+    freeNode(context.handle, paths[i]);
+  }
+
+  freeTestHandle(context);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
 START_TEST(testEmptyVolumeUsage)
 {
   enum Result res;
@@ -185,6 +408,201 @@ START_TEST(testFullVolumeUsage)
 }
 END_TEST
 /*----------------------------------------------------------------------------*/
+START_TEST(testStatistics)
+{
+  struct TestContext context = makeTestHandle();
+  struct Fat32Statistics statistics;
+  enum Result res;
+
+#ifdef CONFIG_STATISTICS
+  res = fat32ResetStatistics(context.handle);
+  ck_assert_uint_eq(res, E_OK);
+  res = fat32GetStatistics(context.handle, &statistics);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(statistics.readBytes, 0);
+  ck_assert_uint_eq(statistics.sectorReads, 0);
+  ck_assert_uint_eq(statistics.bufferReads, 0);
+
+  /* Payload of the aligned file is read with multi-sector commands */
+  uint8_t * const buffer = malloc(ALIG_FILE_SIZE);
+  ck_assert_ptr_nonnull(buffer);
+  struct FsNode * const node = fsOpenNode(context.handle, PATH_HOME_ROOT_ALIG);
+  ck_assert_ptr_nonnull(node);
+  size_t count;
+
+  res = fsNodeRead(node, FS_NODE_DATA, 0, buffer, ALIG_FILE_SIZE, &count);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(count, ALIG_FILE_SIZE);
+  free(buffer);
+
+  res = fat32GetStatistics(context.handle, &statistics);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_gt(statistics.bufferReads, 0);
+  ck_assert_uint_gt(statistics.sectorReads, 0);
+  ck_assert_uint_gt(statistics.tableLookups, 0);
+  ck_assert_uint_ge(statistics.readBytes, ALIG_FILE_SIZE);
+  ck_assert_uint_eq(statistics.nodeExhaustions, 0);
+
+#  ifdef CONFIG_WRITE
+  /* Appended data requires a new cluster */
+  static const uint8_t data[FS_CLUSTER_SIZE] = {0};
+
+  res = fsNodeWrite(node, FS_NODE_DATA, ALIG_FILE_SIZE, data, sizeof(data),
+      &count);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(count, sizeof(data));
+
+  res = fat32GetStatistics(context.handle, &statistics);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(statistics.allocations, 1);
+  ck_assert_uint_ge(statistics.writtenBytes, sizeof(data));
+#  endif
+
+  fsNodeFree(node);
+
+  /* Failed allocation from the empty node pool */
+  PointerQueue nodes = drainNodePool(context.handle);
+  ck_assert_ptr_null(fsOpenNode(context.handle, PATH_HOME_ROOT_ALIG));
+  restoreNodePool(context.handle, &nodes);
+
+  res = fat32GetStatistics(context.handle, &statistics);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(statistics.nodeExhaustions, 1);
+
+  res = fat32ResetStatistics(context.handle);
+  ck_assert_uint_eq(res, E_OK);
+  res = fat32GetStatistics(context.handle, &statistics);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(statistics.readBytes, 0);
+  ck_assert_uint_eq(statistics.writtenBytes, 0);
+  ck_assert_uint_eq(statistics.nodeExhaustions, 0);
+
+  /* Table scan of the utility is counted, failed commands are not */
+  uint8_t arena[MAX_BUFFER_LENGTH * 4];
+  FsCapacity used;
+
+  res = fat32GetUsage(context.handle, arena, sizeof(arena), &used);
+  ck_assert_uint_eq(res, E_OK);
+  res = fat32GetStatistics(context.handle, &statistics);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_gt(statistics.bufferReads, 0);
+  ck_assert_uint_gt(statistics.readBytes, 0);
+
+  const uint64_t readBytes = statistics.readBytes;
+
+  vmemAddMarkedRegion(context.interface,
+      vmemExtractTableSectorRegion(context.interface, 0, 0),
+      false, true, true);
+  res = fat32GetUsage(context.handle, arena, sizeof(arena), &used);
+  ck_assert_uint_eq(res, E_INTERFACE);
+  vmemClearRegions(context.interface);
+
+  res = fat32GetStatistics(context.handle, &statistics);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(statistics.readBytes, readBytes);
+#else
+  res = fat32GetStatistics(context.handle, &statistics);
+  ck_assert_uint_eq(res, E_INVALID);
+  res = fat32ResetStatistics(context.handle);
+  ck_assert_uint_eq(res, E_INVALID);
+#endif
+
+  freeTestHandle(context);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
+START_TEST(testTrace)
+{
+  static const struct VirtualMemConfig vmemConfig = {
+      .size = FS_TOTAL_SIZE
+  };
+  struct Interface * const vmem = init(VirtualMem, &vmemConfig);
+  ck_assert_ptr_nonnull(vmem);
+
+  static const struct Fat32FsConfig makeFsConfig =  {
+      .cluster = FS_CLUSTER_SIZE,
+      .tables = FS_TABLE_COUNT
+  };
+  enum Result res = fat32MakeFs(vmem, &makeFsConfig, NULL, 0);
+  ck_assert_uint_eq(res, E_OK);
+
+  struct TraceLog log = {.count = 0, .total = 0};
+  const struct Fat32Config fsConfig = {
+      .interface = vmem,
+      .nodes = FS_NODE_POOL_SIZE,
+      .threads = FS_THREAD_POOL_SIZE,
+      .trace = onTraceEvent,
+      .traceArgument = &log
+  };
+  struct FsHandle *handle;
+
+  /* Failed mount reports the result of the command */
+  vmemAddRegion(vmem, vmemExtractBootRegion());
+  handle = init(FatHandle, &fsConfig);
+  ck_assert_ptr_null(handle);
+  vmemClearRegions(vmem);
+
+#ifdef CONFIG_TRACE
+  ck_assert_uint_eq(log.count, 2);
+  ck_assert_uint_eq(log.events[0].command, FAT32_TRACE_READ);
+  ck_assert_uint_eq(log.events[0].origin, FAT32_ORIGIN_MOUNT);
+  ck_assert_uint_eq(log.events[0].sector, 0);
+  ck_assert_uint_eq(log.events[0].count, 1);
+  ck_assert(!log.events[0].completed);
+  ck_assert(log.events[1].completed);
+  ck_assert_uint_ne(log.events[1].result, E_OK);
+#else
+  ck_assert_uint_eq(log.total, 0);
+#endif
+
+  log.count = 0;
+  log.total = 0;
+
+  handle = init(FatHandle, &fsConfig);
+  ck_assert_ptr_nonnull(handle);
+
+#ifdef CONFIG_TRACE
+  /* Events are paired, mount reads boot and information sectors */
+  ck_assert_uint_eq(log.total % 2, 0);
+  ck_assert_uint_ge(log.count, 4);
+
+  for (size_t i = 0; i < log.count; i += 2)
+  {
+    ck_assert_uint_eq(log.events[i].origin, FAT32_ORIGIN_MOUNT);
+    ck_assert_uint_eq(log.events[i].command, FAT32_TRACE_READ);
+    ck_assert(!log.events[i].completed);
+    ck_assert(log.events[i + 1].completed);
+    ck_assert_uint_eq(log.events[i + 1].sector, log.events[i].sector);
+    ck_assert_uint_eq(log.events[i + 1].result, E_OK);
+  }
+#else
+  ck_assert_uint_eq(log.total, 0);
+#endif
+
+  /* Commands of the directory scan are attributed to the listing */
+  log.count = 0;
+  log.total = 0;
+
+  struct FsNode * const root = fsHandleRoot(handle);
+  ck_assert_ptr_nonnull(root);
+  struct FsNode * const node = fsNodeHead(root);
+  ck_assert_ptr_null(node);
+  fsNodeFree(root);
+
+#ifdef CONFIG_TRACE
+  ck_assert_uint_gt(log.count, 0);
+
+  for (size_t i = 0; i < log.count; ++i)
+    ck_assert_uint_eq(log.events[i].origin, FAT32_ORIGIN_LIST);
+#else
+  ck_assert_uint_eq(log.total, 0);
+#endif
+
+  deinit(handle);
+  deinit(vmem);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
 START_TEST(testUsedSpaceCalculation)
 {
   static const FsCapacity totalSpaceUsed =
@@ -214,8 +632,12 @@ int main(void)
 
   tcase_add_test(testcase, testCapacityReading);
   tcase_add_test(testcase, testClusterSizeReading);
+  tcase_add_test(testcase, testConsistencyCheck);
+  tcase_add_test(testcase, testDefragmentation);
   tcase_add_test(testcase, testEmptyVolumeUsage);
   tcase_add_test(testcase, testFullVolumeUsage);
+  tcase_add_test(testcase, testStatistics);
+  tcase_add_test(testcase, testTrace);
   tcase_add_test(testcase, testUsedSpaceCalculation);
   suite_add_tcase(suite, testcase);
 
@@ -6,9 +6,86 @@
 
 #include "default_fs.h"
 #include "virtual_mem.h"
+#include <yaf/fat32.h>
 #include <yaf/utils.h>
 #include <check.h>
 #include <stdlib.h>
+#include <string.h>
+/*----------------------------------------------------------------------------*/
+/* Boot sector and information sector images are 512 bytes long */
+#define BOOT_IMAGE_SIZE 1024
+/*----------------------------------------------------------------------------*/
+START_TEST(testAlignedFormat)
+{
+  static const size_t alignment = 64 * 1024;
+  static const struct Fat32FsConfig makeFsConfig =  {
+      .cluster = FS_CLUSTER_SIZE,
+      .reserved = 16,
+      .alignment = alignment,
+      .tables = FS_TABLE_COUNT,
+      .label = "TEST"
+  };
+  static const struct Fat32FsConfig makeFsConfigUnaligned =  {
+      .cluster = FS_CLUSTER_SIZE,
+      .alignment = CONFIG_SECTOR_SIZE + 1,
+      .tables = FS_TABLE_COUNT
+  };
+  static const struct Fat32FsConfig makeFsConfigOversized =  {
+      .cluster = FS_CLUSTER_SIZE,
+      .alignment = FS_TOTAL_SIZE,
+      .tables = FS_TABLE_COUNT
+  };
+  static const struct VirtualMemConfig vmemConfigDefault = {
+      .size = FS_TOTAL_SIZE
+  };
+
+  struct Interface *vmem;
+  enum Result res;
+
+  vmem = init(VirtualMem, &vmemConfigDefault);
+  ck_assert_ptr_nonnull(vmem);
+
+  /* Allocation unit is not a multiple of the sector size */
+  res = fat32MakeFs(vmem, &makeFsConfigUnaligned, NULL, 0);
+  ck_assert_uint_eq(res, E_VALUE);
+
+  /* Aligned tables do not fit into the partition */
+  res = fat32MakeFs(vmem, &makeFsConfigOversized, NULL, 0);
+  ck_assert_uint_eq(res, E_VALUE);
+
+  res = fat32MakeFs(vmem, &makeFsConfig, NULL, 0);
+  ck_assert_uint_eq(res, E_OK);
+
+  /* Tables and the data region start on allocation unit boundaries */
+  for (size_t i = 0; i < FS_TABLE_COUNT; ++i)
+  {
+    const struct VirtualMemRegion table = vmemExtractTableRegion(vmem, i);
+    ck_assert_uint_eq(table.begin % alignment, 0);
+    ck_assert_uint_eq((table.end + 1) % alignment, 0);
+  }
+
+  const struct VirtualMemRegion root = vmemExtractRootDataRegion(vmem);
+  ck_assert_uint_eq(root.begin % alignment, 0);
+
+  /* Formatted partition is mountable and usable */
+  const struct Fat32Config fsConfig = {
+      .interface = vmem,
+      .nodes = FS_NODE_POOL_SIZE,
+      .threads = FS_THREAD_POOL_SIZE
+  };
+  struct FsHandle * const handle = init(FatHandle, &fsConfig);
+  ck_assert_ptr_nonnull(handle);
+
+#ifdef CONFIG_WRITE
+  const FsCapacity capacity = fat32GetCapacity(handle);
+  ck_assert_uint_gt(capacity, 0);
+  ck_assert_uint_lt(capacity, FS_TOTAL_SIZE);
+#endif
+
+  deinit(handle);
+  deinit(vmem);
+}
+END_TEST
 /*----------------------------------------------------------------------------*/
 START_TEST(testArenaFormat)
 {
@@ -42,6 +119,107 @@ START_TEST(testArenaFormat)
   deinit(vmem);
 }
 /*----------------------------------------------------------------------------*/
+START_TEST(testErasedFormat)
+{
+  static const struct Fat32FsConfig makeFsConfig =  {
+      .cluster = FS_CLUSTER_SIZE,
+      .tables = FS_TABLE_COUNT,
+      .label = "TEST"
+  };
+  static const struct Fat32FsConfig makeFsConfigErased =  {
+      .cluster = FS_CLUSTER_SIZE,
+      .tables = FS_TABLE_COUNT,
+      .label = "TEST",
+      .erased = true
+  };
+  static const struct VirtualMemConfig vmemConfigDefault = {
+      .size = FS_TOTAL_SIZE
+  };
+
+  struct VirtualMemStats stats;
+  struct Interface *vref;
+  struct Interface *vmem;
+  enum Result res;
+
+  /* Make reference partition */
+  vref = init(VirtualMem, &vmemConfigDefault);
+  ck_assert_ptr_nonnull(vref);
+  res = fat32MakeFs(vref, &makeFsConfig, NULL, 0);
+  ck_assert_uint_eq(res, E_OK);
+
+  /* Only boot, info and the first sectors of each region are written */
+  vmem = init(VirtualMem, &vmemConfigDefault);
+  ck_assert_ptr_nonnull(vmem);
+  res = fat32MakeFs(vmem, &makeFsConfigErased, NULL, 0);
+  ck_assert_uint_eq(res, E_OK);
+
+  vmemGetStats(vmem, &stats);
+  ck_assert_uint_eq(stats.writes, FS_TABLE_COUNT + 3);
+  ck_assert_uint_eq(stats.writtenBytes,
+      BOOT_IMAGE_SIZE + (FS_TABLE_COUNT + 1) * CONFIG_SECTOR_SIZE);
+  ck_assert_mem_eq(vmemGetAddress(vmem), vmemGetAddress(vref), FS_TOTAL_SIZE);
+
+  /* Formatted partition is mountable */
+  const struct Fat32Config fsConfig = {
+      .interface = vmem,
+      .nodes = FS_NODE_POOL_SIZE,
+      .threads = FS_THREAD_POOL_SIZE
+  };
+  struct FsHandle * const handle = init(FatHandle, &fsConfig);
+  ck_assert_ptr_nonnull(handle);
+  deinit(handle);
+
+  deinit(vmem);
+  deinit(vref);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
+START_TEST(testLargeArena)
+{
+  static const struct Fat32FsConfig makeFsConfig =  {
+      .cluster = FS_CLUSTER_SIZE,
+      .tables = FS_TABLE_COUNT,
+      .label = "TEST"
+  };
+  static const struct VirtualMemConfig vmemConfigDefault = {
+      .size = FS_TOTAL_SIZE
+  };
+
+  /* Arena is larger than the allocation table */
+  static uint8_t arena[FS_TOTAL_SIZE / 16];
+  struct VirtualMemStats stats;
+  struct Interface *vref;
+  struct Interface *vmem;
+  enum Result res;
+
+  /* Make reference partition */
+  vref = init(VirtualMem, &vmemConfigDefault);
+  ck_assert_ptr_nonnull(vref);
+  res = fat32MakeFs(vref, &makeFsConfig, NULL, 0);
+  ck_assert_uint_eq(res, E_OK);
+
+  const struct VirtualMemRegion table = vmemExtractTableRegion(vref, 0);
+  const uint64_t tableSize = table.end + 1 - table.begin;
+  ck_assert_uint_lt(tableSize, sizeof(arena));
+
+  /* Each region is written with a single command without overruns */
+  vmem = init(VirtualMem, &vmemConfigDefault);
+  ck_assert_ptr_nonnull(vmem);
+  memset(arena, 0xAA, sizeof(arena));
+  res = fat32MakeFs(vmem, &makeFsConfig, arena, sizeof(arena));
+  ck_assert_uint_eq(res, E_OK);
+
+  vmemGetStats(vmem, &stats);
+  ck_assert_uint_eq(stats.writes, FS_TABLE_COUNT + 3);
+  ck_assert_uint_eq(stats.writtenBytes, BOOT_IMAGE_SIZE
+      + FS_TABLE_COUNT * tableSize + FS_CLUSTER_SIZE);
+  ck_assert_mem_eq(vmemGetAddress(vmem), vmemGetAddress(vref), FS_TOTAL_SIZE);
+
+  deinit(vmem);
+  deinit(vref);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
 START_TEST(testMemoryErrors)
 {
   static const struct Fat32FsConfig makeFsConfig =  {
@@ -142,7 +320,10 @@ int main(void)
   Suite * const suite = suite_create("MakeFs");
   TCase * const testcase = tcase_create("Core");
 
+  tcase_add_test(testcase, testAlignedFormat);
   tcase_add_test(testcase, testArenaFormat);
+  tcase_add_test(testcase, testErasedFormat);
+  tcase_add_test(testcase, testLargeArena);
   tcase_add_test(testcase, testMemoryErrors);
   suite_add_tcase(suite, testcase);
 
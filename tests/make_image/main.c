@@ -0,0 +1,484 @@
+/*
+ * main.c
+ * Copyright (C) 2026 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#include "default_fs.h"
+#include "file_image.h"
+#include <xcore/fs/utils.h>
+#include <xcore/memory.h>
+#include <yaf/fat32.h>
+#include <yaf/fat32_defs.h>
+#include <yaf/utils.h>
+#include <check.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+/*----------------------------------------------------------------------------*/
+#define IMAGE_TEMPLATE    "/tmp/yaf_image_XXXXXX"
+#define TREE_TEMPLATE     "/tmp/yaf_tree_XXXXXX"
+
+#define ALIGNMENT_SIZE    (64 * 1024)
+#define CHECK_ARENA_SIZE  (64 * 1024)
+#define IMAGE_SIZE        "32M"
+#define PATH_LENGTH       1024
+#define SIMILAR_COUNT     120
+
+#define NAME_LONG \
+    "File with a rather long name, several spaces and.multiple.dots.txt"
+#define NAME_UNICODE      "Größe und Länge.txt"
+#define PATH_SIMILAR      "Similar names"
+/*----------------------------------------------------------------------------*/
+struct NameList
+{
+  char **names;
+  size_t count;
+};
+/*----------------------------------------------------------------------------*/
+static void appendName(struct NameList *, const char *);
+static void checkImage(const char *, const char *, size_t);
+static void compareDir(struct FsHandle *, const char *, const char *);
+static void compareFile(struct FsHandle *, const char *, const char *);
+static int compareNames(const void *, const void *);
+static void fillPattern(uint8_t *, size_t, unsigned int);
+static void freeNameList(struct NameList *);
+static void listHostDir(const char *, struct NameList *);
+static void listImageDir(struct FsHandle *, const char *, struct NameList *);
+static void makeFixtureDir(const char *, const char *);
+static void makeFixtureFile(const char *, const char *, size_t, unsigned int);
+static void makeFixtureTree(char *);
+static void makeImagePath(char *);
+static void removeTree(const char *);
+static int runTool(const char *, const char *, const char *);
+/*----------------------------------------------------------------------------*/
+static void appendName(struct NameList *list, const char *name)
+{
+  char ** const names = realloc(list->names,
+      (list->count + 1) * sizeof(char *));
+  ck_assert_ptr_nonnull(names);
+
+  list->names = names;
+  list->names[list->count] = strdup(name);
+  ck_assert_ptr_nonnull(list->names[list->count]);
+  ++list->count;
+}
+/*----------------------------------------------------------------------------*/
+/* Mount the image, check its consistency and compare it with the source */
+static void checkImage(const char *source, const char *path, size_t alignment)
+{
+  const struct FileImageConfig imageConfig = {
+      .path = path,
+      .mapped = false,
+      .readonly = false
+  };
+  struct Interface * const image = init(FileImage, &imageConfig);
+  ck_assert_ptr_nonnull(image);
+
+  if (alignment)
+  {
+    static const uint64_t bootPosition = 0;
+    struct BootSectorImage boot;
+    enum Result res;
+
+    res = ifSetParam(image, IF_POSITION_64, &bootPosition);
+    ck_assert_uint_eq(res, E_OK);
+    ck_assert_uint_eq(ifRead(image, &boot, sizeof(boot)), sizeof(boot));
+
+    const uint64_t tableSector = fromLittleEndian16(boot.reservedSectors);
+    const uint64_t dataSector = tableSector
+        + (uint64_t)fromLittleEndian32(boot.sectorsPerTable) * boot.tableCount;
+
+    /* Tables and the data region start on allocation unit boundaries */
+    ck_assert_uint_eq((tableSector << SECTOR_EXP) % alignment, 0);
+    ck_assert_uint_eq((dataSector << SECTOR_EXP) % alignment, 0);
+  }
+
+  const struct Fat32Config fsConfig = {
+      .interface = image,
+      .nodes = FS_NODE_POOL_SIZE,
+      .threads = FS_THREAD_POOL_SIZE
+  };
+  struct FsHandle * const handle = init(FatHandle, &fsConfig);
+  ck_assert_ptr_nonnull(handle);
+
+  /* Tables, directory entries and the information sector are consistent */
+  struct Fat32CheckReport report;
+  uint8_t * const arena = malloc(CHECK_ARENA_SIZE);
+  ck_assert_ptr_nonnull(arena);
+
+  const enum Result res = fat32Check(handle, arena, CHECK_ARENA_SIZE, false,
+      &report);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(report.lostChains, 0);
+  ck_assert_uint_eq(report.crossLinks, 0);
+  ck_assert_uint_eq(report.invalidLinks, 0);
+  ck_assert_uint_eq(report.loopedChains, 0);
+  ck_assert_uint_eq(report.invalidEntries, 0);
+  ck_assert_uint_eq(report.freeClusters, report.infoFreeClusters);
+  free(arena);
+
+  compareDir(handle, source, "/");
+
+  deinit(handle);
+  deinit(image);
+}
+/*----------------------------------------------------------------------------*/
+static void compareDir(struct FsHandle *handle, const char *hostPath,
+    const char *imagePath)
+{
+  struct NameList hostNames = {NULL, 0};
+  struct NameList imageNames = {NULL, 0};
+
+  listHostDir(hostPath, &hostNames);
+  listImageDir(handle, imagePath, &imageNames);
+  ck_assert_uint_eq(imageNames.count, hostNames.count);
+
+  for (size_t i = 0; i < hostNames.count; ++i)
+  {
+    char hostChild[PATH_LENGTH];
+    char imageChild[PATH_LENGTH];
+    struct stat info;
+
+    ck_assert_str_eq(imageNames.names[i], hostNames.names[i]);
+
+    sprintf(hostChild, "%s/%s", hostPath, hostNames.names[i]);
+    if (!strcmp(imagePath, "/"))
+      sprintf(imageChild, "/%s", hostNames.names[i]);
+    else
+      sprintf(imageChild, "%s/%s", imagePath, hostNames.names[i]);
+
+    ck_assert_int_eq(stat(hostChild, &info), 0);
+
+    if (S_ISDIR(info.st_mode))
+      compareDir(handle, hostChild, imageChild);
+    else
+      compareFile(handle, hostChild, imageChild);
+  }
+
+  freeNameList(&imageNames);
+  freeNameList(&hostNames);
+}
+/*----------------------------------------------------------------------------*/
+static void compareFile(struct FsHandle *handle, const char *hostPath,
+    const char *imagePath)
+{
+  FILE * const file = fopen(hostPath, "rb");
+  ck_assert_ptr_nonnull(file);
+
+  ck_assert_int_eq(fseek(file, 0, SEEK_END), 0);
+  const long hostLength = ftell(file);
+  ck_assert_int_ne(hostLength, -1);
+  rewind(file);
+
+  uint8_t * const expected = malloc((size_t)hostLength + 1);
+  uint8_t * const buffer = malloc((size_t)hostLength + 1);
+  ck_assert_ptr_nonnull(expected);
+  ck_assert_ptr_nonnull(buffer);
+  ck_assert_uint_eq(fread(expected, 1, (size_t)hostLength, file), hostLength);
+  fclose(file);
+
+  struct FsNode * const node = fsOpenNode(handle, imagePath);
+  ck_assert_ptr_nonnull(node);
+
+  FsLength length;
+  enum Result res;
+
+  res = fsNodeLength(node, FS_NODE_DATA, &length);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(length, hostLength);
+
+  if (length)
+  {
+    size_t count;
+
+    res = fsNodeRead(node, FS_NODE_DATA, 0, buffer, (size_t)length, &count);
+    ck_assert_uint_eq(res, E_OK);
+    ck_assert_uint_eq(count, length);
+    ck_assert_mem_eq(buffer, expected, (size_t)length);
+  }
+
+  fsNodeFree(node);
+  free(buffer);
+  free(expected);
+}
+/*----------------------------------------------------------------------------*/
+static int compareNames(const void *a, const void *b)
+{
+  return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+/*----------------------------------------------------------------------------*/
+static void fillPattern(uint8_t *buffer, size_t length, unsigned int seed)
+{
+  for (size_t i = 0; i < length; ++i)
+    buffer[i] = (uint8_t)(seed * 31 + i);
+}
+/*----------------------------------------------------------------------------*/
+static void freeNameList(struct NameList *list)
+{
+  for (size_t i = 0; i < list->count; ++i)
+    free(list->names[i]);
+  free(list->names);
+}
+/*----------------------------------------------------------------------------*/
+static void listHostDir(const char *path, struct NameList *list)
+{
+  DIR * const directory = opendir(path);
+  ck_assert_ptr_nonnull(directory);
+
+  const struct dirent *entry;
+
+  while ((entry = readdir(directory)) != NULL)
+  {
+    if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+      appendName(list, entry->d_name);
+  }
+  closedir(directory);
+
+  qsort(list->names, list->count, sizeof(char *), compareNames);
+}
+/*----------------------------------------------------------------------------*/
+static void listImageDir(struct FsHandle *handle, const char *path,
+    struct NameList *list)
+{
+  struct FsNode * const parent = fsOpenNode(handle, path);
+  ck_assert_ptr_nonnull(parent);
+
+  struct FsNode * const node = fsNodeHead(parent);
+
+  if (node != NULL)
+  {
+    enum Result res;
+
+    do
+    {
+      char name[FS_NAME_LENGTH];
+
+      res = fsNodeRead(node, FS_NODE_NAME, 0, name, sizeof(name), NULL);
+      ck_assert_uint_eq(res, E_OK);
+
+      if (strcmp(name, ".") && strcmp(name, ".."))
+        appendName(list, name);
+    }
+    while ((res = fsNodeNext(node)) == E_OK);
+
+    ck_assert(res == E_ENTRY || res == E_EMPTY);
+    fsNodeFree(node);
+  }
+
+  fsNodeFree(parent);
+
+  qsort(list->names, list->count, sizeof(char *), compareNames);
+}
+/*----------------------------------------------------------------------------*/
+static void makeFixtureDir(const char *root, const char *path)
+{
+  char buffer[PATH_LENGTH];
+
+  sprintf(buffer, "%s/%s", root, path);
+  ck_assert_int_eq(mkdir(buffer, 0755), 0);
+}
+/*----------------------------------------------------------------------------*/
+static void makeFixtureFile(const char *root, const char *path, size_t length,
+    unsigned int seed)
+{
+  char buffer[PATH_LENGTH];
+
+  sprintf(buffer, "%s/%s", root, path);
+
+  FILE * const file = fopen(buffer, "wb");
+  ck_assert_ptr_nonnull(file);
+
+  if (length)
+  {
+    uint8_t * const data = malloc(length);
+    ck_assert_ptr_nonnull(data);
+
+    fillPattern(data, length, seed);
+    ck_assert_uint_eq(fwrite(data, 1, length, file), length);
+    free(data);
+  }
+
+  ck_assert_int_eq(fclose(file), 0);
+}
+/*----------------------------------------------------------------------------*/
+static void makeFixtureTree(char *root)
+{
+  strcpy(root, TREE_TEMPLATE);
+  ck_assert_ptr_nonnull(mkdtemp(root));
+
+  /* Short names, long names and names with non-ASCII characters */
+  makeFixtureFile(root, "README.TXT", 17, 1);
+  makeFixtureFile(root, NAME_LONG, FS_CLUSTER_SIZE * 3 + 5, 2);
+  makeFixtureFile(root, NAME_UNICODE, FS_CLUSTER_SIZE, 3);
+
+  /* Empty files do not occupy clusters */
+  makeFixtureFile(root, "EMPTY.TXT", 0, 0);
+  makeFixtureFile(root, "Empty file with a long name", 0, 0);
+
+  /* Empty directories still occupy one cluster */
+  makeFixtureDir(root, "EMPTYDIR");
+  makeFixtureDir(root, "Empty directory");
+
+  makeFixtureDir(root, "Nested");
+  makeFixtureDir(root, "Nested/Deeper level");
+  makeFixtureFile(root, "Nested/Deeper level/data.bin", FS_CLUSTER_SIZE * 2,
+      4);
+
+  /* Numeric tails of the aliases exceed the limit of the library */
+  makeFixtureDir(root, PATH_SIMILAR);
+
+  for (unsigned int i = 0; i < SIMILAR_COUNT; ++i)
+  {
+    char name[64];
+
+    sprintf(name, PATH_SIMILAR "/Similar file name %03u.txt", i);
+    makeFixtureFile(root, name, i, i);
+  }
+}
+/*----------------------------------------------------------------------------*/
+static void makeImagePath(char *path)
+{
+  strcpy(path, IMAGE_TEMPLATE);
+
+  const int descriptor = mkstemp(path);
+  ck_assert_int_ne(descriptor, -1);
+  close(descriptor);
+}
+/*----------------------------------------------------------------------------*/
+static void removeTree(const char *path)
+{
+  struct NameList names = {NULL, 0};
+
+  listHostDir(path, &names);
+
+  for (size_t i = 0; i < names.count; ++i)
+  {
+    char child[PATH_LENGTH];
+    struct stat info;
+
+    sprintf(child, "%s/%s", path, names.names[i]);
+    ck_assert_int_eq(stat(child, &info), 0);
+
+    if (S_ISDIR(info.st_mode))
+      removeTree(child);
+    else
+      ck_assert_int_eq(unlink(child), 0);
+  }
+
+  freeNameList(&names);
+  ck_assert_int_eq(rmdir(path), 0);
+}
+/*----------------------------------------------------------------------------*/
+static int runTool(const char *options, const char *source, const char *image)
+{
+  char command[PATH_LENGTH];
+
+  sprintf(command, "\"%s\" %s -s " IMAGE_SIZE " \"%s\" \"%s\" > /dev/null 2>&1",
+      MAKE_IMAGE_PATH, options, source, image);
+  return system(command);
+}
+/*----------------------------------------------------------------------------*/
+START_TEST(testAlignedImage)
+{
+  char image[] = IMAGE_TEMPLATE;
+  char source[] = TREE_TEMPLATE;
+  char options[64];
+
+  makeFixtureTree(source);
+  makeImagePath(image);
+
+  sprintf(options, "-a %u -c %u -t 1", (unsigned int)ALIGNMENT_SIZE,
+      (unsigned int)FS_CLUSTER_SIZE);
+  ck_assert_int_eq(runTool(options, source, image), 0);
+  checkImage(source, image, ALIGNMENT_SIZE);
+
+  unlink(image);
+  removeTree(source);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
+START_TEST(testClusterSize)
+{
+  char image[] = IMAGE_TEMPLATE;
+  char source[] = TREE_TEMPLATE;
+  char options[64];
+
+  makeFixtureTree(source);
+  makeImagePath(image);
+
+  /* Cluster size should be a power of two */
+  sprintf(options, "-c %u", (unsigned int)FS_CLUSTER_SIZE * 3);
+  ck_assert_int_ne(runTool(options, source, image), 0);
+
+#ifdef CONFIG_CLUSTER_SIZE
+  /* Volumes with other cluster sizes are not mountable by the library */
+  sprintf(options, "-c %u", (unsigned int)FS_CLUSTER_SIZE * 2);
+  ck_assert_int_ne(runTool(options, source, image), 0);
+#endif
+
+  unlink(image);
+  removeTree(source);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
+START_TEST(testDefaultImage)
+{
+  char image[] = IMAGE_TEMPLATE;
+  char source[] = TREE_TEMPLATE;
+
+  makeFixtureTree(source);
+  makeImagePath(image);
+
+  ck_assert_int_eq(runTool("-l TEST", source, image), 0);
+  checkImage(source, image, 0);
+
+  unlink(image);
+  removeTree(source);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
+START_TEST(testInvalidSource)
+{
+  char image[] = IMAGE_TEMPLATE;
+  char source[] = TREE_TEMPLATE;
+  char path[PATH_LENGTH];
+
+  makeFixtureTree(source);
+  makeImagePath(image);
+
+  /* Names that differ only in case are ambiguous */
+  makeFixtureFile(source, "readme.txt", 1, 0);
+  ck_assert_int_ne(runTool("", source, image), 0);
+
+  /* Source should be a directory */
+  sprintf(path, "%s/README.TXT", source);
+  ck_assert_int_ne(runTool("", path, image), 0);
+
+  unlink(image);
+  removeTree(source);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
+int main(void)
+{
+  Suite * const suite = suite_create("MakeImage");
+  TCase * const testcase = tcase_create("Core");
+
+  tcase_add_test(testcase, testAlignedImage);
+  tcase_add_test(testcase, testClusterSize);
+  tcase_add_test(testcase, testDefaultImage);
+  tcase_add_test(testcase, testInvalidSource);
+  suite_add_tcase(suite, testcase);
+
+  SRunner * const runner = srunner_create(suite);
+
+  srunner_run_all(runner, CK_NORMAL);
+  const int failed = srunner_ntests_failed(runner);
+  srunner_free(runner);
+
+  return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
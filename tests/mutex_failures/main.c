@@ -7,13 +7,17 @@
 #include "default_fs.h"
 #include "virtual_mem.h"
 #include <yaf/fat32.h>
+#include <yaf/fat32_defs.h>
 #include <yaf/utils.h>
 #include <xcore/os/mutex.h>
+#include <xcore/os/semaphore.h>
 #include <check.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdlib.h>
 /*----------------------------------------------------------------------------*/
 static unsigned int pthreadHookFails = 0;
+static unsigned int semaphoreHookFails = 0;
 
 enum Result mutexInit(struct Mutex *mutex)
 {
@@ -28,6 +32,14 @@ enum Result mutexInit(struct Mutex *mutex)
     return pthread_mutex_init(&mutex->handle, 0) == 0 ? E_OK : E_ERROR;
 }
 /*----------------------------------------------------------------------------*/
+enum Result semInit(struct Semaphore *sem, int value)
+{
+  if (semaphoreHookFails && !--semaphoreHookFails)
+    return E_ERROR;
+  else
+    return sem_init(&sem->handle, 0, value) == 0 ? E_OK : E_ERROR;
+}
+/*----------------------------------------------------------------------------*/
 START_TEST(testMutexInitError)
 {
   static const struct VirtualMemConfig vmemConfig = {
@@ -56,15 +68,46 @@ START_TEST(testMutexInitError)
   ck_assert_ptr_nonnull(handle);
   deinit(handle);
 
-  /* Mutex 1 failure */
-  pthreadHookFails = 1;
-  handle = init(FatHandle, &fsConfig);
-  ck_assert_ptr_null(handle);
+  /* Failures of each lock until all locks are created successfully */
+  unsigned int failures = 0;
 
-  /* Mutex 2 failure */
-  pthreadHookFails = 2;
-  handle = init(FatHandle, &fsConfig);
-  ck_assert_ptr_null(handle);
+  while (1)
+  {
+    pthreadHookFails = failures + 1;
+    handle = init(FatHandle, &fsConfig);
+
+    if (handle != NULL)
+      break;
+    ++failures;
+  }
+
+  /* File, directory and table locks */
+#ifdef LOCK_FREE_ATOMICS
+  ck_assert_uint_eq(failures, DIR_LOCK_COUNT + 2);
+#else
+  /* Memory lock is created when atomic operations are not lock-free */
+  ck_assert_uint_eq(failures, DIR_LOCK_COUNT + 3);
+#endif
+  pthreadHookFails = 0;
+  deinit(handle);
+
+  /* Failures of semaphores in reader-writer locks */
+  failures = 0;
+
+  while (1)
+  {
+    semaphoreHookFails = failures + 1;
+    handle = init(FatHandle, &fsConfig);
+
+    if (handle != NULL)
+      break;
+    ++failures;
+  }
+
+  /* Two semaphores for each directory lock and for the table lock */
+  ck_assert_uint_eq(failures, (DIR_LOCK_COUNT + 1) * 2);
+  semaphoreHookFails = 0;
+  deinit(handle);
 
   /* Release all resources */
   deinit(vmem);
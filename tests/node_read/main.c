@@ -209,6 +209,23 @@ START_TEST(testSparseRead)
   ck_assert_uint_eq(count, sizeof(buffer));
   ck_assert_mem_eq(buffer, pattern, sizeof(buffer));
 
+  /* Seek forward from the end of the first cluster */
+  sparseChunkNumber = FS_CLUSTER_SIZE / sizeof(buffer) - 1;
+  memset(pattern, sparseChunkNumber, sizeof(pattern));
+  res = fsNodeRead(node, FS_NODE_DATA, sparseChunkNumber * sizeof(buffer),
+      buffer, sizeof(buffer), &count);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(count, sizeof(buffer));
+  ck_assert_mem_eq(buffer, pattern, sizeof(buffer));
+
+  sparseChunkNumber = ALIG_FILE_SIZE / sizeof(buffer) - 1;
+  memset(pattern, sparseChunkNumber, sizeof(pattern));
+  res = fsNodeRead(node, FS_NODE_DATA, sparseChunkNumber * sizeof(buffer),
+      buffer, sizeof(buffer), &count);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(count, sizeof(buffer));
+  ck_assert_mem_eq(buffer, pattern, sizeof(buffer));
+
   /* Release all resources */
   fsNodeFree(node);
   freeTestHandle(context);
@@ -13,7 +13,11 @@
 /* January 1, 2020, 12:00:00 */
 #define RTC_INITIAL_TIME      1577836800LL
 /*----------------------------------------------------------------------------*/
-#define FS_CLUSTER_SIZE       (CONFIG_SECTOR_SIZE * 2)
+#ifdef CONFIG_CLUSTER_SIZE
+#  define FS_CLUSTER_SIZE     CONFIG_CLUSTER_SIZE
+#else
+#  define FS_CLUSTER_SIZE     (CONFIG_SECTOR_SIZE * 2)
+#endif
 #define FS_NODE_POOL_SIZE     4
 #define FS_TABLE_COUNT        2
 #define FS_THREAD_POOL_SIZE   0
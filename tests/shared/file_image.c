@@ -0,0 +1,254 @@
+/*
+ * yaf/tests/shared/file_image.c
+ * Copyright (C) 2026 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#include "file_image.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+/*----------------------------------------------------------------------------*/
+struct FileImage
+{
+  struct Interface base;
+
+  sem_t semaphore;
+
+  /* Mapped image, null when the image is accessed with file calls */
+  uint8_t *data;
+  uint64_t position;
+  uint64_t size;
+  /* Result of the last failed command */
+  enum Result status;
+  int descriptor;
+  bool readonly;
+};
+/*----------------------------------------------------------------------------*/
+static size_t transferLength(const struct FileImage *, size_t);
+
+static enum Result imageInit(void *, const void *);
+static void imageDeinit(void *);
+static enum Result imageGetParam(void *, int, void *);
+static enum Result imageSetParam(void *, int, const void *);
+static size_t imageRead(void *, void *, size_t);
+static size_t imageWrite(void *, const void *, size_t);
+/*----------------------------------------------------------------------------*/
+const struct InterfaceClass * const FileImage =
+    &(const struct InterfaceClass){
+    .size = sizeof(struct FileImage),
+    .init = imageInit,
+    .deinit = imageDeinit,
+
+    .setCallback = NULL,
+    .getParam = imageGetParam,
+    .setParam = imageSetParam,
+    .read = imageRead,
+    .write = imageWrite
+};
+/*----------------------------------------------------------------------------*/
+static size_t transferLength(const struct FileImage *image, size_t length)
+{
+  const uint64_t left = image->size - image->position;
+  return length <= left ? length : (size_t)left;
+}
+/*----------------------------------------------------------------------------*/
+static enum Result imageInit(void *object, const void *configBase)
+{
+  const struct FileImageConfig * const config = configBase;
+  assert(config != NULL);
+  assert(config->path != NULL);
+
+  struct FileImage * const image = object;
+
+  image->data = NULL;
+  image->position = 0;
+  image->status = E_OK;
+  image->readonly = config->readonly;
+
+  image->descriptor = open(config->path, config->readonly ? O_RDONLY : O_RDWR);
+  if (image->descriptor == -1)
+    return E_ENTRY;
+
+  /* Block devices report zero size in file status, seek to the end instead */
+  const off_t size = lseek(image->descriptor, 0, SEEK_END);
+
+  if (size <= 0)
+  {
+    close(image->descriptor);
+    return E_EMPTY;
+  }
+  image->size = (uint64_t)size;
+
+  if (config->mapped)
+  {
+    const int protection = config->readonly ?
+        PROT_READ : (PROT_READ | PROT_WRITE);
+    void * const data = mmap(NULL, (size_t)image->size, protection,
+        MAP_SHARED, image->descriptor, 0);
+
+    if (data == MAP_FAILED)
+    {
+      close(image->descriptor);
+      return E_MEMORY;
+    }
+    image->data = data;
+  }
+
+  if (sem_init(&image->semaphore, 0, 1) != 0)
+  {
+    if (image->data != NULL)
+      munmap(image->data, (size_t)image->size);
+    close(image->descriptor);
+    return E_ERROR;
+  }
+
+  return E_OK;
+}
+/*----------------------------------------------------------------------------*/
+static void imageDeinit(void *object)
+{
+  struct FileImage * const image = object;
+
+  sem_destroy(&image->semaphore);
+
+  if (image->data != NULL)
+  {
+    if (!image->readonly)
+      msync(image->data, (size_t)image->size, MS_SYNC);
+    munmap(image->data, (size_t)image->size);
+  }
+  else if (!image->readonly)
+    fsync(image->descriptor);
+
+  close(image->descriptor);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result imageGetParam(void *object, int parameter, void *data)
+{
+  struct FileImage * const image = object;
+
+  switch ((enum IfParameter)parameter)
+  {
+    case IF_POSITION_64:
+      *(uint64_t *)data = image->position;
+      return E_OK;
+
+    case IF_SIZE_64:
+      *(uint64_t *)data = image->size;
+      return E_OK;
+
+    case IF_STATUS:
+      return image->status;
+
+    default:
+      return E_INVALID;
+  }
+}
+/*----------------------------------------------------------------------------*/
+static enum Result imageSetParam(void *object, int parameter, const void *data)
+{
+  struct FileImage * const image = object;
+
+  switch ((enum IfParameter)parameter)
+  {
+    case IF_POSITION_64:
+    {
+      const uint64_t position = *(const uint64_t *)data;
+
+      if (position < image->size)
+      {
+        image->position = position;
+        return E_OK;
+      }
+      else
+        return E_ADDRESS;
+    }
+
+    case IF_ACQUIRE:
+      sem_wait(&image->semaphore);
+      return E_OK;
+
+    case IF_RELEASE:
+      sem_post(&image->semaphore);
+      return E_OK;
+
+    default:
+      return E_INVALID;
+  }
+}
+/*----------------------------------------------------------------------------*/
+static size_t imageRead(void *object, void *buffer, size_t length)
+{
+  struct FileImage * const image = object;
+  const size_t available = transferLength(image, length);
+  size_t count = 0;
+
+  if (image->data != NULL)
+  {
+    memcpy(buffer, image->data + image->position, available);
+    count = available;
+  }
+  else
+  {
+    while (count < available)
+    {
+      const ssize_t chunk = pread(image->descriptor, (uint8_t *)buffer + count,
+          available - count, (off_t)(image->position + count));
+
+      if (chunk <= 0)
+        break;
+      count += (size_t)chunk;
+    }
+  }
+
+  image->position += count;
+  image->status = count == length ? E_OK : E_INTERFACE;
+  return count;
+}
+/*----------------------------------------------------------------------------*/
+static size_t imageWrite(void *object, const void *buffer, size_t length)
+{
+  struct FileImage * const image = object;
+
+  if (image->readonly)
+  {
+    image->status = E_ACCESS;
+    return 0;
+  }
+
+  const size_t available = transferLength(image, length);
+  size_t count = 0;
+
+  if (image->data != NULL)
+  {
+    memcpy(image->data + image->position, buffer, available);
+    count = available;
+  }
+  else
+  {
+    while (count < available)
+    {
+      const ssize_t chunk = pwrite(image->descriptor,
+          (const uint8_t *)buffer + count, available - count,
+          (off_t)(image->position + count));
+
+      if (chunk <= 0)
+        break;
+      count += (size_t)chunk;
+    }
+  }
+
+  image->position += count;
+  image->status = count == length ? E_OK : E_INTERFACE;
+  return count;
+}
+/*----------------------------------------------------------------------------*/
+const uint8_t *fileImageGetAddress(const void *object)
+{
+  const struct FileImage * const image = object;
+  return image->data;
+}
@@ -0,0 +1,32 @@
+/*
+ * yaf/tests/shared/file_image.h
+ * Copyright (C) 2026 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#ifndef YAF_TESTS_SHARED_FILE_IMAGE_H_
+#define YAF_TESTS_SHARED_FILE_IMAGE_H_
+/*----------------------------------------------------------------------------*/
+#include <xcore/interface.h>
+#include <stdbool.h>
+#include <stdint.h>
+/*----------------------------------------------------------------------------*/
+extern const struct InterfaceClass * const FileImage;
+
+struct FileImageConfig
+{
+  /** Mandatory: path to a regular file or a block device. */
+  const char *path;
+  /** Optional: map the image into memory instead of using file calls. */
+  bool mapped;
+  /** Optional: open the image without write access. */
+  bool readonly;
+};
+/*----------------------------------------------------------------------------*/
+BEGIN_DECLS
+
+const uint8_t *fileImageGetAddress(const void *);
+
+END_DECLS
+/*----------------------------------------------------------------------------*/
+#endif /* YAF_TESTS_SHARED_FILE_IMAGE_H_ */
@@ -5,7 +5,10 @@
  */
 
 #include "helpers.h"
-#include <yaf/fat32_defs.h>
+#include <yaf/fat32_helpers.h>
+#include <yaf/fat32_pools.h>
+#include <xcore/interface.h>
+#include <xcore/memory.h>
 #include <check.h>
 /*----------------------------------------------------------------------------*/
 void changeLastAllocatedCluster(void *object, uint32_t number)
@@ -22,7 +25,37 @@ void changeLastAllocatedCluster(void *object, uint32_t number)
 void changeLfnCount(void *object, uint8_t count)
 {
   struct FatNode * const node = object;
+
   node->lfn = count;
+  /* Force name reading from the volume */
+  node->flags &= ~FAT_FLAG_NAME;
+}
+/*----------------------------------------------------------------------------*/
+size_t countChainFragments(const void *object)
+{
+  const struct FatNode * const node = object;
+  const struct FatHandle * const handle = (const struct FatHandle *)node->handle;
+  uint32_t current = node->payloadCluster;
+  size_t fragments = 0;
+
+  while (current >= CLUSTER_OFFSET && current < CLUSTER_EOC_VAL)
+  {
+    const uint64_t position = ((uint64_t)handle->tableSector << SECTOR_EXP)
+        + current * sizeof(uint32_t);
+    uint32_t next;
+
+    ck_assert_uint_eq(ifSetParam(handle->interface, IF_POSITION_64,
+        &position), E_OK);
+    ck_assert_uint_eq(ifRead(handle->interface, &next, sizeof(next)),
+        sizeof(next));
+    next = fromLittleEndian32(next) & 0x0FFFFFFFUL;
+
+    if (next < CLUSTER_EOC_VAL && next != current + 1)
+      ++fragments;
+    current = next;
+  }
+
+  return fragments;
 }
 /*----------------------------------------------------------------------------*/
 PointerQueue drainContextPool(void *object)
@@ -30,16 +63,13 @@ PointerQueue drainContextPool(void *object)
   struct FatHandle * const handle = object;
   PointerQueue contexts;
 
-  const bool res = pointerQueueInit(&contexts,
-      pointerQueueSize(&handle->pools.contexts.queue));
+  const bool res = pointerQueueInit(&contexts, handle->pools.contexts.capacity);
   ck_assert(res);
 
-  while (!pointerQueueEmpty(&handle->pools.contexts.queue))
-  {
-    void * const pointer = pointerQueueFront(&handle->pools.contexts.queue);
-    pointerQueuePopFront(&handle->pools.contexts.queue);
+  void *pointer;
+
+  while ((pointer = allocatePoolContext(handle)) != NULL)
     pointerQueuePushBack(&contexts, pointer);
-  }
 
   return contexts;
 }
@@ -49,24 +79,31 @@ PointerQueue drainNodePool(void *object)
   struct FatHandle * const handle = object;
   PointerQueue nodes;
 
-  const bool res = pointerQueueInit(&nodes,
-      pointerQueueSize(&handle->pools.nodes.queue));
+  const bool res = pointerQueueInit(&nodes, handle->pools.nodes.capacity);
   ck_assert(res);
 
-  while (!pointerQueueEmpty(&handle->pools.nodes.queue))
-  {
-    void * const pointer = pointerQueueFront(&handle->pools.nodes.queue);
-    pointerQueuePopFront(&handle->pools.nodes.queue);
+  void *pointer;
+
+  while ((pointer = popPoolEntry(&handle->pools.nodes)) != NULL)
     pointerQueuePushBack(&nodes, pointer);
-  }
 
   return nodes;
 }
 /*----------------------------------------------------------------------------*/
-size_t getMaxEntriesPerCluster(const void *object)
+uint32_t getClusterCount(const void *object)
 {
+#ifdef CONFIG_WRITE
   const struct FatHandle * const handle = object;
-  return 1 << ENTRY_EXP << handle->clusterSize;
+  return handle->clusterCount;
+#else
+  (void)object;
+  return 0;
+#endif
+}
+/*----------------------------------------------------------------------------*/
+size_t getMaxEntriesPerCluster(const void *object)
+{
+  return calcNodeCount(object);
 }
 /*----------------------------------------------------------------------------*/
 size_t getMaxEntriesPerSector(void)
@@ -74,6 +111,11 @@ size_t getMaxEntriesPerSector(void)
   return 1 << ENTRY_EXP;
 }
 /*----------------------------------------------------------------------------*/
+size_t getMaxSimilarAliasesCount(void)
+{
+  return MAX_SIMILAR_ALIASES;
+}
+/*----------------------------------------------------------------------------*/
 size_t getMaxSimilarNamesCount(void)
 {
   return MAX_SIMILAR_NAMES;
@@ -92,7 +134,7 @@ void restoreContextPool(void *object, PointerQueue *contexts)
   {
     void * const pointer = pointerQueueFront(contexts);
     pointerQueuePopFront(contexts);
-    pointerQueuePushBack(&handle->pools.contexts.queue, pointer);
+    freePoolContext(handle, pointer);
   }
 
   pointerQueueDeinit(contexts);
@@ -106,8 +148,22 @@ void restoreNodePool(void *object, PointerQueue *nodes)
   {
     void * const pointer = pointerQueueFront(nodes);
     pointerQueuePopFront(nodes);
-    pointerQueuePushBack(&handle->pools.nodes.queue, pointer);
+    pushPoolEntry(&handle->pools.nodes, pointer);
   }
 
   pointerQueueDeinit(nodes);
 }
+/*----------------------------------------------------------------------------*/
+void writeTableCell(void *object, uint32_t cluster, uint32_t value)
+{
+  const struct FatHandle * const handle = object;
+  const uint64_t position = ((uint64_t)handle->tableSector << SECTOR_EXP)
+      + cluster * sizeof(uint32_t);
+  const uint32_t cell = toLittleEndian32(value);
+
+  /* Only the first allocation table is modified */
+  ck_assert_uint_eq(ifSetParam(handle->interface, IF_POSITION_64, &position),
+      E_OK);
+  ck_assert_uint_eq(ifWrite(handle->interface, &cell, sizeof(cell)),
+      sizeof(cell));
+}
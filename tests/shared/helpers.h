@@ -15,14 +15,18 @@ BEGIN_DECLS
 
 void changeLastAllocatedCluster(void *, uint32_t);
 void changeLfnCount(void *, uint8_t);
+size_t countChainFragments(const void *);
 PointerQueue drainContextPool(void *);
 PointerQueue drainNodePool(void *);
+uint32_t getClusterCount(const void *);
 size_t getMaxEntriesPerCluster(const void *);
 size_t getMaxEntriesPerSector(void);
+size_t getMaxSimilarAliasesCount(void);
 size_t getMaxSimilarNamesCount(void);
 size_t getTableEntriesPerSector(void);
 void restoreContextPool(void *, PointerQueue *);
 void restoreNodePool(void *, PointerQueue *);
+void writeTableCell(void *, uint32_t, uint32_t);
 
 END_DECLS
 /*----------------------------------------------------------------------------*/
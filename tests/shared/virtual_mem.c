@@ -28,9 +28,20 @@ struct VirtualMem
   size_t position;
   size_t size;
 
+  struct VirtualMemStats stats;
   VmemRegionList regions;
+
+  /* Device timing model */
+  uint64_t bandwidth;
+  size_t block;
+  uint32_t latency;
+  uint32_t rewrite;
+  uint32_t seed;
+  uint32_t stall;
+  uint32_t stallRate;
 };
 /*----------------------------------------------------------------------------*/
+static uint64_t calcCommandTime(struct VirtualMem *, size_t, bool);
 static bool inForbiddenRegion(struct VirtualMem *, uint64_t, uint8_t);
 
 static enum Result vmemInit(void *, const void *);
@@ -53,6 +64,45 @@ const struct InterfaceClass * const VirtualMem =
     .write = vmemWrite
 };
 /*----------------------------------------------------------------------------*/
+static uint64_t calcCommandTime(struct VirtualMem *dev, size_t length,
+    bool write)
+{
+  uint64_t time = dev->latency;
+
+  if (dev->bandwidth)
+    time += (uint64_t)length * 1000000000ULL / dev->bandwidth;
+
+  if (write && dev->block && length)
+  {
+    /* Partially covered erase blocks are read, erased and written again */
+    const size_t begin = dev->position;
+    const size_t end = dev->position + length;
+    const size_t first = begin / dev->block;
+    const size_t last = (end - 1) / dev->block;
+    unsigned int partial = 0;
+
+    if (begin % dev->block)
+      ++partial;
+    if ((end % dev->block) && (first != last || !(begin % dev->block)))
+      ++partial;
+
+    time += (uint64_t)partial * dev->rewrite;
+  }
+
+  if (write && dev->stallRate)
+  {
+    /* Xorshift generator with a fixed seed for reproducible stalls */
+    dev->seed ^= dev->seed << 13;
+    dev->seed ^= dev->seed >> 17;
+    dev->seed ^= dev->seed << 5;
+
+    if (dev->seed % 1000000 < dev->stallRate)
+      time += dev->stall;
+  }
+
+  return time;
+}
+/*----------------------------------------------------------------------------*/
 static bool inForbiddenRegion(struct VirtualMem *dev, uint64_t position,
     uint8_t flag)
 {
@@ -84,6 +134,15 @@ static enum Result vmemInit(void *object, const void *configBase)
   dev->counter = 0;
   dev->position = 0;
   dev->size = config->size;
+  memset(&dev->stats, 0, sizeof(dev->stats));
+
+  dev->bandwidth = config->bandwidth;
+  dev->block = config->block;
+  dev->latency = config->latency;
+  dev->rewrite = config->rewrite;
+  dev->seed = 0x12345678UL;
+  dev->stall = config->stall;
+  dev->stallRate = config->stallRate;
 
   vmemRegionListInit(&dev->regions);
 
@@ -201,6 +260,10 @@ static size_t vmemRead(void *object, void *buffer, size_t length)
   if (match && dev->counter > 0)
     --dev->counter;
 
+  dev->stats.time += calcCommandTime(dev, length, false);
+  ++dev->stats.reads;
+  dev->stats.readBytes += length;
+
   memcpy(buffer, dev->data + dev->position, length);
   dev->position += length;
 
@@ -218,6 +281,10 @@ static size_t vmemWrite(void *object, const void *buffer, size_t length)
   if (match && dev->counter > 0)
     --dev->counter;
 
+  dev->stats.time += calcCommandTime(dev, length, true);
+  ++dev->stats.writes;
+  dev->stats.writtenBytes += length;
+
   memcpy(dev->data + dev->position, buffer, length);
   dev->position += length;
 
@@ -230,6 +297,18 @@ uint8_t *vmemGetAddress(void *object)
   return dev->data;
 }
 /*----------------------------------------------------------------------------*/
+void vmemGetStats(const void *object, struct VirtualMemStats *stats)
+{
+  const struct VirtualMem * const dev = object;
+  *stats = dev->stats;
+}
+/*----------------------------------------------------------------------------*/
+void vmemResetStats(void *object)
+{
+  struct VirtualMem * const dev = object;
+  memset(&dev->stats, 0, sizeof(dev->stats));
+}
+/*----------------------------------------------------------------------------*/
 void vmemAddMarkedRegion(void *object, struct VirtualMemRegion region,
     bool readable, bool writable, bool addressable)
 {
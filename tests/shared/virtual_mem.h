@@ -27,6 +27,32 @@ struct VirtualMemConfig
 {
   /** Mandatory: region size. */
   size_t size;
+  /** Optional: fixed overhead of each command in nanoseconds. */
+  uint32_t latency;
+  /** Optional: transfer rate in bytes per second, zero for no limit. */
+  uint64_t bandwidth;
+  /** Optional: erase block size in bytes, power of two. */
+  size_t block;
+  /** Optional: penalty for each partially written erase block in ns. */
+  uint32_t rewrite;
+  /** Optional: probability of a stall per million write commands. */
+  uint32_t stallRate;
+  /** Optional: duration of each stall in nanoseconds. */
+  uint32_t stall;
+};
+
+struct VirtualMemStats
+{
+  /* Read commands */
+  uint64_t reads;
+  /* Write commands */
+  uint64_t writes;
+  /* Bytes read from the memory */
+  uint64_t readBytes;
+  /* Bytes written to the memory */
+  uint64_t writtenBytes;
+  /* Simulated duration of all commands in nanoseconds */
+  uint64_t time;
 };
 
 struct VirtualMemRegion
@@ -39,6 +65,8 @@ struct VirtualMemRegion
 BEGIN_DECLS
 
 uint8_t *vmemGetAddress(void *);
+void vmemGetStats(const void *, struct VirtualMemStats *);
+void vmemResetStats(void *);
 
 void vmemAddMarkedRegion(void *, struct VirtualMemRegion, bool, bool, bool);
 void vmemAddRegion(void *, struct VirtualMemRegion);
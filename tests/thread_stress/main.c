@@ -0,0 +1,598 @@
+/*
+ * main.c
+ * Copyright (C) 2026 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#include "default_fs.h"
+#include "virtual_mem.h"
+#include <yaf/fat32.h>
+#include <yaf/utils.h>
+#include <xcore/fs/utils.h>
+#include <check.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+/*----------------------------------------------------------------------------*/
+#define PATH_COMPACT        "/COMPACT"
+#define PATH_STRESS         "/STRESS"
+#define PATH_STRESS_DATA    "/STRESS/DATA.BIN"
+
+#define READER_COUNT        2
+#define WRITER_COUNT        4
+#define WRITER_ITERATIONS   64
+#define FILE_SIZE           (FS_CLUSTER_SIZE + 7)
+
+/* Removed entries occupy a whole sector, moved entries keep their offsets */
+#define FRONT_COUNT         (CONFIG_SECTOR_SIZE / 32)
+#define BYSTANDER_COUNT     (FRONT_COUNT * 2)
+/*----------------------------------------------------------------------------*/
+struct StressWorker
+{
+  struct FsHandle *handle;
+  atomic_bool *done;
+  unsigned int index;
+  unsigned int errors;
+};
+
+struct CompactWorker
+{
+  struct FsNode *parent;
+  enum Result result;
+};
+
+struct MetadataWorker
+{
+  struct FsNode *node;
+  const void *buffer;
+  size_t length;
+  enum FsFieldType type;
+  enum Result result;
+};
+/*----------------------------------------------------------------------------*/
+static void checkMetadata(struct FsHandle *, const char *, time64_t, FsAccess);
+static void compactWithMetadata(enum FsFieldType);
+static void fillPattern(uint8_t *, size_t, unsigned int);
+static unsigned int listDir(struct FsHandle *, const char *, size_t *);
+static struct FsHandle *makeStressHandle(struct Interface *);
+static void makeTimedNode(struct FsHandle *, const char *, time64_t);
+static unsigned int readFile(struct FsHandle *, const char *, unsigned int);
+static unsigned int readNode(struct FsNode *, unsigned int);
+static void *runCompactor(void *);
+static void *runMetadataWriter(void *);
+static void *runReader(void *);
+static void *runWriter(void *);
+static void waitForThreads(void);
+static unsigned int writeFile(struct FsNode *, unsigned int);
+/*----------------------------------------------------------------------------*/
+static void checkMetadata(struct FsHandle *handle, const char *path,
+    time64_t timestamp, FsAccess access)
+{
+  struct FsNode * const node = fsOpenNode(handle, path);
+  ck_assert_ptr_nonnull(node);
+
+  FsAccess nodeAccess;
+  time64_t nodeTime;
+  enum Result res;
+
+  res = fsNodeRead(node, FS_NODE_TIME, 0, &nodeTime, sizeof(nodeTime), NULL);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_int_eq(nodeTime, timestamp);
+
+  res = fsNodeRead(node, FS_NODE_ACCESS, 0, &nodeAccess, sizeof(nodeAccess),
+      NULL);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(nodeAccess, access);
+
+  fsNodeFree(node);
+}
+/*----------------------------------------------------------------------------*/
+static void compactWithMetadata(enum FsFieldType type)
+{
+  static const struct VirtualMemConfig vmemConfig = {
+      .size = FS_TOTAL_SIZE
+  };
+  struct Interface * const vmem = init(VirtualMem, &vmemConfig);
+  ck_assert_ptr_nonnull(vmem);
+
+  struct FsHandle * const handle = makeStressHandle(vmem);
+  char path[32];
+  enum Result res;
+
+  /*
+   * Removed entries are followed by the target entry and by bystanders,
+   * each node has a distinct timestamp. Whole minutes are used because
+   * seconds are stored with a lower resolution.
+   */
+  makeNode(handle, PATH_COMPACT, true, false);
+
+  for (unsigned int i = 0; i < FRONT_COUNT; ++i)
+  {
+    sprintf(path, PATH_COMPACT "/F%03u.TXT", i);
+    makeTimedNode(handle, path, (RTC_INITIAL_TIME - i * 60) * 1000000);
+  }
+
+  const time64_t targetTime = (RTC_INITIAL_TIME - FRONT_COUNT * 60) * 1000000;
+  makeTimedNode(handle, PATH_COMPACT "/TARGET.TXT", targetTime);
+
+  for (unsigned int i = 0; i < BYSTANDER_COUNT; ++i)
+  {
+    sprintf(path, PATH_COMPACT "/B%03u.TXT", i);
+    makeTimedNode(handle, path,
+        (RTC_INITIAL_TIME - (FRONT_COUNT + i + 1) * 60) * 1000000);
+  }
+
+  struct FsNode * const parent = fsOpenNode(handle, PATH_COMPACT);
+  ck_assert_ptr_nonnull(parent);
+  struct FsNode * const target = fsOpenNode(handle, PATH_COMPACT "/TARGET.TXT");
+  ck_assert_ptr_nonnull(target);
+
+  for (unsigned int i = 0; i < FRONT_COUNT; ++i)
+  {
+    sprintf(path, PATH_COMPACT "/F%03u.TXT", i);
+
+    struct FsNode * const node = fsOpenNode(handle, path);
+    ck_assert_ptr_nonnull(node);
+
+    res = fsNodeRemove(parent, node);
+    ck_assert_uint_eq(res, E_OK);
+    fsNodeFree(node);
+  }
+
+  /*
+   * Compaction is stalled on the interface while holding the directory lock,
+   * metadata writing is started and waits for the same lock. Open target
+   * node is moved by the compaction before the entry is modified.
+   */
+  static const FsAccess access = FS_ACCESS_READ;
+  const time64_t timestamp = (RTC_INITIAL_TIME + 60) * 1000000;
+  struct CompactWorker compactor = {parent, E_ERROR};
+  struct MetadataWorker writer = {target, NULL, 0, type, E_ERROR};
+  pthread_t compactorThread;
+  pthread_t writerThread;
+  int status;
+
+  if (type == FS_NODE_ACCESS)
+  {
+    writer.buffer = &access;
+    writer.length = sizeof(access);
+  }
+  else
+  {
+    writer.buffer = &timestamp;
+    writer.length = sizeof(timestamp);
+  }
+
+  ifSetParam(vmem, IF_ACQUIRE, NULL);
+
+  status = pthread_create(&compactorThread, NULL, runCompactor, &compactor);
+  ck_assert_int_eq(status, 0);
+  waitForThreads();
+
+  status = pthread_create(&writerThread, NULL, runMetadataWriter, &writer);
+  ck_assert_int_eq(status, 0);
+  waitForThreads();
+
+  ifSetParam(vmem, IF_RELEASE, NULL);
+
+  status = pthread_join(compactorThread, NULL);
+  ck_assert_int_eq(status, 0);
+  ck_assert_uint_eq(compactor.result, E_OK);
+
+  status = pthread_join(writerThread, NULL);
+  ck_assert_int_eq(status, 0);
+  ck_assert_uint_eq(writer.result, E_OK);
+
+  fsNodeFree(target);
+  fsNodeFree(parent);
+
+  /* Target entry is modified, bystanders are left untouched */
+  if (type == FS_NODE_ACCESS)
+    checkMetadata(handle, PATH_COMPACT "/TARGET.TXT", targetTime, access);
+  else
+    checkMetadata(handle, PATH_COMPACT "/TARGET.TXT", timestamp,
+        FS_ACCESS_READ | FS_ACCESS_WRITE);
+
+  for (unsigned int i = 0; i < BYSTANDER_COUNT; ++i)
+  {
+    sprintf(path, PATH_COMPACT "/B%03u.TXT", i);
+    checkMetadata(handle, path,
+        (RTC_INITIAL_TIME - (FRONT_COUNT + i + 1) * 60) * 1000000,
+        FS_ACCESS_READ | FS_ACCESS_WRITE);
+  }
+
+  /* Release all resources */
+  deinit(handle);
+  deinit(vmem);
+}
+/*----------------------------------------------------------------------------*/
+/*----------------------------------------------------------------------------*/
+static void fillPattern(uint8_t *buffer, size_t length, unsigned int seed)
+{
+  for (size_t i = 0; i < length; ++i)
+    buffer[i] = (uint8_t)(seed * 31 + i);
+}
+/*----------------------------------------------------------------------------*/
+static unsigned int listDir(struct FsHandle *handle, const char *path,
+    size_t *count)
+{
+  struct FsNode * const parent = fsOpenNode(handle, path);
+
+  if (parent == NULL)
+    return 1;
+
+  struct FsNode * const node = fsNodeHead(parent);
+  unsigned int errors = 0;
+  enum Result res;
+
+  *count = 0;
+
+  if (node != NULL)
+  {
+    do
+    {
+      char name[FS_NAME_LENGTH];
+
+      res = fsNodeRead(node, FS_NODE_NAME, 0, name, sizeof(name), NULL);
+      if (res != E_OK)
+        ++errors;
+
+      ++*count;
+    }
+    while ((res = fsNodeNext(node)) == E_OK);
+
+    if (res != E_ENTRY && res != E_EMPTY)
+      ++errors;
+
+    fsNodeFree(node);
+  }
+  else
+    ++errors;
+
+  fsNodeFree(parent);
+  return errors;
+}
+/*----------------------------------------------------------------------------*/
+static struct FsHandle *makeStressHandle(struct Interface *vmem)
+{
+  static const struct Fat32FsConfig makeFsConfig =  {
+      .cluster = FS_CLUSTER_SIZE,
+      .reserved = 0,
+      .tables = FS_TABLE_COUNT,
+      .label = "TEST"
+  };
+  const enum Result res = fat32MakeFs(vmem, &makeFsConfig, NULL, 0);
+  ck_assert_uint_eq(res, E_OK);
+
+  /* Threads wait for free contexts instead of failing */
+  const struct Fat32Config fsConfig = {
+      .interface = vmem,
+      .nodes = (READER_COUNT + WRITER_COUNT) * 8,
+      .threads = READER_COUNT + WRITER_COUNT,
+      .timeout = 10000
+  };
+  struct FsHandle * const handle = init(FatHandle, &fsConfig);
+  ck_assert_ptr_nonnull(handle);
+
+  return handle;
+}
+/*----------------------------------------------------------------------------*/
+static void makeTimedNode(struct FsHandle *handle, const char *path,
+    time64_t timestamp)
+{
+  makeNode(handle, path, false, false);
+
+  struct FsNode * const node = fsOpenNode(handle, path);
+  ck_assert_ptr_nonnull(node);
+
+  const enum Result res = fsNodeWrite(node, FS_NODE_TIME, 0, &timestamp,
+      sizeof(timestamp), NULL);
+  ck_assert_uint_eq(res, E_OK);
+
+  fsNodeFree(node);
+}
+/*----------------------------------------------------------------------------*/
+static unsigned int readFile(struct FsHandle *handle, const char *path,
+    unsigned int seed)
+{
+  struct FsNode * const node = fsOpenNode(handle, path);
+
+  if (node == NULL)
+    return 1;
+
+  const unsigned int errors = readNode(node, seed);
+
+  fsNodeFree(node);
+  return errors;
+}
+/*----------------------------------------------------------------------------*/
+static unsigned int readNode(struct FsNode *node, unsigned int seed)
+{
+  uint8_t expected[FILE_SIZE];
+  uint8_t buffer[FILE_SIZE];
+  size_t count;
+
+  fillPattern(expected, sizeof(expected), seed);
+
+  const enum Result res = fsNodeRead(node, FS_NODE_DATA, 0, buffer,
+      sizeof(buffer), &count);
+
+  return res != E_OK || count != sizeof(buffer)
+      || memcmp(buffer, expected, sizeof(buffer)) ? 1 : 0;
+}
+/*----------------------------------------------------------------------------*/
+static void *runCompactor(void *argument)
+{
+  struct CompactWorker * const worker = argument;
+
+  worker->result = fat32CompactDir(worker->parent);
+  return NULL;
+}
+/*----------------------------------------------------------------------------*/
+static void *runMetadataWriter(void *argument)
+{
+  struct MetadataWorker * const worker = argument;
+
+  worker->result = fsNodeWrite(worker->node, worker->type, 0, worker->buffer,
+      worker->length, NULL);
+  return NULL;
+}
+/*----------------------------------------------------------------------------*/
+static void *runReader(void *argument)
+{
+  struct StressWorker * const worker = argument;
+
+  while (!atomic_load(worker->done))
+  {
+    size_t count;
+
+    worker->errors += readFile(worker->handle, PATH_STRESS_DATA, 0);
+
+    /* Dot entries, directories of the writers and the data file */
+    worker->errors += listDir(worker->handle, PATH_STRESS, &count);
+    if (count != WRITER_COUNT + 3)
+      ++worker->errors;
+
+    /* Directory of the writer is modified concurrently */
+    char path[32];
+
+    sprintf(path, PATH_STRESS "/T%u", worker->index % WRITER_COUNT);
+    worker->errors += listDir(worker->handle, path, &count);
+  }
+
+  return NULL;
+}
+/*----------------------------------------------------------------------------*/
+static void *runWriter(void *argument)
+{
+  struct StressWorker * const worker = argument;
+  char dirPath[32];
+
+  sprintf(dirPath, PATH_STRESS "/T%u", worker->index);
+
+  struct FsNode * const parent = fsOpenNode(worker->handle, dirPath);
+
+  if (parent == NULL)
+  {
+    ++worker->errors;
+    return NULL;
+  }
+
+  for (unsigned int i = 0; i < WRITER_ITERATIONS; ++i)
+  {
+    const unsigned int seed = worker->index * WRITER_ITERATIONS + i + 1;
+    char name[16];
+    char path[48];
+
+    sprintf(name, "F%03u.TXT", i);
+    sprintf(path, "%s/%s", dirPath, name);
+
+    const struct FsFieldDescriptor desc[] = {
+        {
+            name,
+            strlen(name) + 1,
+            FS_NODE_NAME
+        }, {
+            NULL,
+            0,
+            FS_NODE_DATA
+        }
+    };
+
+    if (fsNodeCreate(parent, desc, ARRAY_SIZE(desc)) != E_OK)
+    {
+      ++worker->errors;
+      continue;
+    }
+
+    struct FsNode * const node = fsOpenNode(worker->handle, path);
+
+    if (node == NULL)
+    {
+      ++worker->errors;
+      continue;
+    }
+
+    /* Size of the file is saved when the node is freed */
+    worker->errors += writeFile(node, seed);
+    worker->errors += readNode(node, seed);
+
+    /* Odd files are removed, their clusters are reused by other threads */
+    if ((i & 1) && fsNodeRemove(parent, node) != E_OK)
+      ++worker->errors;
+
+    fsNodeFree(node);
+  }
+
+  fsNodeFree(parent);
+  return NULL;
+}
+/*----------------------------------------------------------------------------*/
+static void waitForThreads(void)
+{
+  /* Give started threads time to reach the locks they are waiting for */
+  static const struct timespec delay = {
+      .tv_sec = 0,
+      .tv_nsec = 100000000
+  };
+
+  nanosleep(&delay, NULL);
+}
+/*----------------------------------------------------------------------------*/
+static unsigned int writeFile(struct FsNode *node, unsigned int seed)
+{
+  uint8_t buffer[FILE_SIZE];
+  size_t count;
+
+  fillPattern(buffer, sizeof(buffer), seed);
+
+  const enum Result res = fsNodeWrite(node, FS_NODE_DATA, 0, buffer,
+      sizeof(buffer), &count);
+
+  return res != E_OK || count != sizeof(buffer) ? 1 : 0;
+}
+/*----------------------------------------------------------------------------*/
+START_TEST(testCompactionAccess)
+{
+  compactWithMetadata(FS_NODE_ACCESS);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
+START_TEST(testCompactionTime)
+{
+  compactWithMetadata(FS_NODE_TIME);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
+START_TEST(testConcurrentAccess)
+{
+  static const struct VirtualMemConfig vmemConfig = {
+      .size = FS_TOTAL_SIZE
+  };
+  struct Interface * const vmem = init(VirtualMem, &vmemConfig);
+  ck_assert_ptr_nonnull(vmem);
+
+  struct FsHandle * const handle = makeStressHandle(vmem);
+  enum Result res;
+
+  /* Sibling directories of the writers and a file for the readers */
+  makeNode(handle, PATH_STRESS, true, false);
+
+  for (unsigned int i = 0; i < WRITER_COUNT; ++i)
+  {
+    char path[32];
+
+    sprintf(path, PATH_STRESS "/T%u", i);
+    makeNode(handle, path, true, false);
+  }
+
+  makeNode(handle, PATH_STRESS_DATA, false, false);
+
+  struct FsNode * const data = fsOpenNode(handle, PATH_STRESS_DATA);
+  ck_assert_ptr_nonnull(data);
+  ck_assert_uint_eq(writeFile(data, 0), 0);
+  fsNodeFree(data);
+
+  /* Run readers and writers concurrently */
+  struct StressWorker readers[READER_COUNT];
+  struct StressWorker writers[WRITER_COUNT];
+  pthread_t readerThreads[READER_COUNT];
+  pthread_t writerThreads[WRITER_COUNT];
+  atomic_bool done = false;
+  int status;
+
+  for (unsigned int i = 0; i < READER_COUNT; ++i)
+  {
+    readers[i] = (struct StressWorker){handle, &done, i, 0};
+    status = pthread_create(&readerThreads[i], NULL, runReader, &readers[i]);
+    ck_assert_int_eq(status, 0);
+  }
+
+  for (unsigned int i = 0; i < WRITER_COUNT; ++i)
+  {
+    writers[i] = (struct StressWorker){handle, &done, i, 0};
+    status = pthread_create(&writerThreads[i], NULL, runWriter, &writers[i]);
+    ck_assert_int_eq(status, 0);
+  }
+
+  for (unsigned int i = 0; i < WRITER_COUNT; ++i)
+  {
+    status = pthread_join(writerThreads[i], NULL);
+    ck_assert_int_eq(status, 0);
+    ck_assert_uint_eq(writers[i].errors, 0);
+  }
+
+  atomic_store(&done, true);
+
+  for (unsigned int i = 0; i < READER_COUNT; ++i)
+  {
+    status = pthread_join(readerThreads[i], NULL);
+    ck_assert_int_eq(status, 0);
+    ck_assert_uint_eq(readers[i].errors, 0);
+  }
+
+  /* Even files should be left with their contents */
+  for (unsigned int i = 0; i < WRITER_COUNT; ++i)
+  {
+    char path[48];
+    size_t count;
+
+    sprintf(path, PATH_STRESS "/T%u", i);
+    ck_assert_uint_eq(listDir(handle, path, &count), 0);
+    ck_assert_uint_eq(count, WRITER_ITERATIONS / 2 + 2);
+
+    for (unsigned int j = 0; j < WRITER_ITERATIONS; j += 2)
+    {
+      const unsigned int seed = i * WRITER_ITERATIONS + j + 1;
+
+      sprintf(path, PATH_STRESS "/T%u/F%03u.TXT", i, j);
+      ck_assert_uint_eq(readFile(handle, path, seed), 0);
+    }
+  }
+
+  /* Volume should stay consistent */
+  static const size_t arenaSize = 16384;
+  struct Fat32CheckReport report;
+
+  uint8_t * const arena = malloc(arenaSize);
+  ck_assert_ptr_nonnull(arena);
+
+  res = fsHandleSync(handle);
+  ck_assert_uint_eq(res, E_OK);
+
+  res = fat32Check(handle, arena, arenaSize, false, &report);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(report.lostChains, 0);
+  ck_assert_uint_eq(report.crossLinks, 0);
+  ck_assert_uint_eq(report.invalidLinks, 0);
+  ck_assert_uint_eq(report.loopedChains, 0);
+  ck_assert_uint_eq(report.invalidEntries, 0);
+
+  /* Release all resources */
+  free(arena);
+  deinit(handle);
+  deinit(vmem);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
+int main(void)
+{
+  Suite * const suite = suite_create("ThreadStress");
+  TCase * const testcase = tcase_create("Core");
+
+  tcase_add_test(testcase, testCompactionAccess);
+  tcase_add_test(testcase, testCompactionTime);
+  tcase_add_test(testcase, testConcurrentAccess);
+  suite_add_tcase(suite, testcase);
+
+  SRunner * const runner = srunner_create(suite);
+
+  srunner_run_all(runner, CK_NORMAL);
+  const int failed = srunner_ntests_failed(runner);
+  srunner_free(runner);
+
+  return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -8,16 +8,62 @@
 #include "helpers.h"
 #include "virtual_mem.h"
 #include <yaf/fat32.h>
+#include <yaf/fat32_defs.h>
 #include <xcore/fs/utils.h>
 #include <check.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 /*----------------------------------------------------------------------------*/
 /* Use public definition from the XCORE library */
 #define CONFIG_NAME_LENGTH FS_NAME_LENGTH
 /*----------------------------------------------------------------------------*/
+static void checkNodeName(struct TestContext, struct FsNode *, const char *);
+static enum Result createEmptyNode(struct FsNode *, const char *);
 static void freeFillingNode(struct FsHandle *, const char *, size_t);
 static void insertFillingNode(struct FsHandle *, const char *, size_t);
+static void readAlias(struct TestContext, struct FsNode *, char *);
+/*----------------------------------------------------------------------------*/
+static void checkNodeName(struct TestContext context, struct FsNode *node,
+    const char *name)
+{
+  char buffer[CONFIG_NAME_LENGTH];
+  enum Result res;
+
+  /* Directory entries are unavailable while the name is read */
+  vmemAddRegion(context.interface,
+      vmemExtractDataRegion(context.interface));
+  res = fsNodeRead(node, FS_NODE_NAME, 0, buffer, sizeof(buffer), NULL);
+#ifdef CONFIG_NAME_CACHE
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_str_eq(buffer, name);
+#else
+  ck_assert_uint_eq(res, E_ADDRESS);
+#endif
+  vmemClearRegions(context.interface);
+
+  /* Name read from the volume matches the cached name */
+  res = fsNodeRead(node, FS_NODE_NAME, 0, buffer, sizeof(buffer), NULL);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_str_eq(buffer, name);
+}
+/*----------------------------------------------------------------------------*/
+static enum Result createEmptyNode(struct FsNode *parent, const char *name)
+{
+  const struct FsFieldDescriptor desc[] = {
+      {
+          name,
+          strlen(name) + 1,
+          FS_NODE_NAME
+      }, {
+          NULL,
+          0,
+          FS_NODE_DATA
+      }
+  };
+
+  return fsNodeCreate(parent, desc, ARRAY_SIZE(desc));
+}
 /*----------------------------------------------------------------------------*/
 static void freeFillingNode(struct FsHandle *handle, const char *dir,
     size_t number)
@@ -63,6 +109,221 @@ static void insertFillingNode(struct FsHandle *handle, const char *dir,
   fsNodeFree(parent);
 }
 /*----------------------------------------------------------------------------*/
+static void readAlias(struct TestContext context, struct FsNode *parent,
+    char *alias)
+{
+  const struct VirtualMemRegion region =
+      vmemExtractNodeDataRegion(context.interface, parent, 0);
+  const struct DirEntryImage * const entries = (const struct DirEntryImage *)
+      (vmemGetAddress(context.interface) + region.begin);
+  bool lfn = false;
+
+  /* Short name entry of the first node with a long name is returned */
+  for (size_t i = 0; i < getMaxEntriesPerSector(); ++i)
+  {
+    const struct DirEntryImage * const entry = &entries[i];
+
+    if (!entry->filename[0])
+      break;
+
+    if ((entry->flags & MASK_LFN) == MASK_LFN)
+    {
+      lfn = entry->filename[0] != E_FLAG_EMPTY;
+    }
+    else
+    {
+      if (lfn && entry->filename[0] != E_FLAG_EMPTY)
+      {
+        memcpy(alias, entry->filename, NAME_LENGTH);
+        alias[NAME_LENGTH] = '\0';
+        return;
+      }
+
+      lfn = false;
+    }
+  }
+
+  ck_assert_msg(false, "Alias not found");
+}
+/*----------------------------------------------------------------------------*/
+START_TEST(testAliasCollisions)
+{
+  static const char longName[] = "long file name.txt";
+  static const char longPath[] = PATH_HOME_USER "/aliases/long file name.txt";
+
+  struct TestContext context = makeTestHandle();
+  char alias[NAME_LENGTH + 1];
+  enum Result res;
+
+  makeNode(context.handle, PATH_HOME_USER "/aliases", true, false);
+
+  struct FsNode * const parent = fsOpenNode(context.handle,
+      PATH_HOME_USER "/aliases");
+  ck_assert_ptr_nonnull(parent);
+
+  res = createEmptyNode(parent, longName);
+  ck_assert_uint_eq(res, E_OK);
+  readAlias(context, parent, alias);
+  freeNode(context.handle, longPath);
+
+#ifdef CONFIG_HASHED_ALIASES
+  /* Two characters of the basis, hash of the long name and numeric tail */
+  ck_assert_mem_eq(alias, "LO", ALIAS_PREFIX_LENGTH);
+  for (size_t i = ALIAS_PREFIX_LENGTH; i < ALIAS_PREFIX_LENGTH + 4; ++i)
+    ck_assert_ptr_nonnull(strchr("0123456789ABCDEF", alias[i]));
+  ck_assert_str_eq(alias + ALIAS_PREFIX_LENGTH + 4, "~1TXT");
+
+  const int basisLength = ALIAS_PREFIX_LENGTH + 4;
+  const size_t count = getMaxSimilarAliasesCount();
+
+  for (size_t i = 1; i < count; ++i)
+  {
+    char name[NAME_LENGTH + 2];
+
+    /* Existing short names occupy the lowest numeric tails */
+    sprintf(name, "%.*s~%u.TXT", basisLength, alias, (unsigned int)i);
+    res = createEmptyNode(parent, name);
+    ck_assert_uint_eq(res, E_OK);
+
+    res = createEmptyNode(parent, longName);
+
+    if (i == count - 1)
+    {
+      /* All numeric tails of the hashed alias are used */
+      ck_assert_uint_eq(res, E_EXIST);
+    }
+    else
+    {
+      ck_assert_uint_eq(res, E_OK);
+      readAlias(context, parent, name);
+      ck_assert_mem_eq(name, alias, basisLength);
+      ck_assert_uint_eq(name[basisLength + 1] - '0', i + 1);
+      freeNode(context.handle, longPath);
+    }
+  }
+
+  fsNodeFree(parent);
+
+  for (size_t i = 1; i < count; ++i)
+  {
+    char path[128];
+
+    sprintf(path, "%s/aliases/%.*s~%u.TXT", PATH_HOME_USER, basisLength,
+        alias, (unsigned int)i);
+    freeNode(context.handle, path);
+  }
+#else
+  /* Numeric tail is omitted when the basis is unique */
+  ck_assert_str_eq(alias, "LONGFILETXT");
+
+  /* Existing short name with the same basis */
+  res = createEmptyNode(parent, "LONGFILE.TXT");
+  ck_assert_uint_eq(res, E_OK);
+  res = createEmptyNode(parent, longName);
+  ck_assert_uint_eq(res, E_OK);
+  readAlias(context, parent, alias);
+  ck_assert_str_eq(alias, "LONGFI~1TXT");
+
+  fsNodeFree(parent);
+
+  freeNode(context.handle, longPath);
+  freeNode(context.handle, PATH_HOME_USER "/aliases/LONGFILE.TXT");
+#endif
+
+  /* Release all resources */
+  freeNode(context.handle, PATH_HOME_USER "/aliases");
+  freeTestHandle(context);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
+START_TEST(testBatchSimilarNames)
+{
+  static const char * const names[] = {
+      "filename_a.txt",
+      "filename_b.txt",
+      "filename_c.txt"
+  };
+
+  struct TestContext context = makeTestHandle();
+  const size_t entriesPerCluster = getMaxEntriesPerCluster(context.handle);
+  const size_t similar = getMaxSimilarNamesCount() - 2;
+  char path[128];
+  enum Result res;
+
+  for (size_t i = 0; i < similar; ++i)
+    insertFillingNode(context.handle, PATH_SYS, i);
+
+  struct FsNode * const parent = fsOpenNode(context.handle, PATH_SYS);
+  ck_assert_ptr_nonnull(parent);
+
+  /* Free entries at the end of the directory fit two nodes of the batch */
+  const size_t used = 2 + similar * 3;
+  const size_t padding =
+      (entriesPerCluster * 2 - used % entriesPerCluster - 6)
+      % entriesPerCluster;
+
+  for (size_t i = 0; i < padding; ++i)
+  {
+    sprintf(path, "P_%05u.TXT", (unsigned int)i);
+    res = createEmptyNode(parent, path);
+    ck_assert_uint_eq(res, E_OK);
+  }
+
+  struct FsFieldDescriptor desc[ARRAY_SIZE(names) * 2];
+  struct Fat32NodeFields nodes[ARRAY_SIZE(names)];
+
+  for (size_t i = 0; i < ARRAY_SIZE(names); ++i)
+  {
+    desc[i * 2] = (struct FsFieldDescriptor){
+        names[i],
+        strlen(names[i]) + 1,
+        FS_NODE_NAME
+    };
+    desc[i * 2 + 1] = (struct FsFieldDescriptor){
+        NULL,
+        0,
+        FS_NODE_DATA
+    };
+    nodes[i] = (struct Fat32NodeFields){&desc[i * 2], 2};
+  }
+
+  size_t created;
+
+#ifdef CONFIG_HASHED_ALIASES
+  /* Aliases do not depend on the number of similar names */
+  res = fat32CreateNodes(parent, nodes, ARRAY_SIZE(nodes), &created);
+  ck_assert_uint_eq(res, E_OK);
+  ck_assert_uint_eq(created, ARRAY_SIZE(nodes));
+#else
+  /* Last node collides with the preceding nodes of the same batch */
+  vmemAddMarkedRegion(context.interface,
+      vmemExtractTableRegion(context.interface, 0), true, false, true);
+  res = fat32CreateNodes(parent, nodes, ARRAY_SIZE(nodes), &created);
+  ck_assert_uint_eq(res, E_EXIST);
+  ck_assert_uint_eq(created, ARRAY_SIZE(nodes) - 1);
+  vmemClearRegions(context.interface);
+#endif
+
+  fsNodeFree(parent);
+
+  /* Release all resources */
+  for (size_t i = 0; i < created; ++i)
+  {
+    sprintf(path, "%s/%s", PATH_SYS, names[i]);
+    freeNode(context.handle, path);
+  }
+  for (size_t i = 0; i < padding; ++i)
+  {
+    sprintf(path, "%s/P_%05u.TXT", PATH_SYS, (unsigned int)i);
+    freeNode(context.handle, path);
+  }
+  for (size_t i = 0; i < similar; ++i)
+    freeFillingNode(context.handle, PATH_SYS, i);
+
+  freeTestHandle(context);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
 START_TEST(testDirOverflow)
 {
   struct TestContext context = makeTestHandle();
@@ -89,16 +350,25 @@ START_TEST(testDirOverflow)
     };
     const enum Result res = fsNodeCreate(parent, desc, ARRAY_SIZE(desc));
 
+#ifdef CONFIG_HASHED_ALIASES
+    /* Aliases do not depend on the number of similar names */
+    ck_assert_uint_eq(res, E_OK);
+#else
     if (i == getMaxSimilarNamesCount())
       ck_assert_uint_eq(res, E_EXIST);
     else
       ck_assert_uint_eq(res, E_OK);
+#endif
   }
 
   fsNodeFree(parent);
 
   /* Free temporary nodes */
+#ifdef CONFIG_HASHED_ALIASES
+  for (size_t i = 0; i <= getMaxSimilarNamesCount(); ++i)
+#else
   for (size_t i = 0; i < getMaxSimilarNamesCount(); ++i)
+#endif
     freeFillingNode(context.handle, PATH_SYS, i);
 
   /* Release all resources */
@@ -109,9 +379,16 @@ END_TEST
 START_TEST(testGapFind)
 {
   struct TestContext context = makeTestHandle();
-  const size_t maxEntryNumber =
+
+  /*
+   * Replaced nodes receive aliases with numbers following the largest
+   * existing number, therefore similar names are limited to a half of
+   * the alias limit. Nodes still span two clusters with large clusters.
+   */
+  const size_t maxEntryNumber = MIN(
       (getMaxEntriesPerCluster(context.handle) - 2) / 3
-      + getMaxEntriesPerCluster(context.handle);
+          + getMaxEntriesPerCluster(context.handle),
+      (getMaxSimilarNamesCount() - 1) / 2);
 
   for (size_t i = 0; i < maxEntryNumber; ++i)
     insertFillingNode(context.handle, PATH_SYS, i);
@@ -136,6 +413,51 @@ START_TEST(testGapFind)
 }
 END_TEST
 /*----------------------------------------------------------------------------*/
+START_TEST(testNameCache)
+{
+  static const char initialName[] = "initial long name.txt";
+  static const char renamedName[] = "renamed node with a longer long name.text";
+  static const char shortName[] = "SHORT.TXT";
+
+  struct TestContext context = makeTestHandle();
+  enum Result res;
+
+  makeNode(context.handle, PATH_HOME_USER "/initial long name.txt",
+      false, false);
+
+  struct FsNode * const parent = fsOpenNode(context.handle, PATH_HOME_USER);
+  ck_assert_ptr_nonnull(parent);
+  struct FsNode * const node = fsOpenNode(context.handle,
+      PATH_HOME_USER "/initial long name.txt");
+  ck_assert_ptr_nonnull(node);
+
+  checkNodeName(context, node, initialName);
+
+  /* Long name is replaced with a short name */
+  res = fat32MoveNode(parent, node, parent, shortName);
+  ck_assert_uint_eq(res, E_OK);
+  checkNodeName(context, node, shortName);
+
+  /* Short name is replaced with a long name */
+  res = fat32MoveNode(parent, node, parent, initialName);
+  ck_assert_uint_eq(res, E_OK);
+  checkNodeName(context, node, initialName);
+
+  /* Long name is replaced with another long name of a different length */
+  res = fat32MoveNode(parent, node, parent, renamedName);
+  ck_assert_uint_eq(res, E_OK);
+  checkNodeName(context, node, renamedName);
+
+  fsNodeFree(node);
+  fsNodeFree(parent);
+
+  /* Release all resources */
+  freeNode(context.handle,
+      PATH_HOME_USER "/renamed node with a longer long name.text");
+  freeTestHandle(context);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
 START_TEST(testNameOverflow)
 {
   char path[CONFIG_NAME_LENGTH];
@@ -450,8 +772,11 @@ int main(void)
   Suite * const suite = suite_create("UnicodeWrite");
   TCase * const testcase = tcase_create("Core");
 
+  tcase_add_test(testcase, testAliasCollisions);
+  tcase_add_test(testcase, testBatchSimilarNames);
   tcase_add_test(testcase, testDirOverflow);
   tcase_add_test(testcase, testGapFind);
+  tcase_add_test(testcase, testNameCache);
   tcase_add_test(testcase, testNameOverflow);
   tcase_add_test(testcase, testNameWithoutExtension);
   tcase_add_test(testcase, testNameWithSpaces);
@@ -10,6 +10,8 @@
 #include <xcore/fs/utils.h>
 #include <check.h>
 /*----------------------------------------------------------------------------*/
+#if FS_CLUSTER_SIZE > CONFIG_SECTOR_SIZE
+/* Second sector of the directory should be located in the first cluster */
 START_TEST(testNameAllocationError0)
 {
   static const char path[] = PATH_SYS "/output file.txt";
@@ -49,6 +51,7 @@ START_TEST(testNameAllocationError0)
   freeFillingNodes(context.handle, PATH_SYS, getMaxEntriesPerSector() - 3);
   freeTestHandle(context);
 }
+#endif
 /*----------------------------------------------------------------------------*/
 START_TEST(testNameAllocationError1)
 {
@@ -135,7 +138,9 @@ int main(void)
   Suite * const suite = suite_create("UnicodeWriteFailures");
   TCase * const testcase = tcase_create("Core");
 
+#if FS_CLUSTER_SIZE > CONFIG_SECTOR_SIZE
   tcase_add_test(testcase, testNameAllocationError0);
+#endif
   tcase_add_test(testcase, testNameAllocationError1);
   tcase_add_test(testcase, testNameAllocationError2);
   suite_add_tcase(suite, testcase);
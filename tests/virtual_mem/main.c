@@ -96,6 +96,67 @@ START_TEST(testInterfaceParams)
 }
 END_TEST
 /*----------------------------------------------------------------------------*/
+START_TEST(testLatencyModel)
+{
+  static const uint64_t position = 4 * CONFIG_SECTOR_SIZE;
+  static const uint64_t unaligned = 5 * CONFIG_SECTOR_SIZE;
+  static const struct VirtualMemConfig vmemConfig = {
+      .size = FS_TOTAL_SIZE,
+      .latency = 1000,
+      .bandwidth = 1000000000,
+      .block = 4 * CONFIG_SECTOR_SIZE,
+      .rewrite = 100000
+  };
+
+  struct Interface * const vmem = init(VirtualMem, &vmemConfig);
+  ck_assert_ptr_nonnull(vmem);
+
+  struct VirtualMemStats stats;
+  size_t count;
+  enum Result res;
+  uint8_t * const buffer = malloc(4 * CONFIG_SECTOR_SIZE);
+  ck_assert_ptr_nonnull(buffer);
+
+  /* Command overhead and transfer time */
+  res = ifSetParam(vmem, IF_POSITION_64, &position);
+  ck_assert_uint_eq(res, E_OK);
+  count = ifRead(vmem, buffer, CONFIG_SECTOR_SIZE);
+  ck_assert_uint_eq(count, CONFIG_SECTOR_SIZE);
+  vmemGetStats(vmem, &stats);
+  ck_assert_uint_eq(stats.time, 1000 + CONFIG_SECTOR_SIZE);
+  vmemResetStats(vmem);
+
+  /* Whole erase block is written without a penalty */
+  res = ifSetParam(vmem, IF_POSITION_64, &position);
+  ck_assert_uint_eq(res, E_OK);
+  count = ifWrite(vmem, buffer, 4 * CONFIG_SECTOR_SIZE);
+  ck_assert_uint_eq(count, 4 * CONFIG_SECTOR_SIZE);
+  vmemGetStats(vmem, &stats);
+  ck_assert_uint_eq(stats.time, 1000 + 4 * CONFIG_SECTOR_SIZE);
+  vmemResetStats(vmem);
+
+  /* Partial write inside of one erase block */
+  res = ifSetParam(vmem, IF_POSITION_64, &position);
+  ck_assert_uint_eq(res, E_OK);
+  count = ifWrite(vmem, buffer, CONFIG_SECTOR_SIZE);
+  ck_assert_uint_eq(count, CONFIG_SECTOR_SIZE);
+  vmemGetStats(vmem, &stats);
+  ck_assert_uint_eq(stats.time, 1000 + CONFIG_SECTOR_SIZE + 100000);
+  vmemResetStats(vmem);
+
+  /* Unaligned write touches two erase blocks partially */
+  res = ifSetParam(vmem, IF_POSITION_64, &unaligned);
+  ck_assert_uint_eq(res, E_OK);
+  count = ifWrite(vmem, buffer, 4 * CONFIG_SECTOR_SIZE);
+  ck_assert_uint_eq(count, 4 * CONFIG_SECTOR_SIZE);
+  vmemGetStats(vmem, &stats);
+  ck_assert_uint_eq(stats.time, 1000 + 4 * CONFIG_SECTOR_SIZE + 200000);
+
+  free(buffer);
+  deinit(vmem);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
 START_TEST(testMatchSkip)
 {
   static const uint64_t position = CONFIG_SECTOR_SIZE;
@@ -150,6 +211,107 @@ START_TEST(testMatchSkip)
 }
 END_TEST
 /*----------------------------------------------------------------------------*/
+START_TEST(testStalls)
+{
+  static const uint64_t position = 0;
+  static const struct VirtualMemConfig vmemConfig = {
+      .size = FS_TOTAL_SIZE,
+      .stallRate = 1000000,
+      .stall = 50000
+  };
+
+  struct Interface * const vmem = init(VirtualMem, &vmemConfig);
+  ck_assert_ptr_nonnull(vmem);
+
+  struct VirtualMemStats stats;
+  size_t count;
+  enum Result res;
+  char buffer[MAX_BUFFER_LENGTH] = {0};
+
+  /* Reads are not affected by stalls */
+  res = ifSetParam(vmem, IF_POSITION_64, &position);
+  ck_assert_uint_eq(res, E_OK);
+  count = ifRead(vmem, buffer, sizeof(buffer));
+  ck_assert_uint_eq(count, sizeof(buffer));
+  vmemGetStats(vmem, &stats);
+  ck_assert_uint_eq(stats.time, 0);
+
+  /* Every write stalls with the maximum probability */
+  for (size_t i = 0; i < 4; ++i)
+  {
+    res = ifSetParam(vmem, IF_POSITION_64, &position);
+    ck_assert_uint_eq(res, E_OK);
+    count = ifWrite(vmem, buffer, sizeof(buffer));
+    ck_assert_uint_eq(count, sizeof(buffer));
+  }
+
+  vmemGetStats(vmem, &stats);
+  ck_assert_uint_eq(stats.time, 4 * 50000);
+
+  deinit(vmem);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
+START_TEST(testStatistics)
+{
+  static const uint64_t position = CONFIG_SECTOR_SIZE;
+  static const struct VirtualMemConfig vmemConfig = {
+      .size = FS_TOTAL_SIZE
+  };
+
+  struct Interface * const vmem = init(VirtualMem, &vmemConfig);
+  ck_assert_ptr_nonnull(vmem);
+
+  struct VirtualMemStats stats;
+  size_t count;
+  enum Result res;
+  char buffer[MAX_BUFFER_LENGTH] = {0};
+
+  /* Counters are cleared after initialization */
+  vmemGetStats(vmem, &stats);
+  ck_assert_uint_eq(stats.reads, 0);
+  ck_assert_uint_eq(stats.writes, 0);
+
+  res = ifSetParam(vmem, IF_POSITION_64, &position);
+  ck_assert_uint_eq(res, E_OK);
+  count = ifWrite(vmem, buffer, sizeof(buffer));
+  ck_assert_uint_eq(count, sizeof(buffer));
+  res = ifSetParam(vmem, IF_POSITION_64, &position);
+  ck_assert_uint_eq(res, E_OK);
+  count = ifRead(vmem, buffer, sizeof(buffer) / 2);
+  ck_assert_uint_eq(count, sizeof(buffer) / 2);
+  count = ifRead(vmem, buffer, sizeof(buffer) / 2);
+  ck_assert_uint_eq(count, sizeof(buffer) / 2);
+
+  vmemGetStats(vmem, &stats);
+  ck_assert_uint_eq(stats.reads, 2);
+  ck_assert_uint_eq(stats.writes, 1);
+  ck_assert_uint_eq(stats.readBytes, sizeof(buffer));
+  ck_assert_uint_eq(stats.writtenBytes, sizeof(buffer));
+
+  /* Failed commands are not counted */
+  vmemAddMarkedRegion(vmem, vmemExtractInfoRegion(), false, false, true);
+  res = ifSetParam(vmem, IF_POSITION_64, &position);
+  ck_assert_uint_eq(res, E_OK);
+  count = ifRead(vmem, buffer, sizeof(buffer));
+  ck_assert_uint_eq(count, 0);
+  vmemClearRegions(vmem);
+
+  vmemGetStats(vmem, &stats);
+  ck_assert_uint_eq(stats.reads, 2);
+
+  vmemResetStats(vmem);
+  vmemGetStats(vmem, &stats);
+  ck_assert_uint_eq(stats.reads, 0);
+  ck_assert_uint_eq(stats.writes, 0);
+  ck_assert_uint_eq(stats.readBytes, 0);
+  ck_assert_uint_eq(stats.writtenBytes, 0);
+
+  /* Release resources */
+  deinit(vmem);
+}
+END_TEST
+/*----------------------------------------------------------------------------*/
 int main(void)
 {
   Suite * const suite = suite_create("VirtualMem");
@@ -157,7 +319,10 @@ int main(void)
 
   tcase_add_test(testcase, testAllocationErrors);
   tcase_add_test(testcase, testInterfaceParams);
+  tcase_add_test(testcase, testLatencyModel);
   tcase_add_test(testcase, testMatchSkip);
+  tcase_add_test(testcase, testStalls);
+  tcase_add_test(testcase, testStatistics);
   suite_add_tcase(suite, testcase);
 
   SRunner * const runner = srunner_create(suite);
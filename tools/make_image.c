@@ -0,0 +1,1023 @@
+/*
+ * make_image.c
+ * Copyright (C) 2026 xent
+ * Project is distributed under the terms of the MIT License
+ */
+
+#include "file_image.h"
+#include <yaf/fat32_defs.h>
+#include <yaf/fat32_helpers.h>
+#include <yaf/utils.h>
+#include <xcore/memory.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+/*----------------------------------------------------------------------------*/
+#ifdef CONFIG_CLUSTER_SIZE
+#  define TOOL_CLUSTER_SIZE   CONFIG_CLUSTER_SIZE
+#else
+#  define TOOL_CLUSTER_SIZE   4096
+#endif
+
+#define TOOL_BUFFER_SIZE      (1024 * 1024)
+#define TOOL_MAX_INSTANCE     999999
+#define TOOL_TABLE_COUNT      2
+/*----------------------------------------------------------------------------*/
+struct ImageNode
+{
+  /* Path on the host */
+  char *path;
+  /* Name of the node, points to the last component of the path */
+  const char *name;
+  /* Payload length of the file or length of the directory entries */
+  uint64_t size;
+  /* Modification time */
+  time64_t time;
+
+  /* First cluster of the payload, zero for empty files */
+  uint32_t cluster;
+  /* Length of the contiguous cluster run */
+  uint32_t clusters;
+
+  /* Parent directory index */
+  size_t parent;
+  /* Range of child indices of a directory */
+  size_t first;
+  size_t count;
+
+  /* Short name with extension */
+  char shortName[NAME_LENGTH];
+  /* Number of LFN entries */
+  uint8_t chunks;
+  bool directory;
+  bool writable;
+};
+
+struct ImageTree
+{
+  struct ImageNode *nodes;
+  size_t capacity;
+  size_t count;
+};
+
+/* Write-behind buffer that turns small writes into long sequential commands */
+struct ImageStream
+{
+  struct Interface *interface;
+  uint8_t *buffer;
+  size_t capacity;
+  size_t length;
+  uint64_t position;
+};
+
+struct ImageLayout
+{
+  uint64_t tableSector;
+  uint64_t dataSector;
+  uint32_t clusterCount;
+  uint32_t infoSector;
+  uint32_t sectorsPerTable;
+  uint8_t tableCount;
+};
+/*----------------------------------------------------------------------------*/
+static int compareNames(const void *, const void *);
+static bool isLongNameValid(const char *);
+static size_t hashShortName(const char *);
+static bool insertShortName(const struct ImageTree *, size_t *, size_t,
+    size_t);
+static void makeAlias(char *, const char *, unsigned int);
+static bool parseSize(uint64_t *, const char *);
+static void usage(const char *);
+
+static bool appendNode(struct ImageTree *, const char *, const char *, size_t);
+static bool assignShortNames(struct ImageTree *, size_t);
+static uint32_t planLayout(struct ImageTree *, size_t, bool);
+static bool readLayout(struct Interface *, size_t, struct ImageLayout *);
+static bool scanTree(struct ImageTree *);
+
+static bool streamFile(struct ImageStream *, const struct ImageNode *);
+static bool streamFlush(struct ImageStream *);
+static bool streamSeek(struct ImageStream *, uint64_t);
+static bool streamWrite(struct ImageStream *, const void *, size_t);
+static bool streamZero(struct ImageStream *, size_t);
+
+static bool writeData(struct ImageStream *, const struct ImageTree *,
+    const struct ImageLayout *, size_t, const char *);
+static bool writeDirectory(struct ImageStream *, const struct ImageTree *,
+    size_t, const char *);
+static bool writeInfo(struct Interface *, const struct ImageLayout *,
+    uint32_t);
+static bool writeTables(struct ImageStream *, const struct ImageTree *,
+    const struct ImageLayout *);
+/*----------------------------------------------------------------------------*/
+/* Names that differ only in case become adjacent */
+static int compareNames(const void *a, const void *b)
+{
+  const char * const left = *(const char * const *)a;
+  const char * const right = *(const char * const *)b;
+  const int result = strcasecmp(left, right);
+
+  return result ? result : strcmp(left, right);
+}
+/*----------------------------------------------------------------------------*/
+static bool isLongNameValid(const char *name)
+{
+  for (; *name != '\0'; ++name)
+  {
+    const uint8_t c = (uint8_t)*name;
+
+    if (c < 0x20 || strchr("\"*/:<>?\\|", c) != NULL)
+      return false;
+  }
+
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+static size_t hashShortName(const char *shortName)
+{
+  uint32_t hash = 0x811C9DC5UL;
+
+  for (size_t i = 0; i < NAME_LENGTH; ++i)
+  {
+    hash ^= (uint8_t)shortName[i];
+    hash *= 0x01000193UL;
+  }
+
+  return hash;
+}
+/*----------------------------------------------------------------------------*/
+/* Add the short name of a node to the open addressing table of a directory */
+static bool insertShortName(const struct ImageTree *tree, size_t *table,
+    size_t mask, size_t index)
+{
+  const char * const shortName = tree->nodes[index].shortName;
+  size_t position = hashShortName(shortName) & mask;
+
+  /* Indices are stored with an offset, zero marks an empty slot */
+  while (table[position])
+  {
+    const size_t current = table[position] - 1;
+
+    if (!memcmp(tree->nodes[current].shortName, shortName, NAME_LENGTH))
+      return false;
+    position = (position + 1) & mask;
+  }
+
+  table[position] = index + 1;
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+/* Replace the tail of the short name basis with a numeric tail */
+static void makeAlias(char *shortName, const char *basis, unsigned int instance)
+{
+  char baseName[BASENAME_LENGTH + 1];
+  char suffix[11];
+
+  memcpy(shortName, basis, NAME_LENGTH);
+  if (!instance)
+    return;
+
+  extractShortBasename(baseName, basis);
+
+  const size_t suffixLength = (size_t)sprintf(suffix, "%u", instance);
+  size_t baseLength = strlen(baseName);
+
+  if (baseLength > BASENAME_LENGTH - suffixLength - 1)
+    baseLength = BASENAME_LENGTH - suffixLength - 1;
+
+  memset(shortName + baseLength, ' ', BASENAME_LENGTH - baseLength);
+  shortName[baseLength] = '~';
+  memcpy(shortName + baseLength + 1, suffix, suffixLength);
+}
+/*----------------------------------------------------------------------------*/
+static bool parseSize(uint64_t *result, const char *text)
+{
+  char *end;
+  uint64_t value = strtoull(text, &end, 0);
+
+  switch (*end)
+  {
+    case 'G':
+      value <<= 10;
+      [[fallthrough]];
+    case 'M':
+      value <<= 10;
+      [[fallthrough]];
+    case 'K':
+      value <<= 10;
+      ++end;
+      break;
+
+    default:
+      break;
+  }
+
+  *result = value;
+  return end != text && *end == '\0';
+}
+/*----------------------------------------------------------------------------*/
+static void usage(const char *program)
+{
+  fprintf(stderr,
+      "Usage: %s [-a unit] [-c cluster] [-l label] [-s size] [-t tables]"
+      " SOURCE IMAGE\n"
+      "Create FAT32 image from the contents of SOURCE directory.\n"
+      "  -a  align tables and data region to the allocation unit size\n"
+      "  -c  cluster size in bytes, default is %u\n"
+      "  -l  volume label\n"
+      "  -s  create IMAGE file of the given size, suffixes K, M and G\n"
+      "      are allowed, otherwise IMAGE must exist\n"
+      "  -t  number of FAT copies, default is %u\n",
+      program, TOOL_CLUSTER_SIZE, TOOL_TABLE_COUNT);
+}
+/*----------------------------------------------------------------------------*/
+static bool appendNode(struct ImageTree *tree, const char *directory,
+    const char *name, size_t parent)
+{
+  if (tree->count == tree->capacity)
+  {
+    const size_t capacity = tree->capacity ? tree->capacity * 2 : 64;
+    struct ImageNode * const nodes =
+        realloc(tree->nodes, capacity * sizeof(struct ImageNode));
+
+    if (nodes == NULL)
+      return false;
+
+    tree->nodes = nodes;
+    tree->capacity = capacity;
+  }
+
+  struct ImageNode * const node = &tree->nodes[tree->count];
+  const size_t length = strlen(directory) + strlen(name) + 2;
+
+  memset(node, 0, sizeof(*node));
+  node->parent = parent;
+
+  if ((node->path = malloc(length)) == NULL)
+    return false;
+
+  if (*name != '\0')
+  {
+    sprintf(node->path, "%s/%s", directory, name);
+    node->name = node->path + strlen(directory) + 1;
+  }
+  else
+  {
+    strcpy(node->path, directory);
+    node->name = node->path + strlen(node->path);
+  }
+
+  struct stat info;
+
+  if (stat(node->path, &info) != 0)
+  {
+    fprintf(stderr, "%s: status is unavailable\n", node->path);
+    free(node->path);
+    return false;
+  }
+
+  node->directory = S_ISDIR(info.st_mode);
+  node->writable = (info.st_mode & S_IWUSR) != 0;
+  node->time = (time64_t)info.st_mtime * 1000000;
+
+  if (!node->directory)
+  {
+    if (!S_ISREG(info.st_mode) || (uint64_t)info.st_size > UINT32_MAX)
+    {
+      fprintf(stderr, "%s: unsupported file\n", node->path);
+      free(node->path);
+      return false;
+    }
+    node->size = (uint64_t)info.st_size;
+  }
+
+  ++tree->count;
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Short names of the directory are collected in a hash table. Names that
+ * fit into the short format are placed first, so that the generated aliases
+ * never collide with them.
+ */
+static bool assignShortNames(struct ImageTree *tree, size_t index)
+{
+  const struct ImageNode * const directory = &tree->nodes[index];
+  const size_t first = directory->first;
+  const size_t count = directory->count;
+  size_t mask = 15;
+
+  while (mask < count * 2)
+    mask = mask * 2 + 1;
+
+  size_t * const table = calloc(mask + 1, sizeof(size_t));
+  bool clean[count];
+
+  if (table == NULL)
+    return false;
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    struct ImageNode * const node = &tree->nodes[first + i];
+
+    clean[i] = fillShortName(node->shortName, node->name, !node->directory);
+    if (!clean[i])
+      continue;
+
+    if (!insertShortName(tree, table, mask, first + i))
+    {
+      /* Clean names may still collide, for example "A" file and "A." file */
+      clean[i] = false;
+    }
+  }
+
+  bool completed = true;
+
+  for (size_t i = 0; i < count && completed; ++i)
+  {
+    struct ImageNode * const node = &tree->nodes[first + i];
+
+    if (clean[i])
+      continue;
+
+    const size_t nameLength = uLengthToUtf16(node->name) + 1;
+
+    if (nameLength > CONFIG_NAME_LENGTH / 2 || !isLongNameValid(node->name))
+    {
+      fprintf(stderr, "%s: unsupported name\n", node->path);
+      completed = false;
+      break;
+    }
+
+    /* Append additional entry when last chunk is incomplete */
+    node->chunks = (uint8_t)((nameLength + LFN_ENTRY_LENGTH - 2)
+        / LFN_ENTRY_LENGTH);
+
+    char basis[NAME_LENGTH];
+
+    fillShortName(basis, node->name, !node->directory);
+#ifdef CONFIG_HASHED_ALIASES
+    fillHashedAlias(basis, node->name);
+#endif
+
+    unsigned int instance = 0;
+
+    do
+    {
+      if (instance > TOOL_MAX_INSTANCE)
+      {
+        fprintf(stderr, "%s: too many similar names\n", node->path);
+        completed = false;
+        break;
+      }
+
+      makeAlias(node->shortName, basis, instance++);
+    }
+    while (!insertShortName(tree, table, mask, first + i));
+  }
+
+  free(table);
+  return completed;
+}
+/*----------------------------------------------------------------------------*/
+/* Returns number of clusters used by the image */
+static uint32_t planLayout(struct ImageTree *tree, size_t clusterSize,
+    bool labeled)
+{
+  uint64_t next = CLUSTER_OFFSET;
+
+  for (size_t i = 0; i < tree->count; ++i)
+  {
+    struct ImageNode * const node = &tree->nodes[i];
+    uint64_t length;
+
+    if (node->directory)
+    {
+      /* Dot entries in subdirectories or a volume label in the root */
+      size_t entries = i ? 2 : (labeled ? 1 : 0);
+
+      for (size_t j = node->first; j < node->first + node->count; ++j)
+        entries += tree->nodes[j].chunks + 1;
+
+      if (entries > 1 << 16)
+      {
+        fprintf(stderr, "%s: too many entries\n", node->path);
+        return UINT32_MAX;
+      }
+      node->size = (uint64_t)entries * sizeof(struct DirEntryImage);
+
+      /* Directories occupy at least one cluster */
+      length = node->size ? node->size : 1;
+    }
+    else
+      length = node->size;
+
+    node->clusters = (uint32_t)((length + clusterSize - 1) / clusterSize);
+    if (node->clusters)
+    {
+      node->cluster = (uint32_t)next;
+      next += node->clusters;
+    }
+
+    if (next > CLUSTER_EOC_VAL)
+      return UINT32_MAX;
+  }
+
+  return (uint32_t)(next - CLUSTER_OFFSET);
+}
+/*----------------------------------------------------------------------------*/
+static bool readLayout(struct Interface *interface, size_t clusterSize,
+    struct ImageLayout *layout)
+{
+  static const uint64_t bootPosition = 0;
+  struct BootSectorImage boot;
+
+  if (ifSetParam(interface, IF_POSITION_64, &bootPosition) != E_OK)
+    return false;
+  if (ifRead(interface, &boot, sizeof(boot)) != sizeof(boot))
+    return false;
+
+  const uint32_t reservedSectors = fromLittleEndian16(boot.reservedSectors);
+  const uint32_t sectorsPerPartition =
+      fromLittleEndian32(boot.sectorsPerPartition);
+
+  layout->tableCount = boot.tableCount;
+  layout->sectorsPerTable = fromLittleEndian32(boot.sectorsPerTable);
+  layout->infoSector = fromLittleEndian16(boot.infoSector);
+  layout->tableSector = reservedSectors;
+  layout->dataSector = reservedSectors
+      + (uint64_t)layout->sectorsPerTable * layout->tableCount;
+  layout->clusterCount = (uint32_t)((sectorsPerPartition - layout->dataSector)
+      / (clusterSize >> SECTOR_EXP));
+
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+/* Collect nodes in breadth-first order, children of a directory are adjacent */
+static bool scanTree(struct ImageTree *tree)
+{
+  for (size_t index = 0; index < tree->count; ++index)
+  {
+    if (!tree->nodes[index].directory)
+      continue;
+
+    DIR * const directory = opendir(tree->nodes[index].path);
+
+    if (directory == NULL)
+    {
+      fprintf(stderr, "%s: directory is unavailable\n",
+          tree->nodes[index].path);
+      return false;
+    }
+
+    const struct dirent *entry;
+    char **names = NULL;
+    size_t count = 0;
+    bool completed = true;
+
+    while ((entry = readdir(directory)) != NULL)
+    {
+      if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+        continue;
+
+      char ** const expanded = realloc(names, (count + 1) * sizeof(char *));
+
+      if (expanded == NULL || (expanded[count] = strdup(entry->d_name)) == NULL)
+      {
+        names = expanded != NULL ? expanded : names;
+        completed = false;
+        break;
+      }
+
+      names = expanded;
+      ++count;
+    }
+    closedir(directory);
+
+    /* Sorted names make images reproducible */
+    if (completed)
+    {
+      qsort(names, count, sizeof(char *), compareNames);
+
+      /* Names in the file system are case-insensitive */
+      for (size_t i = 1; i < count && completed; ++i)
+      {
+        if (!strcasecmp(names[i - 1], names[i]))
+        {
+          fprintf(stderr, "%s: names \"%s\" and \"%s\" are ambiguous\n",
+              tree->nodes[index].path, names[i - 1], names[i]);
+          completed = false;
+        }
+      }
+    }
+
+    tree->nodes[index].first = tree->count;
+    tree->nodes[index].count = count;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+      if (completed)
+      {
+        completed = appendNode(tree, tree->nodes[index].path, names[i],
+            index);
+      }
+      free(names[i]);
+    }
+    free(names);
+
+    if (!completed || !assignShortNames(tree, index))
+      return false;
+  }
+
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+static bool streamFile(struct ImageStream *stream, const struct ImageNode *node)
+{
+  const int descriptor = open(node->path, O_RDONLY);
+
+  if (descriptor == -1)
+  {
+    fprintf(stderr, "%s: file is unavailable\n", node->path);
+    return false;
+  }
+
+  uint64_t left = node->size;
+
+  /* File contents are read directly into the write-behind buffer */
+  while (left)
+  {
+    const size_t space = stream->capacity - stream->length;
+    const size_t chunk = left < space ? (size_t)left : space;
+    const ssize_t count = read(descriptor, stream->buffer + stream->length,
+        chunk);
+
+    if (count <= 0)
+    {
+      fprintf(stderr, "%s: file is truncated\n", node->path);
+      close(descriptor);
+      return false;
+    }
+
+    stream->length += (size_t)count;
+    left -= (uint64_t)count;
+
+    if (stream->length == stream->capacity && !streamFlush(stream))
+    {
+      close(descriptor);
+      return false;
+    }
+  }
+
+  close(descriptor);
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+static bool streamFlush(struct ImageStream *stream)
+{
+  if (!stream->length)
+    return true;
+
+  if (ifSetParam(stream->interface, IF_POSITION_64, &stream->position) != E_OK)
+    return false;
+  if (ifWrite(stream->interface, stream->buffer, stream->length)
+      != stream->length)
+  {
+    return false;
+  }
+
+  stream->position += stream->length;
+  stream->length = 0;
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+static bool streamSeek(struct ImageStream *stream, uint64_t position)
+{
+  if (!streamFlush(stream))
+    return false;
+
+  stream->position = position;
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+static bool streamWrite(struct ImageStream *stream, const void *data,
+    size_t count)
+{
+  const uint8_t *position = data;
+
+  while (count)
+  {
+    const size_t space = stream->capacity - stream->length;
+    const size_t chunk = count < space ? count : space;
+
+    memcpy(stream->buffer + stream->length, position, chunk);
+    stream->length += chunk;
+    position += chunk;
+    count -= chunk;
+
+    if (stream->length == stream->capacity && !streamFlush(stream))
+      return false;
+  }
+
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+static bool streamZero(struct ImageStream *stream, size_t count)
+{
+  while (count)
+  {
+    const size_t space = stream->capacity - stream->length;
+    const size_t chunk = count < space ? count : space;
+
+    memset(stream->buffer + stream->length, 0, chunk);
+    stream->length += chunk;
+    count -= chunk;
+
+    if (stream->length == stream->capacity && !streamFlush(stream))
+      return false;
+  }
+
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+/* Write payload of all nodes in a single pass in ascending cluster order */
+static bool writeData(struct ImageStream *stream, const struct ImageTree *tree,
+    const struct ImageLayout *layout, size_t clusterSize, const char *label)
+{
+  if (!streamSeek(stream, layout->dataSector << SECTOR_EXP))
+    return false;
+
+  for (size_t i = 0; i < tree->count; ++i)
+  {
+    const struct ImageNode * const node = &tree->nodes[i];
+    const uint64_t length = (uint64_t)node->clusters * clusterSize;
+
+    if (!node->clusters)
+      continue;
+
+    if (node->directory)
+    {
+      if (!writeDirectory(stream, tree, i, i ? NULL : label))
+        return false;
+    }
+    else
+    {
+      if (!streamFile(stream, node))
+        return false;
+    }
+
+    /* Unused space in the last cluster is cleared */
+    if (!streamZero(stream, (size_t)(length - node->size)))
+      return false;
+  }
+
+  return streamFlush(stream);
+}
+/*----------------------------------------------------------------------------*/
+static bool writeDirectory(struct ImageStream *stream,
+    const struct ImageTree *tree, size_t index, const char *label)
+{
+  const struct ImageNode * const directory = &tree->nodes[index];
+  struct DirEntryImage entry;
+
+  if (index)
+  {
+    const struct ImageNode * const parent = &tree->nodes[directory->parent];
+
+    /* Current directory entry . */
+    memset(&entry, 0, sizeof(entry));
+    memset(entry.filename, ' ', NAME_LENGTH);
+    entry.name[0] = '.';
+    fillDirEntry(&entry, true, FS_ACCESS_READ | FS_ACCESS_WRITE,
+        directory->cluster, directory->time);
+    if (!streamWrite(stream, &entry, sizeof(entry)))
+      return false;
+
+    /* Parent directory entry .., root is referenced as cluster zero */
+    entry.name[1] = '.';
+    fillDirEntry(&entry, true, FS_ACCESS_READ | FS_ACCESS_WRITE,
+        directory->parent ? parent->cluster : 0, parent->time);
+    if (!streamWrite(stream, &entry, sizeof(entry)))
+      return false;
+  }
+  else if (label != NULL)
+  {
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.filename, label, strlen(label));
+    entry.flags = FLAG_VOLUME;
+    if (!streamWrite(stream, &entry, sizeof(entry)))
+      return false;
+  }
+
+  for (size_t i = directory->first; i < directory->first + directory->count;
+      ++i)
+  {
+    const struct ImageNode * const node = &tree->nodes[i];
+
+    if (node->chunks)
+    {
+      const uint8_t checksum = calcLongNameChecksum(node->shortName,
+          NAME_LENGTH);
+      const size_t nameLength = uLengthToUtf16(node->name) + 1;
+      char16_t nameBuffer[CONFIG_NAME_LENGTH / 2];
+
+      uToUtf16(nameBuffer, node->name, nameLength);
+
+      /* Long name entries are stored in reverse order */
+      for (size_t chunk = node->chunks; chunk; --chunk)
+      {
+        const size_t offset = (chunk - 1) * LFN_ENTRY_LENGTH;
+        const size_t left = nameLength - 1 - offset;
+
+        memset(&entry, 0, sizeof(entry));
+        fillLongName(&entry, nameBuffer + offset,
+            left > LFN_ENTRY_LENGTH ? LFN_ENTRY_LENGTH : left);
+        fillLongNameEntry(&entry, (uint8_t)chunk, node->chunks, checksum);
+        if (!streamWrite(stream, &entry, sizeof(entry)))
+          return false;
+      }
+    }
+
+    FsAccess access = FS_ACCESS_READ;
+
+    if (node->writable)
+      access |= FS_ACCESS_WRITE;
+
+    memset(&entry, 0, sizeof(entry));
+    fillDirEntry(&entry, node->directory, access, node->cluster, node->time);
+    if (!node->directory)
+      entry.size = toLittleEndian32((uint32_t)node->size);
+    memcpy(entry.filename, node->shortName, NAME_LENGTH);
+    if (!streamWrite(stream, &entry, sizeof(entry)))
+      return false;
+  }
+
+  return true;
+}
+/*----------------------------------------------------------------------------*/
+static bool writeInfo(struct Interface *interface,
+    const struct ImageLayout *layout, uint32_t used)
+{
+  const uint64_t position = (uint64_t)layout->infoSector << SECTOR_EXP;
+  struct InfoSectorImage info;
+
+  if (ifSetParam(interface, IF_POSITION_64, &position) != E_OK)
+    return false;
+  if (ifRead(interface, &info, sizeof(info)) != sizeof(info))
+    return false;
+
+  info.freeClusters = toLittleEndian32(layout->clusterCount - used);
+  info.lastAllocated = toLittleEndian32(CLUSTER_OFFSET + used - 1);
+
+  if (ifSetParam(interface, IF_POSITION_64, &position) != E_OK)
+    return false;
+  return ifWrite(interface, &info, sizeof(info)) == sizeof(info);
+}
+/*----------------------------------------------------------------------------*/
+/*
+ * Every node occupies a contiguous run of clusters, therefore each table
+ * is a sequence of incrementing links with end-of-chain markers. Tables
+ * were cleared during formatting and only the used part is written.
+ */
+static bool writeTables(struct ImageStream *stream,
+    const struct ImageTree *tree, const struct ImageLayout *layout)
+{
+  for (size_t fat = 0; fat < layout->tableCount; ++fat)
+  {
+    static const uint32_t pattern[] = {
+        TO_LITTLE_ENDIAN_32(CLUSTER_EOC_VAL),
+        TO_LITTLE_ENDIAN_32(CLUSTER_RES_VAL)
+    };
+    const uint64_t sector = layout->tableSector
+        + (uint64_t)layout->sectorsPerTable * fat;
+    uint64_t written = sizeof(pattern);
+
+    if (!streamSeek(stream, sector << SECTOR_EXP))
+      return false;
+    if (!streamWrite(stream, pattern, sizeof(pattern)))
+      return false;
+
+    for (size_t i = 0; i < tree->count; ++i)
+    {
+      const struct ImageNode * const node = &tree->nodes[i];
+
+      for (uint32_t j = 1; j <= node->clusters; ++j)
+      {
+        const uint32_t next = j < node->clusters ?
+            node->cluster + j : CLUSTER_EOC_VAL;
+        const uint32_t value = toLittleEndian32(next);
+
+        if (!streamWrite(stream, &value, sizeof(value)))
+          return false;
+      }
+      written += (uint64_t)node->clusters * sizeof(uint32_t);
+    }
+
+    /* Commands are aligned to sector boundaries */
+    const size_t padding = (size_t)(-written & ((1 << SECTOR_EXP) - 1));
+
+    if (!streamZero(stream, padding))
+      return false;
+  }
+
+  return streamFlush(stream);
+}
+/*----------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+  const char *label = NULL;
+  uint64_t alignment = 0;
+  uint64_t imageSize = 0;
+  size_t clusterSize = TOOL_CLUSTER_SIZE;
+  size_t tableCount = TOOL_TABLE_COUNT;
+  int option;
+
+  while ((option = getopt(argc, argv, "a:c:l:s:t:")) != -1)
+  {
+    uint64_t value;
+
+    switch (option)
+    {
+      case 'a':
+        if (!parseSize(&alignment, optarg)
+            || (alignment & ((1 << SECTOR_EXP) - 1)))
+        {
+          fprintf(stderr, "Incorrect allocation unit size\n");
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'c':
+        if (!parseSize(&value, optarg) || value < (1 << SECTOR_EXP)
+            || value > 65536 || (value & (value - 1)))
+        {
+          fprintf(stderr, "Incorrect cluster size\n");
+          return EXIT_FAILURE;
+        }
+#ifdef CONFIG_CLUSTER_SIZE
+        /* Library with a fixed cluster size mounts only such volumes */
+        if (value != CONFIG_CLUSTER_SIZE)
+        {
+          fprintf(stderr, "Cluster size is fixed to %u bytes\n",
+              (unsigned int)CONFIG_CLUSTER_SIZE);
+          return EXIT_FAILURE;
+        }
+#endif
+        clusterSize = (size_t)value;
+        break;
+
+      case 'l':
+        if (strlen(optarg) > NAME_LENGTH)
+        {
+          fprintf(stderr, "Incorrect volume label\n");
+          return EXIT_FAILURE;
+        }
+        label = optarg;
+        break;
+
+      case 's':
+        if (!parseSize(&imageSize, optarg) || !imageSize)
+        {
+          fprintf(stderr, "Incorrect image size\n");
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 't':
+        if (!parseSize(&value, optarg) || !value || value > 2)
+        {
+          fprintf(stderr, "Incorrect number of tables\n");
+          return EXIT_FAILURE;
+        }
+        tableCount = (size_t)value;
+        break;
+
+      default:
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (argc - optind != 2)
+  {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const char * const sourcePath = argv[optind];
+  const char * const imagePath = argv[optind + 1];
+
+  /* Plan the whole layout before any write to the image */
+  struct ImageTree tree = {NULL, 0, 0};
+  uint8_t *buffer = NULL;
+  struct Interface *image = NULL;
+  bool completed = false;
+  uint32_t used = UINT32_MAX;
+
+  if (!appendNode(&tree, sourcePath, "", 0) || !tree.nodes[0].directory)
+  {
+    fprintf(stderr, "%s: source is not a directory\n", sourcePath);
+    goto exit;
+  }
+  if (!scanTree(&tree))
+    goto exit;
+
+  if ((used = planLayout(&tree, clusterSize, label != NULL)) == UINT32_MAX)
+  {
+    fprintf(stderr, "Source tree is too large\n");
+    goto exit;
+  }
+
+  if (imageSize)
+  {
+    const int descriptor = open(imagePath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (descriptor == -1 || ftruncate(descriptor, (off_t)imageSize) != 0)
+    {
+      fprintf(stderr, "%s: image file is unavailable\n", imagePath);
+      if (descriptor != -1)
+        close(descriptor);
+      goto exit;
+    }
+    close(descriptor);
+  }
+
+  const struct FileImageConfig imageConfig = {
+      .path = imagePath
+  };
+
+  if ((image = init(FileImage, &imageConfig)) == NULL)
+  {
+    fprintf(stderr, "%s: image is unavailable\n", imagePath);
+    goto exit;
+  }
+
+  if ((buffer = malloc(TOOL_BUFFER_SIZE)) == NULL)
+    goto exit;
+
+  /* Newly created image file reads as zeros */
+  const struct Fat32FsConfig fsConfig = {
+      .cluster = clusterSize,
+      .alignment = (size_t)alignment,
+      .tables = tableCount,
+      .label = label,
+      .erased = imageSize != 0
+  };
+
+  if (fat32MakeFs(image, &fsConfig, buffer, TOOL_BUFFER_SIZE) != E_OK)
+  {
+    fprintf(stderr, "%s: formatting failed\n", imagePath);
+    goto exit;
+  }
+
+  struct ImageLayout layout;
+
+  if (!readLayout(image, clusterSize, &layout))
+  {
+    fprintf(stderr, "%s: boot sector is unavailable\n", imagePath);
+    goto exit;
+  }
+  if (used > layout.clusterCount)
+  {
+    fprintf(stderr, "%s: image is too small, %" PRIu32 " clusters required\n",
+        imagePath, used);
+    goto exit;
+  }
+
+  struct ImageStream stream = {
+      .interface = image,
+      .buffer = buffer,
+      .capacity = TOOL_BUFFER_SIZE,
+      .length = 0,
+      .position = 0
+  };
+
+  if (!writeTables(&stream, &tree, &layout)
+      || !writeData(&stream, &tree, &layout, clusterSize, label)
+      || !writeInfo(image, &layout, used))
+  {
+    fprintf(stderr, "%s: write failed\n", imagePath);
+    goto exit;
+  }
+
+  printf("%zu nodes, %" PRIu32 " of %" PRIu32 " clusters used\n",
+      tree.count, used, layout.clusterCount);
+  completed = true;
+
+exit:
+  if (image != NULL)
+    deinit(image);
+  free(buffer);
+
+  for (size_t i = 0; i < tree.count; ++i)
+    free(tree.nodes[i].path);
+  free(tree.nodes);
+
+  return completed ? EXIT_SUCCESS : EXIT_FAILURE;
+}